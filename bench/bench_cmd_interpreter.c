@@ -0,0 +1,86 @@
+// uvscpd - Minimalist VSCP Daemon
+// Copyright (C) 2019 Maarten Zanders
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+/* Commands per second through cmd_interpreter: pipelined batches of 'send'
+ * lines, as configuration tools send them, split over reads of 120 bytes. */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "cmd_interpreter.h"
+
+#define LINES 1000
+#define ROUNDS 1000
+#define READ_SIZE 120
+
+static unsigned long calls;
+
+static int do_count(void *obj, int argc, char *argv[]) {
+  calls += argc;
+  return 0;
+}
+
+/* the same names as the daemon's command table */
+static const cmd_interpreter_cmd_list_t commands[] = {
+    {"+", do_count},         {"noop", do_count},      {"quit", do_count},
+    {"user", do_count},      {"pass", do_count},      {"restart", do_count},
+    {"shutdown", do_count},  {"send", do_count},      {"retr", do_count},
+    {"rcvloop", do_count},   {"quitloop", do_count},  {"cdta", do_count},
+    {"checkdata", do_count}, {"clra", do_count},      {"ggid", do_count},
+    {"getguid", do_count},   {"sgid", do_count},      {"setguid", do_count},
+    {"wcyd", do_count},      {"whatcanyoudo", do_count},
+    {"vers", do_count},      {"version", do_count},   {"stat", do_count},
+    {"info", do_count},      {"chid", do_count},      {"sflt", do_count},
+    {"setfilter", do_count}, {"smsk", do_count},      {"setmask", do_count},
+    {"interface", do_count}};
+
+int main(void) {
+  static char input[LINES * 80];
+  cmd_interpreter_ctx_t *ctx;
+  struct timespec start, end;
+  size_t length = 0, offset;
+  char *p;
+  double seconds;
+  int i, n;
+
+  for (i = 0; i < LINES; i++)
+    length += sprintf(input + length,
+                      "send 0,20,3,0,,0,-,0x%02X,0x%02X,0x%02X\r\n", i & 0xFF,
+                      (i >> 8) & 0xFF, i % 7);
+
+  ctx = cmd_interpreter_ctx_create(
+      commands, sizeof(commands) / sizeof(commands[0]), 10, 1, 320, " ");
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (n = 0; n < ROUNDS; n++) {
+    for (offset = 0; offset < length; offset += READ_SIZE) {
+      size_t chunk = length - offset < READ_SIZE ? length - offset : READ_SIZE;
+      p = input + offset;
+      while (cmd_interpreter_process(ctx, &p, chunk - (p - (input + offset)),
+                                     NULL) != CMD_INTERPRETER_NO_MORE_DATA)
+        ;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("cmd_interpreter: %.0f commands/s (%lu arguments seen)\n",
+         (double)LINES * ROUNDS / seconds, calls);
+  cmd_interpreter_free(ctx);
+  return 0;
+}
@@ -0,0 +1,730 @@
+// uvscpd - Minimalist VSCP Daemon
+// Copyright (C) 2019 Maarten Zanders
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+/* The daemon end to end: frames enter through a bus backend at a steady
+ * rate and leave to clients in rcvloop and to clients polling with retr.
+ * It starts uvscpd on a port of its own and reports, as one JSON object on
+ * stdout:
+ *  - the rate the frames were received on the bus, and written to clients
+ *  - latency percentiles from reception on the bus to the client reading
+ *    the event: the timestamp field of the event against the clock of the
+ *    same host. For retr clients this includes waiting for the next poll.
+ *  - CPU time of the daemon for each frame
+ *  - frames a client never got, and got twice
+ * The frames come from a candump log written for the replay backend, from
+ * a client sending them on the loopback backend, or are written to the
+ * (v)can interface the daemon is started on.
+ *
+ *   bench_load [-b replay|loopback|<interface>] [-r <frames/s>, 0: at once]
+ *              [-n <frames>] [-l <rcvloop clients>] [-t <retr clients>]
+ *              [-p <port>] [-u <uvscpd>] [-- <more uvscpd arguments>]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/can.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+
+/* the frames: class 20 type 3 from nickname 1, their number in the data */
+#define FRAME_ID (CAN_EFF_FLAG | 20 << 16 | 3 << 8 | 1)
+
+#define RETR_COMMAND "retr 256\r\n" /* asked with each poll */
+#define RETR_IDLE_US 1000      /* wait before asking again after none */
+#define LEAD_IN_US 1000000     /* replay: for the clients to connect */
+#define DRAIN_US 2000000       /* done when nothing came for this long */
+#define SEND_WINDOW 256        /* loopback: sends not acknowledged yet */
+#define STARTUP_US 3000000     /* for uvscpd to listen */
+#define CLIENT_BUFFER 65536
+
+typedef struct {
+  int fd;
+  int retr;  /* polls with retr, else in rcvloop */
+  int state; /* 0: connecting, 1: command sent, 2: receiving */
+  uint64_t poll_at; /* retr: when to ask again, 0 when a reply is due */
+  unsigned int replied; /* retr: events in the reply so far */
+  char buffer[CLIENT_BUFFER];
+  size_t length;
+  uint8_t *seen; /* a bit for each frame */
+  unsigned long received, duplicates;
+} client_t;
+
+typedef struct {
+  uint32_t *samples;
+  size_t count, room;
+} latencies_t;
+
+static const char *backend = "replay";
+static double rate = 2000;
+static unsigned long frames = 20000;
+static unsigned int loop_clients = 4, retr_clients = 2;
+static int port = 18598;
+static const char *uvscpd = "./uvscpd";
+
+static client_t *clients;
+static unsigned int client_count, ready;
+static latencies_t latencies[2]; /* rcvloop, retr */
+static uint64_t first_bus, last_bus, first_write, last_write, last_progress;
+static unsigned long written;
+static int inject_fd = -1;
+static uint64_t inject_end; /* realtime when all frames were sent, atomic */
+
+static uint64_t realtime_us(void) {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static uint64_t monotonic_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_until(uint64_t due) {
+  struct timespec ts;
+
+  ts.tv_sec = due / 1000000;
+  ts.tv_nsec = (due % 1000000) * 1000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+}
+
+/* CPU time used by process 'pid', in microseconds */
+static uint64_t cpu_us(pid_t pid) {
+  unsigned long utime, stime;
+  char path[32], buffer[1024], *p;
+  ssize_t size;
+  int fd;
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+  size = read(fd, buffer, sizeof(buffer) - 1);
+  close(fd);
+  if (size <= 0)
+    return 0;
+  buffer[size] = 0;
+  /* utime and stime follow the command, its state and 10 more fields */
+  p = strrchr(buffer, ')');
+  if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u "
+                                 "%*u %lu %lu",
+                          &utime, &stime) != 2)
+    return 0;
+  return (uint64_t)(utime + stime) * 1000000 / sysconf(_SC_CLK_TCK);
+}
+
+static void latency_add(latencies_t *l, uint32_t latency) {
+  uint32_t *samples;
+
+  if (l->count == l->room) {
+    l->room = l->room > 0 ? 2 * l->room : 65536;
+    samples = realloc(l->samples, l->room * sizeof(uint32_t));
+    if (samples == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+    l->samples = samples;
+  }
+  l->samples[l->count++] = latency;
+}
+
+static int compare(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(const latencies_t *l, double p) {
+  return l->count > 0 ? l->samples[(size_t)(p * (l->count - 1))] : 0;
+}
+
+static void print_latencies(const char *name, latencies_t *l) {
+  qsort(l->samples, l->count, sizeof(uint32_t), compare);
+  printf("\"%s\":{\"samples\":%zu,\"p50\":%u,\"p90\":%u,\"p99\":%u,"
+         "\"p999\":%u,\"max\":%u}",
+         name, l->count, percentile(l, 0.5), percentile(l, 0.9),
+         percentile(l, 0.99), percentile(l, 0.999), percentile(l, 1));
+}
+
+/* "head,class,type,obid,datetime,timestamp,GUID,data...", the timestamp
+ * and the frame number of one of ours; -1 for other events */
+static int parse_event(const char *line, uint32_t *timestamp,
+                       unsigned long *number) {
+  unsigned int class, type, field;
+  unsigned long byte;
+  const char *p = line;
+  char *end;
+  int i;
+
+  if (sscanf(line, "%*u,%u,%u", &class, &type) != 2 || class != 20 ||
+      type != 3)
+    return -1;
+  for (field = 0; field < 5; field++)
+    if ((p = strchr(p, ',')) == NULL)
+      return -1;
+    else
+      p++;
+  *timestamp = (uint32_t)strtoul(p, NULL, 10);
+  if ((p = strchr(p, ',')) == NULL || (p = strchr(p + 1, ',')) == NULL)
+    return -1;
+  *number = 0;
+  for (i = 0; i < 4; i++) {
+    if (*p != ',')
+      return -1;
+    byte = strtoul(p + 1, &end, 10);
+    if (end == p + 1 || byte > 255)
+      return -1;
+    *number = *number << 8 | byte;
+    p = end;
+  }
+  return *p == 0 ? 0 : -1;
+}
+
+static void client_write(client_t *client, const char *command) {
+  if (write(client->fd, command, strlen(command)) < 0) {
+    perror("client");
+    exit(1);
+  }
+}
+
+static void client_event(client_t *client, const char *line, uint64_t now) {
+  unsigned long number;
+  uint32_t timestamp, latency;
+  uint64_t bus;
+
+  if (parse_event(line, &timestamp, &number) || number >= frames)
+    return;
+  if (client->seen[number / 8] & 1 << number % 8) {
+    client->duplicates++;
+    return;
+  }
+  client->seen[number / 8] |= 1 << number % 8;
+  client->received++;
+
+  /* the timestamp holds the low 32 bits of the microseconds */
+  latency = (uint32_t)now - timestamp;
+  if (latency > INT32_MAX)
+    latency = 0; /* clocks a hair apart */
+  latency_add(&latencies[client->retr], latency);
+  bus = now - latency;
+  if (first_bus == 0 || bus < first_bus)
+    first_bus = bus;
+  if (bus > last_bus)
+    last_bus = bus;
+  if (first_write == 0)
+    first_write = now;
+  last_write = now;
+  last_progress = now;
+  written++;
+}
+
+static void client_line(client_t *client, const char *line, uint64_t now) {
+  if (*line >= '0' && *line <= '9') {
+    client_event(client, line, now);
+    client->replied++;
+    return;
+  }
+  if (strncmp(line, "+OK", 3) != 0 && strncmp(line, "-OK", 3) != 0)
+    return; /* the welcome */
+
+  switch (client->state) {
+  case 0:
+    if (client->retr) {
+      client->state = 2;
+      ready++;
+    } else {
+      client_write(client, "rcvloop\r\n");
+      client->state = 1;
+    }
+    break;
+  case 1:
+    client->state = 2;
+    ready++;
+    break;
+  default:
+    /* the end of a retr reply, rcvloop keepalives */
+    if (client->retr) {
+      client->poll_at = client->replied > 0 ? now : now + RETR_IDLE_US;
+      client->replied = 0;
+    }
+  }
+}
+
+static int client_read(client_t *client, uint64_t now) {
+  char *line, *end;
+  ssize_t size;
+
+  while (1) {
+    size = read(client->fd, client->buffer + client->length,
+                sizeof(client->buffer) - client->length - 1);
+    if (size < 0)
+      return errno == EAGAIN ? 0 : -1;
+    if (size == 0)
+      return -1;
+    client->length += size;
+    client->buffer[client->length] = 0;
+    line = client->buffer;
+    while ((end = strstr(line, "\r\n")) != NULL) {
+      *end = 0;
+      client_line(client, line, now);
+      line = end + 2;
+    }
+    client->length -= line - client->buffer;
+    memmove(client->buffer, line, client->length);
+    if (client->length == sizeof(client->buffer) - 1)
+      client->length = 0; /* not a line of ours */
+  }
+}
+
+static int tcp_connect(void) {
+  struct sockaddr_in addr;
+  int fd, enable = 1;
+
+  fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+  return fd;
+}
+
+static void frame_make(struct can_frame *frame, unsigned long number) {
+  memset(frame, 0, sizeof(*frame));
+  frame->can_id = FRAME_ID;
+  frame->can_dlc = 4;
+  frame->data[0] = number >> 24;
+  frame->data[1] = number >> 16;
+  frame->data[2] = number >> 8;
+  frame->data[3] = number;
+}
+
+/* replay: a log with a frame of no interest to start the clock, then ours
+ * after the lead-in */
+static char *replay_log(void) {
+  static char path[] = "/tmp/uvscpd-bench-XXXXXX";
+  struct can_frame frame;
+  uint64_t timestamp;
+  unsigned long i;
+  FILE *log;
+  int fd;
+
+  fd = mkstemp(path);
+  if (fd < 0 || (log = fdopen(fd, "w")) == NULL) {
+    perror("replay log");
+    exit(1);
+  }
+  fprintf(log, "(1.000000) bench 000#\n");
+  for (i = 0; i < frames; i++) {
+    timestamp = 1000000 + LEAD_IN_US + (uint64_t)(i * 1e6 / rate);
+    frame_make(&frame, i);
+    fprintf(log, "(%lu.%06lu) bench %08X#%02X%02X%02X%02X\n",
+            (unsigned long)(timestamp / 1000000),
+            (unsigned long)(timestamp % 1000000),
+            frame.can_id & CAN_EFF_MASK, frame.data[0], frame.data[1],
+            frame.data[2], frame.data[3]);
+  }
+  if (fclose(log) != 0) {
+    perror("replay log");
+    exit(1);
+  }
+  return path;
+}
+
+/* loopback: wait for the daemon to take sends until fewer than 'window'
+ * are outstanding */
+static void send_settle(unsigned long *outstanding, unsigned long window) {
+  static char buffer[4096];
+  static size_t length;
+  unsigned int sent;
+  char *line, *end;
+  ssize_t size;
+
+  while (*outstanding >= window) {
+    size = read(inject_fd, buffer + length, sizeof(buffer) - length - 1);
+    if (size <= 0) {
+      fprintf(stderr, "loopback: connection lost\n");
+      exit(1);
+    }
+    length += size;
+    buffer[length] = 0;
+    line = buffer;
+    while ((end = strstr(line, "\r\n")) != NULL) {
+      *end = 0;
+      if (sscanf(line, "+OK - %u sent", &sent) == 1)
+        *outstanding -= sent < *outstanding ? sent : *outstanding;
+      else if (strncmp(line, "-OK", 3) == 0 && *outstanding > 0)
+        (*outstanding)--; /* refused, nothing to wait for */
+      line = end + 2;
+    }
+    length -= line - buffer;
+    memmove(buffer, line, length);
+  }
+}
+
+static void *inject(void *arg) {
+  int loopback = strcmp(backend, "loopback") == 0;
+  unsigned long i, outstanding = 0;
+  struct can_frame frame;
+  char text[4096];
+  size_t length = 0;
+  uint64_t start;
+
+  start = monotonic_us();
+  for (i = 0; i < frames; i++) {
+    if (rate > 0 && monotonic_us() < start + (uint64_t)(i * 1e6 / rate)) {
+      /* all that was due is out, before waiting for more */
+      if (length > 0 && write(inject_fd, text, length) != (ssize_t)length) {
+        perror("loopback");
+        exit(1);
+      }
+      length = 0;
+      sleep_until(start + (uint64_t)(i * 1e6 / rate));
+    }
+    frame_make(&frame, i);
+    if (loopback) {
+      if (outstanding == SEND_WINDOW || length > sizeof(text) - 64) {
+        if (write(inject_fd, text, length) != (ssize_t)length) {
+          perror("loopback");
+          exit(1);
+        }
+        length = 0;
+        send_settle(&outstanding, SEND_WINDOW);
+      }
+      length += snprintf(text + length, sizeof(text) - length,
+                         "send 0,20,3,0,,0,-,%u,%u,%u,%u\r\n", frame.data[0],
+                         frame.data[1], frame.data[2], frame.data[3]);
+      outstanding++;
+    } else {
+      while (write(inject_fd, &frame, sizeof(frame)) != sizeof(frame)) {
+        if (errno != ENOBUFS && errno != EINTR) {
+          perror(backend);
+          exit(1);
+        }
+        usleep(100); /* the interface queue is full */
+      }
+    }
+  }
+  if (length > 0 && write(inject_fd, text, length) != (ssize_t)length) {
+    perror("loopback");
+    exit(1);
+  }
+  if (loopback)
+    send_settle(&outstanding, 1);
+  __atomic_store_n(&inject_end, realtime_us(), __ATOMIC_RELEASE);
+  return NULL;
+}
+
+/* vcan: a CAN_RAW socket of our own on the interface */
+static int can_open(const char *name) {
+  struct sockaddr_can addr;
+  struct ifreq ifr;
+  int fd;
+
+  fd = socket(PF_CAN, SOCK_RAW | SOCK_CLOEXEC, CAN_RAW);
+  if (fd < 0)
+    return -1;
+  memset(&addr, 0, sizeof(addr));
+  strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+  ifr.ifr_name[IFNAMSIZ - 1] = 0;
+  if (ioctl(fd, SIOCGIFINDEX, &ifr) < 0) {
+    close(fd);
+    return -1;
+  }
+  addr.can_family = AF_CAN;
+  addr.can_ifindex = ifr.ifr_ifindex;
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static pid_t daemon_start(const char *spec, int argc, char *argv[]) {
+  char port_text[16], connections[16];
+  const char **args;
+  pid_t pid;
+  int i, n = 0;
+
+  args = calloc(argc + 10, sizeof(char *));
+  if (args == NULL)
+    return -1;
+  snprintf(port_text, sizeof(port_text), "%d", port);
+  snprintf(connections, sizeof(connections), "%u", client_count + 1);
+  args[n++] = uvscpd;
+  args[n++] = "--stay";
+  args[n++] = "-p";
+  args[n++] = port_text;
+  args[n++] = "-c";
+  args[n++] = spec;
+  args[n++] = "-m";
+  args[n++] = connections;
+  for (i = 0; i < argc; i++)
+    args[n++] = argv[i];
+
+  pid = fork();
+  if (pid == 0) {
+    dup2(STDERR_FILENO, STDOUT_FILENO); /* stdout is for the results */
+    execv(uvscpd, (char *const *)args);
+    perror(uvscpd);
+    _exit(127);
+  }
+  free(args);
+  return pid;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "Usage: bench_load [-b replay|loopback|<interface>] [-r <frames/s>]"
+          " [-n <frames>]\n"
+          "                  [-l <rcvloop clients>] [-t <retr clients>]"
+          " [-p <port>]\n"
+          "                  [-u <uvscpd>] [-- <uvscpd arguments>]\n");
+  exit(2);
+}
+
+int main(int argc, char *argv[]) {
+  struct epoll_event event, events[64];
+  unsigned long drops[2] = {0, 0}, duplicates = 0, most = 0;
+  uint64_t now, cpu_start, cpu_end, deadline, end, next;
+  char spec[4096], *log = NULL;
+  pthread_t injector;
+  int epoll, opt, n, i, status, timeout;
+  unsigned int c, done;
+  pid_t pid;
+
+  while ((opt = getopt(argc, argv, "b:r:n:l:t:p:u:h")) != -1) {
+    switch (opt) {
+    case 'b':
+      backend = optarg;
+      break;
+    case 'r':
+      rate = atof(optarg);
+      break;
+    case 'n':
+      frames = strtoul(optarg, NULL, 10);
+      break;
+    case 'l':
+      loop_clients = strtoul(optarg, NULL, 10);
+      break;
+    case 't':
+      retr_clients = strtoul(optarg, NULL, 10);
+      break;
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'u':
+      uvscpd = optarg;
+      break;
+    default:
+      usage();
+    }
+  }
+  client_count = loop_clients + retr_clients;
+  if (rate < 0 || frames == 0 || frames > UINT32_MAX || client_count == 0)
+    usage();
+
+  /* where the frames come from */
+  if (strcmp(backend, "replay") == 0) {
+    if (rate == 0) {
+      fprintf(stderr, "replay needs a rate, a high one is as fast as it "
+                      "goes\n");
+      exit(2);
+    }
+    log = replay_log();
+    snprintf(spec, sizeof(spec), "replay:%s", log);
+  } else if (strcmp(backend, "loopback") == 0) {
+    snprintf(spec, sizeof(spec), "loopback");
+  } else {
+    inject_fd = can_open(backend);
+    if (inject_fd < 0) {
+      fprintf(stderr, "interface [%s] error: %s\n", backend, strerror(errno));
+      exit(1);
+    }
+    snprintf(spec, sizeof(spec), "%s", backend);
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  pid = daemon_start(spec, argc - optind, argv + optind);
+  if (pid < 0) {
+    perror("fork");
+    exit(1);
+  }
+
+  /* the clients, the first one as soon as it listens */
+  clients = calloc(client_count, sizeof(client_t));
+  epoll = epoll_create1(EPOLL_CLOEXEC);
+  if (clients == NULL || epoll < 0) {
+    perror("clients");
+    goto fail;
+  }
+  deadline = monotonic_us() + STARTUP_US;
+  while ((clients[0].fd = tcp_connect()) < 0) {
+    if (monotonic_us() > deadline || waitpid(pid, &status, WNOHANG) != 0) {
+      fprintf(stderr, "uvscpd did not start\n");
+      goto fail;
+    }
+    usleep(10000);
+  }
+  for (c = 0; c < client_count; c++) {
+    if (c > 0 && (clients[c].fd = tcp_connect()) < 0) {
+      perror("connect");
+      goto fail;
+    }
+    fcntl(clients[c].fd, F_SETFL, O_NONBLOCK);
+    clients[c].retr = c >= loop_clients;
+    clients[c].seen = calloc((frames + 7) / 8, 1);
+    if (clients[c].seen == NULL) {
+      perror("clients");
+      goto fail;
+    }
+    event.events = EPOLLIN;
+    event.data.u32 = c;
+    epoll_ctl(epoll, EPOLL_CTL_ADD, clients[c].fd, &event);
+  }
+
+  /* all in rcvloop or polling before the first frame */
+  deadline = monotonic_us() + STARTUP_US;
+  while (ready < client_count) {
+    if (monotonic_us() > deadline) {
+      fprintf(stderr, "clients not connected, max connections?\n");
+      goto fail;
+    }
+    n = epoll_wait(epoll, events, 64, 100);
+    now = realtime_us();
+    for (i = 0; i < n; i++)
+      if (client_read(&clients[events[i].data.u32], now) < 0) {
+        fprintf(stderr, "client refused\n");
+        goto fail;
+      }
+  }
+
+  cpu_start = cpu_us(pid);
+  now = realtime_us();
+  for (c = 0; c < client_count; c++)
+    clients[c].poll_at = now;
+  if (log != NULL) {
+    /* the replay started with the first connection */
+    inject_end = now + LEAD_IN_US + (uint64_t)((frames - 1) * 1e6 / rate);
+  } else {
+    /* loopback: sent by a client of its own, acknowledged by the window */
+    if (strcmp(backend, "loopback") == 0) {
+      snprintf(spec, sizeof(spec), "swnd %d\r\n", SEND_WINDOW);
+      if ((inject_fd = tcp_connect()) < 0 ||
+          write(inject_fd, spec, strlen(spec)) < 0) {
+        perror("loopback");
+        goto fail;
+      }
+    }
+    pthread_create(&injector, NULL, inject, NULL);
+  }
+
+  /* until all have all, or nothing more comes */
+  last_progress = now;
+  do {
+    now = realtime_us();
+    next = now + 100000;
+    for (c = 0; c < client_count; c++) {
+      if (!clients[c].retr || clients[c].poll_at == 0)
+        continue;
+      if (clients[c].poll_at <= now) {
+        client_write(&clients[c], RETR_COMMAND);
+        clients[c].poll_at = 0;
+      } else if (clients[c].poll_at < next) {
+        next = clients[c].poll_at;
+      }
+    }
+    timeout = (int)((next - now + 999) / 1000);
+    n = epoll_wait(epoll, events, 64, timeout);
+    now = realtime_us();
+    for (i = 0; i < n; i++)
+      if (client_read(&clients[events[i].data.u32], now) < 0) {
+        fprintf(stderr, "client disconnected\n");
+        goto fail;
+      }
+
+    for (c = 0, done = 0; c < client_count; c++)
+      done += clients[c].received == frames;
+    end = __atomic_load_n(&inject_end, __ATOMIC_ACQUIRE);
+  } while (done < client_count &&
+           (end == 0 || now < end || now - last_progress < DRAIN_US));
+  cpu_end = cpu_us(pid);
+  if (log == NULL)
+    pthread_join(injector, NULL);
+
+  for (c = 0; c < client_count; c++) {
+    drops[clients[c].retr] += frames - clients[c].received;
+    duplicates += clients[c].duplicates;
+    if (clients[c].received > most)
+      most = clients[c].received;
+  }
+
+  printf("{\"version\":\"%s\",\"backend\":\"%s\",\"rate\":%.0f,"
+         "\"frames\":%lu,\"rcvloop_clients\":%u,\"retr_clients\":%u,",
+         PACKAGE_VERSION, backend, rate, frames, loop_clients, retr_clients);
+  printf("\"duration_s\":%.3f,\"bus_fps\":%.1f,\"written_fps\":%.1f,",
+         (last_bus - first_bus) / 1e6,
+         last_bus > first_bus ? (most - 1) * 1e6 / (last_bus - first_bus) : 0,
+         last_write > first_write
+             ? (written - 1) * 1e6 / (last_write - first_write)
+             : 0);
+  printf("\"latency_us\":{");
+  print_latencies("rcvloop", &latencies[0]);
+  printf(",");
+  print_latencies("retr", &latencies[1]);
+  printf("},\"cpu_us_per_frame\":%.2f,", (cpu_end - cpu_start) / (double)frames);
+  printf("\"drops\":{\"rcvloop\":%lu,\"retr\":%lu},\"duplicates\":%lu}\n",
+         drops[0], drops[1], duplicates);
+
+  kill(pid, SIGTERM);
+  waitpid(pid, &status, 0);
+  if (log != NULL)
+    unlink(log);
+  return 0;
+
+fail:
+  kill(pid, SIGTERM);
+  waitpid(pid, &status, 0);
+  if (log != NULL)
+    unlink(log);
+  return 1;
+}
@@ -0,0 +1,154 @@
+// uvscpd - Minimalist VSCP Daemon
+// Copyright (C) 2019 Maarten Zanders
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+/* Frames per second through print_vscp(): the snprintf/gmtime/strncat
+ * version it replaced, print_vscp() and print_vscp_prefix(). Random messages
+ * are first checked to come out the same with all of them. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "vscp.h"
+
+#define FRAMES 3000000
+#define CHECKS 200000
+
+/* as print_vscp() was, with strncat() limited to the room left */
+static int print_vscp_snprintf(const vscp_msg_t *msg, char *buffer,
+                               size_t buffer_size) {
+  const uint8_t *g = msg->guid.guid;
+  char timebuffer[32];
+  char guidbuffer[56];
+  struct tm *tmp;
+  int i;
+
+  tmp = gmtime(&(msg->timestamp));
+  if (tmp != NULL)
+    strftime(timebuffer, 32, "%FT%H:%M:%S", tmp);
+  else
+    timebuffer[0] = 0;
+
+  snprintf(guidbuffer, sizeof(guidbuffer),
+           "%X:%X:%X:%X:%X:%X:%X:%X:%X:%X:%X:%X:%X:%X:%X:%X", g[0], g[1], g[2],
+           g[3], g[4], g[5], g[6], g[7], g[8], g[9], g[10], g[11], g[12], g[13],
+           g[14], g[15]);
+
+  snprintf(buffer, buffer_size, "%u,%u,%u,0,%s,%u,%s,", msg->head, msg->class,
+           msg->type, timebuffer, msg->hw_timestamp, guidbuffer);
+
+  for (i = 0; (i < msg->data_length) && (i < 8); i++) {
+    char temp[8];
+    snprintf(temp, 7, "%u,", msg->data[i]);
+    strncat(buffer, temp, buffer_size - strlen(buffer) - 1);
+  }
+  buffer[strlen(buffer) - 1] = 0;
+  strncat(buffer, "\r\n", buffer_size - strlen(buffer) - 1);
+
+  return strlen(buffer);
+}
+
+static uint64_t state = 88172645463325252ull;
+
+static uint32_t random32(void) {
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return (uint32_t)state;
+}
+
+static double elapsed(const struct timespec *start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(void) {
+  char expected[256], got[256];
+  vscp_guid_prefix_t prefix;
+  struct timespec start;
+  vscp_msg_t msg;
+  volatile int sink = 0;
+  double before, after, prefixed;
+  int i, j, mismatches = 0;
+
+  for (i = 0; i < CHECKS; i++) {
+    memset(&msg, 0, sizeof(msg));
+    msg.head = random32() & 0xFF;
+    msg.class = random32() % 512;
+    msg.type = random32() & 0xFF;
+    msg.hw_timestamp = random32();
+    msg.timestamp = i % 5 == 0 ? (time_t)random32() : 1700000000 + i / 1000;
+    for (j = 0; j < 16; j++)
+      msg.guid.guid[j] = i % 3 ? random32() : 0;
+    msg.data_length = random32() % 9;
+    for (j = 0; j < 8; j++)
+      msg.data[j] = random32();
+    if (print_vscp_snprintf(&msg, expected, sizeof(expected)) !=
+            print_vscp(&msg, got, sizeof(got)) ||
+        strcmp(expected, got) != 0) {
+      if (mismatches++ < 5)
+        printf("mismatch:\n%s%s", expected, got);
+    }
+  }
+  if (mismatches > 0) {
+    printf("print_vscp: %d of %d messages differ\n", mismatches, CHECKS);
+    return 1;
+  }
+
+  /* a typical event, with the time changing now and then as on a bus */
+  memset(&msg, 0, sizeof(msg));
+  msg.head = 96;
+  msg.class = 20;
+  msg.type = 3;
+  msg.data_length = 3;
+  msg.data[0] = 1;
+  msg.data[1] = 200;
+  msg.data[2] = 33;
+  vscp_guid_prefix_set(&prefix, &msg.guid);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < FRAMES; i++) {
+    msg.timestamp = 1700000000 + i / 5000;
+    msg.hw_timestamp = i;
+    sink += print_vscp_snprintf(&msg, got, VSCP_TEXT_MAX);
+  }
+  before = elapsed(&start);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < FRAMES; i++) {
+    msg.timestamp = 1700000000 + i / 5000;
+    msg.hw_timestamp = i;
+    sink += print_vscp(&msg, got, VSCP_TEXT_MAX);
+  }
+  after = elapsed(&start);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < FRAMES; i++) {
+    msg.timestamp = 1700000000 + i / 5000;
+    msg.hw_timestamp = i;
+    sink += print_vscp_prefix(&msg, &prefix, got, VSCP_TEXT_MAX);
+  }
+  prefixed = elapsed(&start);
+
+  printf("print_vscp: %.2f M frames/s with snprintf, %.2f M frames/s, "
+         "%.2f M frames/s with a prefix (%d messages checked)\n",
+         FRAMES / before / 1e6, FRAMES / after / 1e6, FRAMES / prefixed / 1e6,
+         CHECKS);
+  return 0;
+}
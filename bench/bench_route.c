@@ -0,0 +1,114 @@
+// uvscpd - Minimalist VSCP Daemon
+// Copyright (C) 2019 Maarten Zanders
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+/* Cost of finding the sessions a frame goes to: 500 clients with 50 filters
+ * each, set with the setfilter/setmask syntax. Every filter is checked for
+ * every frame, against a lookup in the routing index. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "tcpserver_route.h"
+#include "vscp.h"
+
+#define CLIENTS 500
+#define FILTERS 50
+#define FRAMES 100000
+#define ROUNDS 10
+
+static struct can_filter filters[CLIENTS][FILTERS];
+static canid_t frames[FRAMES];
+
+static int match(const struct can_filter *filter, canid_t id) {
+  return ((id ^ filter->can_id) & filter->can_mask) == 0;
+}
+
+static double elapsed(const struct timespec *start) {
+  struct timespec end;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(void) {
+  const char *zero_guid = "00:00:00:00:00:00:00:00:00:00:00:00:00:00:00:00";
+  char text[120];
+  tcpserver_route_t *route;
+  struct timespec start;
+  canid_t class_type, class_only;
+  unsigned long hits_scan = 0, hits_route = 0;
+  const uint64_t *map;
+  uint64_t bits;
+  double scan, lookup, build;
+  int c, f, i, n, w, words;
+
+  /* masks on class and type, or on class alone for a tenth of the filters */
+  snprintf(text, sizeof(text), "0,511,255,%s", zero_guid);
+  vscp_parse_filter(text, &class_type, NULL);
+  snprintf(text, sizeof(text), "0,511,0,%s", zero_guid);
+  vscp_parse_filter(text, &class_only, NULL);
+
+  srand(1);
+  for (c = 0; c < CLIENTS; c++)
+    for (f = 0; f < FILTERS; f++) {
+      snprintf(text, sizeof(text), "0,%d,%d,%s", rand() % 128, rand() % 32,
+               zero_guid);
+      vscp_parse_filter(text, &filters[c][f].can_id, NULL);
+      filters[c][f].can_mask = f % 10 == 0 ? class_only : class_type;
+    }
+  for (i = 0; i < FRAMES; i++)
+    frames[i] = CAN_EFF_FLAG | (rand() % 128) << 16 | (rand() % 32) << 8 |
+                (rand() & 0xFF);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (n = 0; n < ROUNDS; n++)
+    for (i = 0; i < FRAMES; i++)
+      for (c = 0; c < CLIENTS; c++)
+        for (f = 0; f < FILTERS; f++)
+          if (match(&filters[c][f], frames[i])) {
+            hits_scan++;
+            break;
+          }
+  scan = elapsed(&start);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  route = tcpserver_route_create(CLIENTS);
+  for (c = 0; c < CLIENTS; c++)
+    tcpserver_route_set(route, c, filters[c], FILTERS);
+  build = elapsed(&start);
+
+  words = tcpserver_route_words(route);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (n = 0; n < ROUNDS; n++)
+    for (i = 0; i < FRAMES; i++) {
+      map = tcpserver_route_lookup(route, frames[i]);
+      for (w = 0; w < words; w++)
+        for (bits = map[w]; bits != 0; bits &= bits - 1)
+          hits_route++;
+    }
+  lookup = elapsed(&start);
+
+  printf("route: %d clients x %d filters, %lu deliveries\n", CLIENTS, FILTERS,
+         hits_route / ROUNDS);
+  printf("  every filter: %8.1f ns/frame\n",
+         scan * 1e9 / ((double)FRAMES * ROUNDS));
+  printf("  index:        %8.1f ns/frame (built in %.1f ms)\n",
+         lookup * 1e9 / ((double)FRAMES * ROUNDS), build * 1e3);
+  tcpserver_route_free(route);
+  return hits_scan == hits_route ? 0 : 1;
+}
@@ -0,0 +1,425 @@
+// uvscpd - Minimalist VSCP Daemon
+// Copyright (C) 2019 Maarten Zanders
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+/* Send lines per second through vscp_parse_msg(): the strndup/sscanf version
+ * it replaced and the in-place one. Random send lines, filters and GUIDs are
+ * first checked to be accepted or rejected alike, with the same values. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "vscp.h"
+
+#define LINES 500000
+#define CHECKS 1000000
+
+/* as vscp_strtoguid() was */
+static int strtoguid_sscanf(const char *input, vscp_guid_t *guid) {
+  const char *ptr = input;
+  char temp[3];
+  vscp_guid_t local_guid;
+  unsigned int value;
+  int field = 0;
+
+  if (input == NULL)
+    return -1;
+
+  while (*ptr != 0) {
+    const char *seek = ptr;
+    char guard;
+
+    if (field > 15)
+      return -1;
+
+    while (*seek != ':' && *seek != 0)
+      seek++;
+
+    if ((seek - ptr) > 2)
+      return -1;
+
+    strncpy(temp, ptr, seek - ptr);
+    temp[seek - ptr] = 0;
+
+    if (sscanf(temp, "%X%c", &value, &guard) != 1)
+      return -1;
+
+    if (value > UINT8_MAX)
+      return -1;
+
+    local_guid.guid[field] = (uint8_t)value;
+
+    ptr = seek;
+    if (*ptr != 0)
+      ptr++;
+    field++;
+  }
+  if (*ptr != 0 || field != 16)
+    return -1;
+  *guid = local_guid;
+  return 0;
+}
+
+/* reads one field the way both old parsers did */
+static int scan_field(const char *temp, unsigned int *value) {
+  char guard;
+
+  if (temp[0] == '0' && temp[1] == 'x')
+    return sscanf(temp, "%X%c", value, &guard) != 1;
+  return sscanf(temp, "%u%c", value, &guard) != 1;
+}
+
+/* as vscp_parse_filter() was, with the field copy freed on errors */
+static int parse_filter_sscanf(const char *input, canid_t *id) {
+  const char *ptr = input;
+  char *temp;
+  unsigned int value = 0;
+  int field = 0, error = 0;
+  vscp_guid_t guid;
+  *id = 0;
+
+  while (*ptr != 0 && !error) {
+    const char *seek = ptr;
+
+    while (*seek != ',' && *seek != 0)
+      seek++;
+
+    temp = strndup(ptr, seek - ptr);
+
+    switch (field) {
+    case 0 ... 2:
+      error = scan_field(temp, &value);
+      break;
+    case 3:
+      error = strtoguid_sscanf(temp, &guid);
+      break;
+    }
+    free(temp);
+    if (error)
+      break;
+
+    switch (field) {
+    case 0:
+      if (value <= 0b111)
+        *id |= value << 26;
+      else
+        error = 1;
+      break;
+
+    case 1:
+      if (value < 512)
+        *id |= value << 16;
+      else if (value < 1024)
+        *id |= (value - 512) << 16;
+      else
+        error = 1;
+      break;
+
+    case 2:
+      if (value <= UINT8_MAX)
+        *id |= (uint8_t)value << 8;
+      else
+        error = 1;
+      break;
+
+    case 3:
+      *id |= guid.guid[15];
+      break;
+    }
+
+    ptr = seek;
+    if (*ptr != 0)
+      ptr++;
+    field++;
+  }
+  if (!error && field == 4)
+    return 0;
+  return -1;
+}
+
+/* as vscp_parse_msg() was, with the field copy freed on errors */
+static int parse_msg_sscanf(const char *input, vscp_msg_t *msg,
+                            vscp_guid_t *my_guid) {
+  const char *ptr = input;
+  char *temp;
+  unsigned int value = 0;
+  int field = 0, error = 0;
+  int level2 = 0;
+
+  msg->data_length = 0;
+
+  while (*ptr != 0 && !error) {
+    const char *seek = ptr;
+
+    while (*seek != ',' && *seek != 0)
+      seek++;
+
+    temp = strndup(ptr, seek - ptr);
+
+    switch (field) {
+    case 0 ... 2:
+    case 7 ... 30:
+      error = scan_field(temp, &value);
+      break;
+    case 31:
+      error = 1;
+      break;
+    }
+    free(temp);
+    if (error)
+      break;
+
+    switch (field) {
+    case 0:
+      if (value <= UINT8_MAX)
+        msg->head = (uint8_t)value;
+      else
+        error = 1;
+      break;
+
+    case 1:
+      if (value < 512)
+        msg->class = (uint16_t)value;
+      else if (value < 1024) {
+        msg->class = (uint16_t)value - 512;
+        level2 = 1;
+      } else
+        error = 1;
+      break;
+
+    case 2:
+      if (value <= UINT8_MAX)
+        msg->type = (uint8_t)value;
+      else
+        error = 1;
+      break;
+
+    case 7 ... 30:
+      if (level2) {
+        if (field < 23 && my_guid->guid[field - 7] != value) {
+          error = 1;
+        } else if (field >= 23) {
+          if (value <= UINT8_MAX)
+            msg->data[field - 23] = (uint8_t)value;
+          else
+            error = 1;
+          msg->data_length++;
+        }
+      } else {
+        if (field == 15 || value > UINT8_MAX) {
+          error = 1;
+          break;
+        }
+        msg->data[field - 7] = (uint8_t)value;
+        msg->data_length++;
+      }
+      break;
+    }
+
+    ptr = seek;
+    if (*ptr != 0)
+      ptr++;
+    field++;
+  }
+  if (!error && field > 6)
+    return 0;
+  return -1;
+}
+
+/* numbers as clients write them, and the ones sscanf() let through */
+static const char *numbers[] = {
+    "0",          "1",           "3",          "7",
+    "8",          "20",          "255",        "256",
+    "511",        "512",         "600",        "1023",
+    "1024",       "007",         "0x",         "0X",
+    "0x0",        "0xff",        "0xFF",       "0x100",
+    "0x200",      "0x1ff",       "0X5",        "0xg",
+    "0x-5",       "0x 5",        "x5",         "12a",
+    "",           " ",           " 5",         "\t5",
+    "5 ",         "+5",          "-5",         "-0",
+    "+",          "-",           "+-5",        "- 5",
+    "-4294967295", "4294967295", "4294967296", "4294967297",
+    "4294967551", "18446744073709551615",      "18446744073709551616",
+    "99999999999999999999",      "0xffffffff", "0x100000000",
+    "0x1000000ff", "0x10000000000000000",      "+0x5",       "-0x5"};
+#define NUMBERS (sizeof(numbers) / sizeof(numbers[0]))
+
+static const char *guids[] = {
+    "00:00:00:00:00:00:00:00:00:00:00:00:00:00:00:00",
+    "0:0:0:0:0:0:0:0:0:0:0:0:0:0:0:5",
+    "ff:ff:ff:ff:ff:ff:ff:ff:ff:ff:ff:ff:ff:ff:ff:ff:",
+    "0:0:0:0:0:0:0:0:0:0:0:0:0:0:0",
+    "0:0:0:0:0:0:0:0:0:0:0:0:0:0:0:0:0",
+    "0::0:0:0:0:0:0:0:0:0:0:0:0:0:0:0",
+    "fff:0:0:0:0:0:0:0:0:0:0:0:0:0:0:0",
+    "+1:-0: 2:0x:0X:-1:+:a:B:c:D:e:F:10:\t1:ff",
+    "-0:+0:0:0:0:0:0:0:0:0:0:0:0:0:0:7",
+    "1:2:3",
+    ""};
+#define GUIDS (sizeof(guids) / sizeof(guids[0]))
+
+static const char *datetimes[] = {"", "2020-01-02T03:04:05Z",
+                                  "0000-00-00t16:00:00z",
+                                  "1272-23-95T05:127:00Z"};
+
+static uint64_t state = 88172645463325252ull;
+
+static uint32_t random32(void) {
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return (uint32_t)state;
+}
+
+/* a number, now and then a few random characters instead */
+static const char *random_number(void) {
+  static const char chars[] = "0123456789abcdefxX:,tT-+ ";
+  static char text[8];
+  int i, n;
+
+  if (random32() % 8)
+    return numbers[random32() % NUMBERS];
+  n = random32() % 5;
+  for (i = 0; i < n; i++)
+    text[i] = chars[random32() % (sizeof(chars) - 1)];
+  text[n] = 0;
+  return text;
+}
+
+/* a GUID, with one octet now and then replaced by a random number */
+static const char *random_guid(void) {
+  static char text[128];
+  const char *guid = guids[random32() % GUIDS];
+  char *p = text;
+  int octet = random32() % 24;
+
+  for (; *guid != 0; guid++) {
+    if (octet == 0) {
+      p += sprintf(p, "%s", random_number());
+      while (guid[1] != 0 && guid[1] != ':')
+        guid++;
+    } else
+      *p++ = *guid;
+    if (*guid == ':')
+      octet--;
+  }
+  *p = 0;
+  return text;
+}
+
+static void random_line(char *line) {
+  char *p = line;
+  int i, n;
+
+  p += sprintf(p, "%s,%s,%s", random_number(), random_number(),
+               random_number());
+  if (random32() % 3 == 0) {
+    /* a filter, with now and then a field too many */
+    p += sprintf(p, ",%s", random_guid());
+    if (random32() % 8 == 0)
+      p += sprintf(p, ",%s", random_number());
+  } else {
+    p += sprintf(p, ",%s,%s,%s,%s", random_number(),
+                 datetimes[random32() % 4], random_number(), random_guid());
+    n = random32() % 26;
+    for (i = 0; i < n; i++)
+      p += sprintf(p, ",%s", random32() % 4 ? "0" : random_number());
+  }
+  if (random32() % 10 == 0)
+    strcpy(p, ",");
+}
+
+static double elapsed(const struct timespec *start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(void) {
+  const char *level2 =
+      "96,512,9,0,2020-01-02T03:04:05Z,0,"
+      "00:00:00:00:00:00:00:00:00:00:00:00:00:00:00:00,0x00,0x00,0x00,0x00,"
+      "0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x03,0xD0,"
+      "1,2,3,4,5,6";
+  char line[1024];
+  vscp_guid_t my_guid, expected_guid, got_guid;
+  vscp_msg_t expected, got;
+  canid_t expected_id, got_id;
+  struct timespec start;
+  volatile int sink = 0;
+  double before, after;
+  int i, a, b, accepted = 0, mismatches = 0;
+
+  memset(&my_guid, 0, sizeof(my_guid));
+  for (i = 0; i < CHECKS; i++) {
+    random_line(line);
+
+    memset(&expected, 0, sizeof(expected));
+    memset(&got, 0, sizeof(got));
+    a = parse_msg_sscanf(line, &expected, &my_guid);
+    b = vscp_parse_msg(line, &got, &my_guid);
+    if (a != b ||
+        (a == 0 && (expected.head != got.head ||
+                    expected.class != got.class ||
+                    expected.type != got.type ||
+                    expected.data_length != got.data_length ||
+                    memcmp(expected.data, got.data, got.data_length) != 0))) {
+      if (mismatches++ < 5)
+        printf("send mismatch (%d, %d): %s\n", a, b, line);
+    }
+    accepted += a == 0;
+
+    a = parse_filter_sscanf(line, &expected_id);
+    b = vscp_parse_filter(line, &got_id, &my_guid);
+    if (a != b || (a == 0 && expected_id != got_id)) {
+      if (mismatches++ < 5)
+        printf("filter mismatch (%d, %d): %s\n", a, b, line);
+    }
+    accepted += a == 0;
+
+    strcpy(line, random_guid());
+    a = strtoguid_sscanf(line, &expected_guid);
+    b = vscp_strtoguid(line, &got_guid);
+    if (a != b ||
+        (a == 0 && memcmp(&expected_guid, &got_guid, sizeof(got_guid)) != 0)) {
+      if (mismatches++ < 5)
+        printf("GUID mismatch (%d, %d): %s\n", a, b, line);
+    }
+    accepted += a == 0;
+  }
+  if (mismatches > 0) {
+    printf("vscp_parse_msg: %d of %d lines differ\n", mismatches, CHECKS * 3);
+    return 1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < LINES; i++)
+    sink += parse_msg_sscanf(level2, &got, &my_guid);
+  before = elapsed(&start);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < LINES; i++)
+    sink += vscp_parse_msg(level2, &got, &my_guid);
+  after = elapsed(&start);
+
+  printf("vscp_parse_msg: %.2f M lines/s with sscanf, %.2f M lines/s "
+         "(%d lines checked, %d accepted)\n",
+         LINES / before / 1e6, LINES / after / 1e6, CHECKS * 3, accepted);
+  return 0;
+}
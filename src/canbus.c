@@ -0,0 +1,712 @@
+// uvscpd - Minimalist VSCP Daemon
+// Copyright (C) 2019 Maarten Zanders
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <assert.h>
+#include <errno.h>
+#include <linux/can/bcm.h>
+#include <linux/can/raw.h>
+#include <net/if.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "canbus.h"
+#include "canbus_backend.h"
+#include "vscp.h"
+
+/* frames fetched from the backend at once */
+#define CANBUS_BATCH 32
+/* batches read per wakeup, so a flood can't starve the TCP side */
+#define CANBUS_MAX_BATCHES 8
+
+/* the interface queue was full, try again after this many microseconds */
+#define CANBUS_TX_RETRY_US 2000
+
+/* the frames someone wants */
+typedef struct subscription {
+  const void *origin;
+  struct can_filter *filters;
+  unsigned int count;
+  struct subscription *next;
+} subscription_t;
+
+/* the frames someone wants only when they change */
+typedef struct watcher {
+  const void *origin;
+  canbus_watch_t *watches;
+  unsigned int count;
+  struct watcher *next;
+} watcher_t;
+
+/* what goes to and comes from the CAN_BCM socket */
+typedef struct {
+  struct bcm_msg_head head;
+  struct can_frame frame;
+} bcm_msg_t;
+
+typedef struct canbus {
+  canbus_backend_t *backend;
+  char name[IFNAMSIZ];
+  int bcm; /* CAN_BCM socket, -1 when the backend has none */
+  vscp_buffer_ctx_t *ring;
+  vscp_guid_t guid;
+  vscp_guid_prefix_t guid_prefix;
+  canbus_sched_t *tx_sched;
+  int tx_state;      /* CANBUS_TX_DONE, _WRITABLE or _RETRY */
+  uint64_t tx_retry; /* CANBUS_TX_RETRY: when to try again */
+  /* the frames of the canbus_send_bulk() in progress: their flow and tags,
+   * and where to tell which of them the interface refused */
+  canbus_flow_t *tx_bulk_flow;
+  const uint32_t *tx_bulk_tags;
+  unsigned int tx_bulk_count;
+  int *tx_bulk_status;
+  subscription_t *subscriptions;
+  vscp_cache_t *cache; /* latest message per event, NULL if none */
+  int keep_all;        /* take every frame, not only those subscribed to */
+  vscp_buffer_ctx_t *raw; /* every frame, VSCP or not, NULL when not kept */
+  watcher_t *watchers;
+  canbus_watch_t *watched; /* what the kernel watches, one per id */
+  unsigned int watched_count;
+} canbus_t;
+
+static uint64_t monotonic_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+canbus_t *canbus_open(const char *name, unsigned int ring_size,
+                      unsigned int tx_queue_size, unsigned int cache_size,
+                      const vscp_guid_t *guid, char *error, size_t error_size) {
+  struct timespec now;
+  canbus_t *bus;
+
+  bus = calloc(1, sizeof(canbus_t));
+  if (bus == NULL) {
+    snprintf(error, error_size, "out of memory");
+    return NULL;
+  }
+  bus->bcm = -1;
+  bus->guid = *guid;
+  vscp_guid_prefix_set(&(bus->guid_prefix), guid);
+  snprintf(bus->name, sizeof(bus->name), "%s", canbus_backend_name(name));
+  bus->tx_sched = canbus_sched_create(tx_queue_size);
+  if (bus->tx_sched == NULL) {
+    snprintf(error, error_size, "out of memory");
+    free(bus);
+    return NULL;
+  }
+
+  bus->backend = canbus_backend_open(name, error, error_size);
+  if (bus->backend == NULL) {
+    canbus_sched_free(bus->tx_sched);
+    free(bus);
+    return NULL;
+  }
+
+  /* numbered from the microsecond it was opened on. The bus is far from a
+   * million frames a second, so the numbers of an earlier run or interface
+   * are always below those of this one */
+  clock_gettime(CLOCK_REALTIME, &now);
+  bus->ring = vscp_buffer_ctx_create_at(
+      ring_size, (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000);
+  if (bus->ring == NULL) {
+    snprintf(error, error_size, "out of memory");
+    goto fail;
+  }
+  if (cache_size > 0) {
+    bus->cache = vscp_cache_create(cache_size);
+    if (bus->cache == NULL) {
+      snprintf(error, error_size, "out of memory");
+      vscp_buffer_free(bus->ring);
+      goto fail;
+    }
+  }
+
+  /* change-only subscriptions, when the backend has the broadcast manager */
+  if (bus->backend->ops->changes_fd != NULL)
+    bus->bcm = bus->backend->ops->changes_fd(bus->backend);
+  return bus;
+
+fail:
+  bus->backend->ops->close(bus->backend);
+  canbus_sched_free(bus->tx_sched);
+  free(bus);
+  return NULL;
+}
+
+void canbus_close(canbus_t *bus) {
+  assert(bus != NULL);
+  while (bus->subscriptions != NULL)
+    canbus_unsubscribe(bus, bus->subscriptions->origin);
+  while (bus->watchers != NULL)
+    canbus_watch(bus, bus->watchers->origin, NULL, 0);
+  free(bus->watched);
+  bus->backend->ops->close(bus->backend); /* and the CAN_BCM socket */
+  vscp_buffer_free(bus->ring);
+  if (bus->raw != NULL)
+    vscp_buffer_free(bus->raw);
+  if (bus->cache != NULL)
+    vscp_cache_free(bus->cache);
+  canbus_sched_free(bus->tx_sched);
+  free(bus);
+}
+
+int canbus_fd(canbus_t *bus) { return bus->backend->ops->fd(bus->backend); }
+
+const char *canbus_name(canbus_t *bus) { return bus->name; }
+
+int canbus_changes_fd(canbus_t *bus) { return bus->bcm; }
+
+vscp_buffer_ctx_t *canbus_ring(canbus_t *bus) { return bus->ring; }
+
+vscp_buffer_ctx_t *canbus_raw_ring(canbus_t *bus) { return bus->raw; }
+
+const vscp_guid_t *canbus_guid(canbus_t *bus) { return &(bus->guid); }
+
+vscp_cache_t *canbus_cache(canbus_t *bus) { return bus->cache; }
+
+vscp_text_t *canbus_text(canbus_t *bus, uint64_t seq) {
+  vscp_buffer_entry_t entry;
+  vscp_msg_t msg;
+  char buf[VSCP_TEXT_MAX];
+  int n;
+
+  if (vscp_buffer_get(bus->ring, seq, &entry))
+    return NULL;
+
+  if (entry.text == NULL) {
+    can_to_vscp(&entry.frame, entry.timestamp, &msg, &(bus->guid));
+    n = print_vscp_prefix(&msg, &(bus->guid_prefix), buf, sizeof(buf));
+    entry.text = vscp_text_create(buf, n);
+    if (entry.text == NULL || vscp_buffer_set_text(bus->ring, seq, entry.text))
+      return NULL;
+  }
+  return entry.text;
+}
+
+int canbus_read(canbus_t *bus) {
+  const canbus_backend_ops_t *ops = bus->backend->ops;
+  struct can_frame frames[CANBUS_BATCH];
+  uint64_t timestamps[CANBUS_BATCH];
+  vscp_buffer_entry_t entries[CANBUS_BATCH];
+  vscp_buffer_entry_t raw[CANBUS_BATCH];
+  int batches, added = 0;
+  int n, i, count;
+
+  for (batches = 0; batches < CANBUS_MAX_BATCHES; batches++) {
+    n = ops->recv(bus->backend, frames, timestamps, CANBUS_BATCH);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        break;
+      return -1;
+    }
+
+    /* all of them for a capture, before they are picked */
+    if (bus->raw != NULL) {
+      for (i = 0; i < n; i++) {
+        raw[i].frame = frames[i];
+        raw[i].timestamp = timestamps[i];
+        raw[i].origin = NULL;
+        raw[i].text = NULL;
+      }
+      vscp_buffer_push_bulk(bus->raw, raw, n);
+    }
+
+    /* decode the whole batch, then store it in one go */
+    count = 0;
+    for (i = 0; i < n; i++) {
+      if (vscp_frame_check(&frames[i]))
+        continue; /* not a VSCP frame */
+      entries[count].frame = frames[i];
+      entries[count].timestamp = timestamps[i];
+      entries[count].origin = NULL;
+      entries[count].text = NULL;
+      count++;
+    }
+    vscp_buffer_push_bulk(bus->ring, entries, count);
+    if (bus->cache != NULL)
+      vscp_cache_update(bus->cache, entries, count);
+    added += count;
+
+    if (n < CANBUS_BATCH)
+      break; /* drained */
+  }
+  return added;
+}
+
+/* set the union of all subscriptions on the socket */
+static int filters_apply(canbus_t *bus, const subscription_t *subscriptions) {
+  static const struct can_filter all = {0, 0};
+  const canbus_backend_ops_t *ops = bus->backend->ops;
+  struct can_filter *filters = NULL;
+  const subscription_t *sub;
+  unsigned int count = 0, i, j;
+  int rval;
+
+  /* a backend without filters passes everything, the sessions filter */
+  if (ops->filter == NULL)
+    return 0;
+
+  for (sub = subscriptions; sub != NULL; sub = sub->next)
+    count += sub->count;
+  /* the cache has to see every event to know its latest value */
+  if (subscriptions != NULL && count <= CANBUS_MAX_FILTERS &&
+      bus->cache == NULL && !bus->keep_all && bus->raw == NULL)
+    filters = malloc(count * sizeof(struct can_filter) + 1); /* not 0 */
+
+  if (filters != NULL) {
+    /* the same pair wanted twice takes the kernel twice the time */
+    count = 0;
+    for (sub = subscriptions; sub != NULL; sub = sub->next)
+      for (i = 0; i < sub->count; i++) {
+        for (j = 0; j < count; j++)
+          if (filters[j].can_id == sub->filters[i].can_id &&
+              filters[j].can_mask == sub->filters[i].can_mask)
+            break;
+        if (j == count)
+          filters[count++] = sub->filters[i];
+      }
+    rval = ops->filter(bus->backend, filters, count);
+    free(filters);
+  } else {
+    /* nobody subscribed, more than the kernel takes, caching or keeping
+     * all, VSCP or not */
+    rval = ops->filter(bus->backend, &all, 1);
+  }
+  return rval;
+}
+
+/* unlink the subscription of 'origin', NULL if it has none */
+static subscription_t *subscription_take(canbus_t *bus, const void *origin) {
+  subscription_t **pp = &(bus->subscriptions), *sub;
+
+  for (; *pp != NULL; pp = &((*pp)->next))
+    if ((*pp)->origin == origin) {
+      sub = *pp;
+      *pp = sub->next;
+      return sub;
+    }
+  return NULL;
+}
+
+int canbus_subscribe(canbus_t *bus, const void *origin,
+                     const struct can_filter *filters, unsigned int count) {
+  subscription_t *sub, *old;
+
+  sub = malloc(sizeof(subscription_t));
+  if (sub == NULL)
+    return -1;
+  sub->filters = malloc(count * sizeof(struct can_filter) + 1); /* not 0 */
+  if (sub->filters == NULL) {
+    free(sub);
+    return -1;
+  }
+  memcpy(sub->filters, filters, count * sizeof(struct can_filter));
+  sub->count = count;
+  sub->origin = origin;
+
+  old = subscription_take(bus, origin);
+  sub->next = bus->subscriptions;
+  if (filters_apply(bus, sub) < 0) {
+    if (old != NULL) {
+      old->next = bus->subscriptions;
+      bus->subscriptions = old;
+    }
+    free(sub->filters);
+    free(sub);
+    return -1;
+  }
+  bus->subscriptions = sub;
+  if (old != NULL) {
+    free(old->filters);
+    free(old);
+  }
+  return 0;
+}
+
+void canbus_unsubscribe(canbus_t *bus, const void *origin) {
+  subscription_t *sub = subscription_take(bus, origin);
+
+  if (sub == NULL)
+    return;
+  /* fewer filters never fail where more didn't */
+  filters_apply(bus, bus->subscriptions);
+  free(sub->filters);
+  free(sub);
+}
+
+int canbus_keep_all(canbus_t *bus) {
+  bus->keep_all = 1;
+  return filters_apply(bus, bus->subscriptions);
+}
+
+int canbus_keeps_all(canbus_t *bus) { return bus->keep_all; }
+
+int canbus_keep_raw(canbus_t *bus, unsigned int size) {
+  const canbus_backend_ops_t *ops = bus->backend->ops;
+
+  if (bus->raw == NULL) {
+    bus->raw = vscp_buffer_ctx_create(size);
+    if (bus->raw == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+  }
+  if (ops->error_frames != NULL && ops->error_frames(bus->backend) < 0)
+    return -1;
+  return filters_apply(bus, bus->subscriptions);
+}
+
+/* watch 'watch->id' in the kernel, or stop watching it */
+static int bcm_write(canbus_t *bus, uint32_t opcode,
+                     const canbus_watch_t *watch) {
+  bcm_msg_t msg;
+  size_t length = sizeof(msg);
+
+  memset(&msg, 0, sizeof(msg));
+  msg.head.opcode = opcode;
+  msg.head.can_id = watch->id;
+  if (opcode == RX_SETUP) {
+    /* a timeout of 0 stops the timer; once timed out, tell when it's back */
+    msg.head.flags = SETTIMER | STARTTIMER | RX_CHECK_DLC | RX_ANNOUNCE_RESUME;
+    msg.head.ival1.tv_sec = watch->timeout_ms / 1000;
+    msg.head.ival1.tv_usec = (watch->timeout_ms % 1000) * 1000;
+    msg.head.nframes = 1;
+    /* any change of the data counts */
+    memset(msg.frame.data, 0xFF, sizeof(msg.frame.data));
+  } else {
+    length = sizeof(msg.head);
+  }
+  return write(bus->bcm, &msg, length) == (ssize_t)length ? 0 : -1;
+}
+
+/* find 'id' in 'watches', NULL if it isn't there */
+static canbus_watch_t *watch_find(canbus_watch_t *watches, unsigned int count,
+                                  canid_t id) {
+  unsigned int i;
+
+  for (i = 0; i < count; i++)
+    if (watches[i].id == id)
+      return &watches[i];
+  return NULL;
+}
+
+/* let the kernel watch the union of what 'watchers' want */
+static int watches_apply(canbus_t *bus, const watcher_t *watchers) {
+  canbus_watch_t *watched = NULL, *w, *old;
+  const watcher_t *watcher;
+  unsigned int count = 0, i;
+
+  for (watcher = watchers; watcher != NULL; watcher = watcher->next)
+    count += watcher->count;
+  watched = malloc(count * sizeof(canbus_watch_t) + 1); /* not 0 */
+  if (watched == NULL)
+    return -1;
+
+  count = 0;
+  for (watcher = watchers; watcher != NULL; watcher = watcher->next)
+    for (i = 0; i < watcher->count; i++) {
+      w = watch_find(watched, count, watcher->watches[i].id);
+      if (w == NULL) {
+        watched[count++] = watcher->watches[i];
+      } else if (watcher->watches[i].timeout_ms != 0 &&
+                 (w->timeout_ms == 0 ||
+                  watcher->watches[i].timeout_ms < w->timeout_ms)) {
+        w->timeout_ms = watcher->watches[i].timeout_ms;
+      }
+    }
+
+  for (i = 0; i < count; i++) {
+    old = watch_find(bus->watched, bus->watched_count, watched[i].id);
+    if ((old == NULL || old->timeout_ms != watched[i].timeout_ms) &&
+        bcm_write(bus, RX_SETUP, &watched[i]) < 0)
+      break;
+  }
+  if (i < count) {
+    /* take back what was set up so far */
+    while (i-- > 0) {
+      old = watch_find(bus->watched, bus->watched_count, watched[i].id);
+      if (old == NULL)
+        bcm_write(bus, RX_DELETE, &watched[i]);
+      else if (old->timeout_ms != watched[i].timeout_ms)
+        bcm_write(bus, RX_SETUP, old);
+    }
+    free(watched);
+    return -1;
+  }
+  for (i = 0; i < bus->watched_count; i++)
+    if (watch_find(watched, count, bus->watched[i].id) == NULL)
+      bcm_write(bus, RX_DELETE, &bus->watched[i]);
+  free(bus->watched);
+  bus->watched = watched;
+  bus->watched_count = count;
+  return 0;
+}
+
+int canbus_watch(canbus_t *bus, const void *origin,
+                 const canbus_watch_t *watches, unsigned int count) {
+  watcher_t **pp, *watcher = NULL, *old = NULL;
+
+  if (count > 0 && bus->bcm < 0) {
+    errno = EOPNOTSUPP;
+    return -1;
+  }
+  for (pp = &(bus->watchers); *pp != NULL; pp = &((*pp)->next))
+    if ((*pp)->origin == origin) {
+      old = *pp;
+      *pp = old->next;
+      break;
+    }
+
+  if (count > 0) {
+    watcher = malloc(sizeof(watcher_t));
+    if (watcher != NULL)
+      watcher->watches = malloc(count * sizeof(canbus_watch_t));
+    if (watcher == NULL || watcher->watches == NULL) {
+      free(watcher);
+      goto restore;
+    }
+    memcpy(watcher->watches, watches, count * sizeof(canbus_watch_t));
+    watcher->count = count;
+    watcher->origin = origin;
+    watcher->next = bus->watchers;
+    bus->watchers = watcher;
+  }
+
+  /* fewer watches never fail where more didn't, the kernel only deletes */
+  if (watches_apply(bus, bus->watchers) < 0 && watcher != NULL) {
+    bus->watchers = watcher->next;
+    free(watcher->watches);
+    free(watcher);
+    goto restore;
+  }
+  if (old != NULL) {
+    free(old->watches);
+    free(old);
+  }
+  return 0;
+
+restore:
+  if (old != NULL) {
+    old->next = bus->watchers;
+    bus->watchers = old;
+  }
+  return -1;
+}
+
+int canbus_read_changes(canbus_t *bus) {
+  vscp_buffer_entry_t entries[CANBUS_BATCH];
+  vscp_buffer_entry_t *entry;
+  bcm_msg_t msg;
+  struct timeval tv;
+  int batches, added = 0;
+  int count;
+  ssize_t n;
+
+  for (batches = 0; batches < CANBUS_MAX_BATCHES; batches++) {
+    count = 0;
+    while (count < CANBUS_BATCH) {
+      n = read(bus->bcm, &msg, sizeof(msg));
+      if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+          break;
+        return -1;
+      }
+      entry = &entries[count];
+      if (msg.head.opcode == RX_CHANGED && n == sizeof(msg) &&
+          vscp_frame_check(&msg.frame) == 0) {
+        entry->frame = msg.frame;
+        entry->origin = CANBUS_CHANGED;
+      } else if (msg.head.opcode == RX_TIMEOUT) {
+        memset(&(entry->frame), 0, sizeof(struct can_frame));
+        entry->frame.can_id = msg.head.can_id;
+        entry->origin = CANBUS_SILENT;
+      } else {
+        continue; /* not for us */
+      }
+      gettimeofday(&tv, NULL);
+      entry->timestamp = (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_usec;
+      entry->text = NULL;
+      count++;
+    }
+    /* not remembered in the cache, these are copies or no frames at all */
+    vscp_buffer_push_bulk(bus->ring, entries, count);
+    added += count;
+
+    if (count < CANBUS_BATCH)
+      break; /* drained */
+  }
+  return added;
+}
+
+/* the kernel doesn't loop our own frames back to this socket, nor does any
+ * other backend, so let the other sessions know about the frames sent here */
+static void tx_done(canbus_t *bus, const canbus_sched_entry_t *sent,
+                    unsigned int count) {
+  vscp_buffer_entry_t entries[CANBUS_TX_BATCH];
+  struct timeval tv;
+  uint64_t timestamp;
+  unsigned int i, n;
+
+  gettimeofday(&tv, NULL);
+  timestamp = (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_usec;
+  for (i = 0, n = 0; i < count; i++) {
+    if (vscp_frame_check(&sent[i].frame))
+      continue;
+    entries[n].frame = sent[i].frame;
+    entries[n].timestamp = timestamp;
+    entries[n].origin = canbus_sched_flow_origin(sent[i].flow);
+    entries[n].text = NULL;
+    n++;
+  }
+  vscp_buffer_push_bulk(bus->ring, entries, n);
+  if (bus->raw != NULL)
+    vscp_buffer_push_bulk(bus->raw, entries, n);
+  if (bus->cache != NULL)
+    vscp_cache_update(bus->cache, entries, n);
+}
+
+canbus_flow_t *canbus_flow_open(canbus_t *bus, const void *origin) {
+  return canbus_sched_flow_open(bus->tx_sched, origin);
+}
+
+void canbus_flow_close(canbus_flow_t *flow) { canbus_sched_flow_close(flow); }
+
+void canbus_flow_stats(canbus_flow_t *flow, canbus_flow_stats_t *stats) {
+  canbus_sched_flow_stats(flow, stats);
+}
+
+unsigned int canbus_flow_failures(canbus_flow_t *flow,
+                                  canbus_sched_failure_t *failures,
+                                  unsigned int max) {
+  return canbus_sched_flow_failures(flow, failures, max);
+}
+
+void canbus_tx_set_rate(canbus_t *bus, uint32_t bits_per_second) {
+  canbus_sched_set_rate(bus->tx_sched, bits_per_second);
+}
+
+int canbus_send(canbus_t *bus, canbus_flow_t *flow,
+                const struct can_frame *frame) {
+  uint32_t tag = 0;
+  int status;
+
+  if (canbus_send_bulk(bus, flow, frame, &tag, 1, &status) == 1)
+    return 0;
+  errno = status;
+  return -1;
+}
+
+int canbus_send_bulk(canbus_t *bus, canbus_flow_t *flow,
+                     const struct can_frame *frames, const uint32_t *tags,
+                     unsigned int count, int *status) {
+  unsigned int i, accepted = 0;
+  uint64_t now = monotonic_us();
+
+  assert(count <= CANBUS_TX_BATCH);
+  bus->tx_bulk_flow = flow;
+  bus->tx_bulk_tags = tags;
+  bus->tx_bulk_count = count;
+  bus->tx_bulk_status = status;
+  for (i = 0; i < count; i++)
+    status[i] = canbus_sched_push(flow, &frames[i], tags[i], now) ? ENOSPC : 0;
+
+  /* those the interface refuses right away get their errno in 'status' */
+  canbus_tx_flush(bus);
+  bus->tx_bulk_count = 0;
+
+  for (i = 0; i < count; i++)
+    if (status[i] == 0)
+      accepted++;
+  return accepted;
+}
+
+int canbus_tx_flush(canbus_t *bus) {
+  canbus_sched_entry_t entries[CANBUS_TX_BATCH];
+  struct can_frame frames[CANBUS_TX_BATCH];
+  unsigned int n, i;
+  uint64_t now = monotonic_us();
+  int sent, error;
+
+  if (bus->tx_state == CANBUS_TX_WRITABLE ||
+      (bus->tx_state == CANBUS_TX_RETRY && now < bus->tx_retry))
+    return bus->tx_state;
+  bus->tx_state = CANBUS_TX_DONE;
+
+  while ((n = canbus_sched_pop(bus->tx_sched, entries, CANBUS_TX_BATCH,
+                               now)) > 0) {
+    for (i = 0; i < n; i++)
+      frames[i] = entries[i].frame;
+    sent = bus->backend->ops->send(bus->backend, frames, n);
+    if (sent < 0) {
+      if (errno == ENOBUFS) {
+        /* the interface queue is full, it doesn't tell when it drains */
+        canbus_sched_unpop(bus->tx_sched, entries, n);
+        bus->tx_state = CANBUS_TX_RETRY;
+        bus->tx_retry = now + CANBUS_TX_RETRY_US;
+        return bus->tx_state;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        canbus_sched_unpop(bus->tx_sched, entries, n);
+        bus->tx_state = CANBUS_TX_WRITABLE;
+        return bus->tx_state;
+      }
+      /* the interface refuses this one, don't hold up the others. One of
+       * the canbus_send_bulk() in progress is told there, the flow keeps
+       * the others for canbus_flow_failures() */
+      error = errno;
+      for (i = 0; i < bus->tx_bulk_count; i++)
+        if (entries[0].flow == bus->tx_bulk_flow &&
+            entries[0].tag == bus->tx_bulk_tags[i]) {
+          bus->tx_bulk_status[i] = error;
+          error = 0;
+          break;
+        }
+      canbus_sched_unpop(bus->tx_sched, entries + 1, n - 1);
+      canbus_sched_failed(bus->tx_sched, &entries[0], error);
+      continue;
+    }
+    canbus_sched_unpop(bus->tx_sched, entries + sent, n - sent);
+    canbus_sched_sent(bus->tx_sched, entries, sent, now);
+    tx_done(bus, entries, sent);
+  }
+
+  /* held back by the rate cap */
+  if (canbus_sched_length(bus->tx_sched) > 0) {
+    bus->tx_state = CANBUS_TX_RETRY;
+    bus->tx_retry = canbus_sched_deadline(bus->tx_sched);
+  }
+  return bus->tx_state;
+}
+
+void canbus_tx_writable(canbus_t *bus) {
+  if (bus->tx_state == CANBUS_TX_WRITABLE)
+    bus->tx_state = CANBUS_TX_DONE;
+}
+
+uint64_t canbus_tx_deadline(canbus_t *bus) { return bus->tx_retry; }
+
+unsigned int canbus_tx_pending(canbus_t *bus) {
+  return canbus_sched_length(bus->tx_sched);
+}
+
+void canbus_tx_stats(canbus_t *bus, canbus_tx_stats_t *stats) {
+  canbus_sched_stats(bus->tx_sched, stats);
+}
@@ -0,0 +1,188 @@
+// uvscpd - Minimalist VSCP Daemon
+// Copyright (C) 2019 Maarten Zanders
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _CANBUS_H_
+#define _CANBUS_H_
+
+/* One reader per CAN interface. Frames are read from a single socket, or
+ * another backend (canbus_backend.h), decoded once and stored in a ring
+ * buffer which all sessions read from. */
+
+#include <stddef.h>
+#include <linux/can.h>
+#include "canbus_sched.h"
+#include "vscp_buffer.h"
+#include "vscp_cache.h"
+
+typedef struct canbus canbus_t;
+
+// Open the interface 'name', or the backend it names ("replay:<log>[,<speed>]",
+// "loopback"), keeping the last 'ring_size' messages. Messages
+// are decoded using 'guid'. Up to 'tx_queue_size' frames wait for the
+// interface when it can't take them right away. The latest message of up to
+// 'cache_size' events is remembered, 0 for none. Returns NULL on failure,
+// with a description of the problem in 'error'.
+canbus_t *canbus_open(const char *name, unsigned int ring_size,
+                      unsigned int tx_queue_size, unsigned int cache_size,
+                      const vscp_guid_t *guid, char *error, size_t error_size);
+
+// Close the interface and free the ring buffer
+void canbus_close(canbus_t *bus);
+
+// File descriptor to wait on for incoming frames
+int canbus_fd(canbus_t *bus);
+
+// The interface name, or that of the backend when it has none
+const char *canbus_name(canbus_t *bus);
+
+// Read the pending frames from the interface into the ring buffer, in batches.
+// Returns the number of VSCP messages added, -1 when the interface failed.
+int canbus_read(canbus_t *bus);
+
+// The latest message of every event, NULL when not remembered
+vscp_cache_t *canbus_cache(canbus_t *bus);
+
+// Most CAN_RAW_FILTER pairs the kernel takes
+#define CANBUS_MAX_FILTERS 512
+
+// Frames 'origin' wants, as CAN_RAW_FILTER pairs. The socket takes the union
+// of what everyone wants, so the kernel drops frames nobody does; no
+// subscriptions at all, a cache or canbus_keep_all() means everything.
+// Returns 0 on success, -1 when the kernel refuses the filters, leaving the
+// previous ones in place.
+int canbus_subscribe(canbus_t *bus, const void *origin,
+                     const struct can_filter *filters, unsigned int count);
+
+// 'origin' no longer wants anything
+void canbus_unsubscribe(canbus_t *bus, const void *origin);
+
+// Take every frame, also those nobody subscribed to, so the ring holds all
+// of the traffic for the clients coming back. Returns -1 on failure.
+int canbus_keep_all(canbus_t *bus);
+int canbus_keeps_all(canbus_t *bus);
+
+// Also keep every frame received or sent in a ring of 'size' of its own,
+// canbus_raw_ring(), for a capture: those that aren't VSCP as well, like
+// standard, remote and error frames, which the ring buffer leaves out.
+// Takes every frame, as canbus_keep_all() does. Returns -1 on failure.
+int canbus_keep_raw(canbus_t *bus, unsigned int size);
+
+// A frame wanted only when its data changes, as the kernel's broadcast
+// manager (CAN_BCM) tells, or when it didn't come for 'timeout_ms'
+// milliseconds (0 for never)
+typedef struct {
+  canid_t id;
+  uint32_t timeout_ms;
+} canbus_watch_t;
+
+// Origins of the messages canbus_read_changes() adds: a frame whose data
+// changed, and a frame that didn't come in time, of which only the id is set
+#define CANBUS_CHANGED ((const void *)1)
+#define CANBUS_SILENT ((const void *)2)
+
+// File descriptor to wait on for changed frames, -1 without CAN_BCM
+int canbus_changes_fd(canbus_t *bus);
+
+// Read the changed frames and timeouts into the ring buffer. Returns the
+// number of messages added, -1 when the interface failed.
+int canbus_read_changes(canbus_t *bus);
+
+// Frames 'origin' wants only when they change, instead of those it watched
+// before. The kernel watches the union of what everyone wants; a frame
+// watched with different timeouts times out at the shortest. Frames only
+// watched don't need to pass the CAN_RAW_FILTER of canbus_subscribe(). Returns
+// 0 on success, -1 when the kernel refuses or has no CAN_BCM, leaving the
+// previous ones in place.
+int canbus_watch(canbus_t *bus, const void *origin,
+                 const canbus_watch_t *watches, unsigned int count);
+
+// Most frames canbus_send_bulk() passes to the kernel in one call
+#define CANBUS_TX_BATCH 32
+
+// Open a flow of frames to send for 'origin'; the transmit scheduler serves
+// flows in turn. Returns NULL when out of memory.
+canbus_flow_t *canbus_flow_open(canbus_t *bus, const void *origin);
+
+// Close the flow, its queued frames still go out
+void canbus_flow_close(canbus_flow_t *flow);
+
+// Statistics of the flow
+void canbus_flow_stats(canbus_flow_t *flow, canbus_flow_stats_t *stats);
+
+// Take up to 'max' frames of the flow the interface refused after
+// canbus_send_bulk() returned, with their tag and errno, oldest first.
+// Returns the number taken.
+unsigned int canbus_flow_failures(canbus_flow_t *flow,
+                                  canbus_sched_failure_t *failures,
+                                  unsigned int max);
+
+// Send a frame of 'flow' on the bus. Once sent, the frame is also added to the
+// ring buffer, marked with the origin of the flow so the sender can skip it.
+// Returns 0 on success.
+int canbus_send(canbus_t *bus, canbus_flow_t *flow,
+                const struct can_frame *frame);
+
+// Send up to CANBUS_TX_BATCH frames of 'flow', as canbus_send() does for each.
+// They are queued and leave by priority and in turn with the other flows, as
+// many right away as the interface takes; canbus_tx_flush() sends the rest.
+// 'status' gets 0 for every frame accepted, or the errno why it wasn't:
+// ENOSPC when the queue is full, or what the interface said when it refused
+// the frame right away. Frames refused later are told by
+// canbus_flow_failures() with their 'tags', which tell apart the frames of a
+// call. Returns the number of frames accepted.
+int canbus_send_bulk(canbus_t *bus, canbus_flow_t *flow,
+                     const struct can_frame *frames, const uint32_t *tags,
+                     unsigned int count, int *status);
+
+// Cap the frames sent to 'bits_per_second' on the wire, 0 for no cap
+void canbus_tx_set_rate(canbus_t *bus, uint32_t bits_per_second);
+
+// canbus_tx_flush() results
+#define CANBUS_TX_DONE 0     // the queue is empty
+#define CANBUS_TX_WRITABLE 1 // wait for the socket to become writable
+#define CANBUS_TX_RETRY 2    // try again at canbus_tx_deadline()
+
+// Send the queued frames, as many as the interface and the rate cap allow
+int canbus_tx_flush(canbus_t *bus);
+
+// The socket became writable again
+void canbus_tx_writable(canbus_t *bus);
+
+// CANBUS_TX_RETRY: when to try again, CLOCK_MONOTONIC in microseconds
+uint64_t canbus_tx_deadline(canbus_t *bus);
+
+// Number of frames in the queue
+unsigned int canbus_tx_pending(canbus_t *bus);
+
+// Statistics of the queue
+void canbus_tx_stats(canbus_t *bus, canbus_tx_stats_t *stats);
+
+// The ring buffer holding the received messages
+vscp_buffer_ctx_t *canbus_ring(canbus_t *bus);
+
+// The ring of every frame, see canbus_keep_raw(), NULL when not kept
+vscp_buffer_ctx_t *canbus_raw_ring(canbus_t *bus);
+
+// The GUID used for decoding
+const vscp_guid_t *canbus_guid(canbus_t *bus);
+
+// Message 'seq' rendered for the wire (as print_vscp() does), using the GUID
+// of the bus. It is rendered only once and shared by everyone asking for it;
+// the text is valid until the message leaves the ring, take a reference to
+// keep it longer. Returns NULL when the message isn't in the ring.
+vscp_text_t *canbus_text(canbus_t *bus, uint64_t seq);
+
+#endif /* _CANBUS_H_ */
@@ -0,0 +1,127 @@
+// uvscpd - Minimalist VSCP Daemon
+// Copyright (C) 2019 Maarten Zanders
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "canbus_backend.h"
+
+/* the backends named in a spec, socketcan is the one without a name */
+static const canbus_backend_ops_t *const backends[] = {&canbus_replay,
+                                                       &canbus_loopback};
+
+#define BACKENDS (sizeof(backends) / sizeof(backends[0]))
+
+/* the backend 'spec' names, and what follows its name in 'arg' */
+static const canbus_backend_ops_t *backend_find(const char *spec,
+                                                const char **arg) {
+  size_t length;
+  unsigned int i;
+
+  for (i = 0; i < BACKENDS; i++) {
+    length = strlen(backends[i]->name);
+    if (strncmp(spec, backends[i]->name, length) == 0 &&
+        (spec[length] == 0 || spec[length] == ':')) {
+      *arg = spec[length] == ':' ? spec + length + 1 : "";
+      return backends[i];
+    }
+  }
+  *arg = spec;
+  return &canbus_socketcan;
+}
+
+canbus_backend_t *canbus_backend_open(const char *spec, char *error,
+                                      size_t error_size) {
+  const canbus_backend_ops_t *ops;
+  const char *arg;
+
+  ops = backend_find(spec, &arg);
+  return ops->open(arg, error, error_size);
+}
+
+const char *canbus_backend_name(const char *spec) {
+  const canbus_backend_ops_t *ops;
+  const char *arg;
+
+  ops = backend_find(spec, &arg);
+  return ops == &canbus_socketcan ? spec : ops->name;
+}
+
+/* Loopback: a bus of its own, nothing to receive from but what the clients
+ * send, which reaches the others as it would on an interface. Sending never
+ * waits. */
+
+typedef struct {
+  canbus_backend_t backend;
+  int event; /* never readable, for the event loop to wait on */
+} loopback_t;
+
+static canbus_backend_t *loopback_open(const char *arg, char *error,
+                                       size_t error_size) {
+  loopback_t *loopback;
+
+  if (*arg != 0) {
+    snprintf(error, error_size, "loopback takes no arguments");
+    return NULL;
+  }
+  loopback = calloc(1, sizeof(loopback_t));
+  if (loopback == NULL) {
+    snprintf(error, error_size, "out of memory");
+    return NULL;
+  }
+  loopback->backend.ops = &canbus_loopback;
+  loopback->event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (loopback->event < 0) {
+    snprintf(error, error_size, "loopback error: %s", strerror(errno));
+    free(loopback);
+    return NULL;
+  }
+  return &(loopback->backend);
+}
+
+static void loopback_close(canbus_backend_t *backend) {
+  close(((loopback_t *)backend)->event);
+  free(backend);
+}
+
+static int loopback_fd(canbus_backend_t *backend) {
+  return ((loopback_t *)backend)->event;
+}
+
+static int loopback_recv(canbus_backend_t *backend, struct can_frame *frames,
+                         uint64_t *timestamps, unsigned int max) {
+  errno = EAGAIN;
+  return -1;
+}
+
+static int loopback_send(canbus_backend_t *backend,
+                         const struct can_frame *frames, unsigned int count) {
+  return count;
+}
+
+const canbus_backend_ops_t canbus_loopback = {.name = "loopback",
+                                              .open = loopback_open,
+                                              .close = loopback_close,
+                                              .fd = loopback_fd,
+                                              .recv = loopback_recv,
+                                              .send = loopback_send,
+                                              .filter = NULL,
+                                              .changes_fd = NULL,
+                                              .error_frames = NULL};
@@ -0,0 +1,83 @@
+// uvscpd - Minimalist VSCP Daemon
+// Copyright (C) 2019 Maarten Zanders
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _CANBUS_BACKEND_H_
+#define _CANBUS_BACKEND_H_
+
+/* Where the frames of a bus come from and go to. The bus (canbus.c) only
+ * sees a file descriptor to wait on and batches of frames; a backend is a
+ * table of operations and its own state, which starts with a pointer to the
+ * table:
+ *  - socketcan: a CAN_RAW socket on a (v)can interface, the default
+ *  - replay: the frames of a candump log, at the pace they were logged,
+ *    scaled, or as fast as they are taken
+ *  - loopback: no interface at all, the frames sent are taken at once
+ * The last two need neither CAN hardware nor root, for trying out and
+ * benchmarking the daemon anywhere. */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/can.h>
+
+typedef struct canbus_backend {
+  const struct canbus_backend_ops *ops;
+} canbus_backend_t;
+
+typedef struct canbus_backend_ops {
+  const char *name;
+  // Open for 'arg', what followed the name and its colon (the interface
+  // for socketcan). Returns NULL on failure, with a description of the
+  // problem in 'error'.
+  canbus_backend_t *(*open)(const char *arg, char *error, size_t error_size);
+  void (*close)(canbus_backend_t *backend);
+  // File descriptor to wait on for frames to receive, and to become
+  // writable when send() returned EAGAIN
+  int (*fd)(canbus_backend_t *backend);
+  // Up to 'max' frames with the time they were received, microseconds since
+  // the epoch. Returns their number, -1 with errno set (EAGAIN when there
+  // are none now).
+  int (*recv)(canbus_backend_t *backend, struct can_frame *frames,
+              uint64_t *timestamps, unsigned int max);
+  // Send up to 'count' frames. Returns the number sent, -1 with errno set
+  // when not even the first one was: EAGAIN to wait for fd(), ENOBUFS to
+  // try again later, anything else when the first frame is refused.
+  int (*send)(canbus_backend_t *backend, const struct can_frame *frames,
+              unsigned int count);
+  // Receive only the frames passing any of the CAN_RAW_FILTER pairs, NULL
+  // when the backend passes all of them. Returns -1 when refused.
+  int (*filter)(canbus_backend_t *backend, const struct can_filter *filters,
+                unsigned int count);
+  // A CAN_BCM socket connected to the same interface, NULL or -1 for none
+  int (*changes_fd)(canbus_backend_t *backend);
+  // Receive the error frames of the interface as well, NULL when the
+  // backend has none. Returns -1 when refused.
+  int (*error_frames)(canbus_backend_t *backend);
+} canbus_backend_ops_t;
+
+extern const canbus_backend_ops_t canbus_socketcan;
+extern const canbus_backend_ops_t canbus_replay;
+extern const canbus_backend_ops_t canbus_loopback;
+
+// Open the backend 'spec' names: "replay:<arg>", "loopback", or else a
+// socketcan interface. Returns NULL on failure, with a description of
+// the problem in 'error'.
+canbus_backend_t *canbus_backend_open(const char *spec, char *error,
+                                      size_t error_size);
+
+// The name of the interface, or of the backend when it has none
+const char *canbus_backend_name(const char *spec);
+
+#endif /* _CANBUS_BACKEND_H_ */
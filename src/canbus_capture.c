@@ -0,0 +1,493 @@
+// uvscpd - Minimalist VSCP Daemon
+// Copyright (C) 2019 Maarten Zanders
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "canbus_capture.h"
+#include "vscp.h"
+
+/* frames taken from the ring at once */
+#define CAPTURE_BATCH 256
+/* how often the thread looks for new frames. A saturated 1 Mbit/s bus brings
+ * less than a hundred in this time, the ring holds far more */
+#define CAPTURE_POLL_MS 10
+/* after failing to open a segment, how long to drop frames before trying
+ * again, in microseconds */
+#define CAPTURE_RETRY_US 1000000
+/* largest segment, it is mapped as a whole */
+#define CAPTURE_MAX_SEGMENT_MIB 1024
+
+static const char *ModuleName = "Capture";
+
+_Static_assert(sizeof(canbus_capture_header_t) <= CANBUS_CAPTURE_HEADER_SIZE,
+               "capture header too large");
+_Static_assert(sizeof(canbus_capture_record_t) == 24,
+               "capture record not packed");
+
+typedef struct canbus_capture {
+  vscp_buffer_ctx_t *ring;
+  canbus_capture_config_t config;
+  char directory[PATH_MAX - 64]; /* leaves room for the segment names */
+  char interface[16];
+  uint64_t cursor; /* next message in the ring to write */
+  int stop;        /* set by canbus_capture_stop() */
+  pthread_t thread;
+  /* the segment being written, header is NULL when there is none */
+  int fd;
+  char path[PATH_MAX];
+  canbus_capture_header_t *header; /* the mapping, index and records follow */
+  canbus_capture_block_t *blocks;
+  canbus_capture_record_t *records;
+  size_t size;       /* of the mapping */
+  uint64_t capacity; /* records that fit */
+  uint64_t retry_at; /* no segment until then */
+  uint64_t lost;     /* while there was no segment, told in the next one */
+  /* the segments written, oldest first, when only some are kept */
+  char (*kept)[PATH_MAX];
+  unsigned int kept_first;
+  unsigned int kept_count;
+} canbus_capture_t;
+
+static uint64_t realtime_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int canbus_capture_parse_rotate(const char *input,
+                                canbus_capture_config_t *config) {
+  unsigned int mib, secs = 0, count = 0;
+  char guard;
+  int n;
+
+  n = sscanf(input, "%u,%u,%u%c", &mib, &secs, &count, &guard);
+  if (n != 3) {
+    n = sscanf(input, "%u,%u%c", &mib, &secs, &guard);
+    if (n != 2) {
+      n = sscanf(input, "%u%c", &mib, &guard);
+      if (n != 1)
+        return -1;
+    }
+  }
+  if (mib == 0 || mib > CAPTURE_MAX_SEGMENT_MIB)
+    return -1;
+  config->segment_mib = mib;
+  config->segment_secs = secs;
+  config->segment_count = count;
+  return 0;
+}
+
+/* remember the segment just opened, removing the oldest beyond the count */
+static void segment_keep(canbus_capture_t *capture) {
+  unsigned int count = capture->config.segment_count;
+  unsigned int last;
+
+  if (count == 0)
+    return;
+  if (capture->kept_count == count) {
+    if (unlink(capture->kept[capture->kept_first]) < 0 && errno != ENOENT)
+      syslog(LOG_WARNING, "%s - remove %s - %s", ModuleName,
+             capture->kept[capture->kept_first], strerror(errno));
+    capture->kept_first = (capture->kept_first + 1) % count;
+    capture->kept_count--;
+  }
+  last = (capture->kept_first + capture->kept_count) % count;
+  strcpy(capture->kept[last], capture->path);
+  capture->kept_count++;
+}
+
+static int name_compare(const void *a, const void *b) {
+  return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/* take the segments of this interface left by earlier runs as kept, oldest
+ * first, and remove those beyond the count right away */
+static int segment_keep_existing(canbus_capture_t *capture) {
+  size_t prefix = strlen(capture->interface);
+  unsigned int count = 0, room = 0, i;
+  struct dirent *de;
+  char **names = NULL, **more;
+  DIR *dir;
+
+  if (capture->config.segment_count == 0)
+    return 0;
+  dir = opendir(capture->directory);
+  if (dir == NULL)
+    return -1;
+  /* <interface>-<16 digits>.cap, the digits sort as the times they are */
+  while ((de = readdir(dir)) != NULL) {
+    if (strncmp(de->d_name, capture->interface, prefix) != 0 ||
+        de->d_name[prefix] != '-' ||
+        strspn(de->d_name + prefix + 1, "0123456789") != 16 ||
+        strcmp(de->d_name + prefix + 17, ".cap") != 0)
+      continue;
+    if (count == room) {
+      room = room > 0 ? 2 * room : 64;
+      more = realloc(names, room * sizeof(char *));
+      if (more == NULL)
+        break;
+      names = more;
+    }
+    names[count] = strdup(de->d_name);
+    if (names[count] == NULL)
+      break;
+    count++;
+  }
+  closedir(dir);
+  if (de != NULL) {
+    for (i = 0; i < count; i++)
+      free(names[i]);
+    free(names);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  qsort(names, count, sizeof(char *), name_compare);
+  for (i = 0; i < count; i++) {
+    snprintf(capture->path, sizeof(capture->path), "%s/%s",
+             capture->directory, names[i]);
+    if (count - i > capture->config.segment_count) {
+      if (unlink(capture->path) < 0 && errno != ENOENT)
+        syslog(LOG_WARNING, "%s - remove %s - %s", ModuleName, capture->path,
+               strerror(errno));
+    } else
+      segment_keep(capture);
+    free(names[i]);
+  }
+  free(names);
+  return 0;
+}
+
+/* start a segment with the frame of 'timestamp'. The space is allocated up
+ * front: a write to the mapping that finds the disk full would be fatal */
+static int segment_open(canbus_capture_t *capture, uint64_t timestamp) {
+  canbus_capture_header_t *header;
+  uint64_t index_count, records_offset;
+  void *map;
+  int rval;
+
+  capture->size = (size_t)capture->config.segment_mib << 20;
+  /* an entry for every block there would be room for without the index */
+  index_count = (capture->size - CANBUS_CAPTURE_HEADER_SIZE) /
+                    (CANBUS_CAPTURE_BLOCK * sizeof(canbus_capture_record_t)) +
+                1;
+  records_offset = CANBUS_CAPTURE_HEADER_SIZE +
+                   ((index_count * sizeof(canbus_capture_block_t) + 4095) &
+                    ~(uint64_t)4095);
+
+  snprintf(capture->path, sizeof(capture->path), "%s/%s-%016" PRIu64 ".cap",
+           capture->directory, capture->interface, timestamp);
+  capture->fd = open(capture->path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                     0644);
+  if (capture->fd < 0)
+    goto fail;
+  rval = posix_fallocate(capture->fd, 0, capture->size);
+  if (rval != 0) {
+    errno = rval;
+    goto fail_close;
+  }
+  map = mmap(NULL, capture->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+             capture->fd, 0);
+  if (map == MAP_FAILED)
+    goto fail_close;
+
+  header = map;
+  memcpy(header->magic, CANBUS_CAPTURE_MAGIC, sizeof(header->magic));
+  header->version = CANBUS_CAPTURE_VERSION;
+  header->record_size = sizeof(canbus_capture_record_t);
+  strcpy(header->interface, capture->interface);
+  header->first_timestamp = timestamp;
+  header->last_timestamp = timestamp;
+  header->count = 0;
+  header->lost = capture->lost;
+  header->records_offset = records_offset;
+  header->block_records = CANBUS_CAPTURE_BLOCK;
+  header->index_count = index_count;
+  capture->lost = 0;
+  capture->header = header;
+  capture->blocks = (canbus_capture_block_t *)((char *)map +
+                                               CANBUS_CAPTURE_HEADER_SIZE);
+  capture->records = (canbus_capture_record_t *)((char *)map +
+                                                 records_offset);
+  capture->capacity = (capture->size - records_offset) /
+                      sizeof(canbus_capture_record_t);
+  segment_keep(capture);
+  return 0;
+
+fail_close:
+  rval = errno;
+  close(capture->fd);
+  unlink(capture->path);
+  errno = rval;
+fail:
+  syslog(LOG_ERR, "%s - %s - %s", ModuleName, capture->path, strerror(errno));
+  return -1;
+}
+
+/* unmap the segment and give back the space it didn't use */
+static void segment_close(canbus_capture_t *capture) {
+  canbus_capture_header_t *header = capture->header;
+  off_t used = header->records_offset +
+               header->count * sizeof(canbus_capture_record_t);
+
+  if (header->lost > 0)
+    syslog(LOG_WARNING, "%s - %s - %" PRIu64 " frames lost", ModuleName,
+           capture->path, header->lost);
+  munmap(header, capture->size);
+  capture->header = NULL;
+  if (ftruncate(capture->fd, used) < 0)
+    syslog(LOG_WARNING, "%s - truncate %s - %s", ModuleName, capture->path,
+           strerror(errno));
+  close(capture->fd);
+}
+
+static void capture_lost(canbus_capture_t *capture, uint64_t count) {
+  if (capture->header != NULL)
+    capture->header->lost += count;
+  else
+    capture->lost += count;
+}
+
+static void capture_write(canbus_capture_t *capture,
+                          const vscp_buffer_entry_t *entry) {
+  canbus_capture_header_t *header = capture->header;
+  canbus_capture_record_t *record;
+  canbus_capture_block_t *block;
+  uint64_t secs = capture->config.segment_secs;
+  unsigned int class, nickname;
+
+  if (header != NULL &&
+      (header->count == capture->capacity ||
+       (secs > 0 && entry->timestamp >= header->first_timestamp +
+                                             secs * 1000000)))
+    segment_close(capture);
+  if (capture->header == NULL) {
+    if (realtime_us() < capture->retry_at ||
+        segment_open(capture, entry->timestamp) < 0) {
+      if (realtime_us() >= capture->retry_at)
+        capture->retry_at = realtime_us() + CAPTURE_RETRY_US;
+      capture->lost++;
+      return;
+    }
+    header = capture->header;
+  }
+
+  block = &(capture->blocks[header->count / CANBUS_CAPTURE_BLOCK]);
+  if (header->count % CANBUS_CAPTURE_BLOCK == 0) {
+    block->first_timestamp = entry->timestamp;
+    block->last_timestamp = entry->timestamp;
+  }
+  /* frames sent by clients may be stamped a bit out of order */
+  if (entry->timestamp < block->first_timestamp)
+    block->first_timestamp = entry->timestamp;
+  if (entry->timestamp > block->last_timestamp)
+    block->last_timestamp = entry->timestamp;
+  /* only VSCP frames are looked up by class and nickname */
+  if (vscp_frame_check(&(entry->frame)) == 0) {
+    class = (entry->frame.can_id >> 16) & 0x1FF;
+    nickname = entry->frame.can_id & 0xFF;
+    block->classes |= 1ULL << (class % 64);
+    block->nicknames |= 1ULL << (nickname % 64);
+    header->classes[class / 64] |= 1ULL << (class % 64);
+    header->nicknames[nickname / 64] |= 1ULL << (nickname % 64);
+  }
+
+  record = &(capture->records[header->count]);
+  record->timestamp = entry->timestamp;
+  record->can_id = entry->frame.can_id;
+  record->dlc = entry->frame.can_dlc;
+  record->flags = entry->origin != NULL ? CANBUS_CAPTURE_TX : 0;
+  memcpy(record->data, entry->frame.data, sizeof(record->data));
+  if (entry->timestamp < header->first_timestamp)
+    header->first_timestamp = entry->timestamp;
+  if (entry->timestamp > header->last_timestamp)
+    header->last_timestamp = entry->timestamp;
+  /* a reader of the file sees the record and its index before it is
+   * counted */
+  __atomic_store_n(&(header->count), header->count + 1, __ATOMIC_RELEASE);
+}
+
+static void *capture_thread(void *arg) {
+  canbus_capture_t *capture = arg;
+  vscp_buffer_entry_t entries[CAPTURE_BATCH];
+  const struct timespec poll = {0, CAPTURE_POLL_MS * 1000000};
+  unsigned int i, n;
+  uint64_t tail;
+  int stop;
+
+  do {
+    /* what came before the stop is still written */
+    stop = __atomic_load_n(&(capture->stop), __ATOMIC_ACQUIRE);
+    while (1) {
+      n = vscp_buffer_get_bulk(capture->ring, capture->cursor, entries,
+                               CAPTURE_BATCH);
+      if (n == 0) {
+        tail = vscp_buffer_tail(capture->ring);
+        if (capture->cursor >= tail)
+          break;
+        /* the ring went round before we got to these */
+        capture_lost(capture, tail - capture->cursor);
+        capture->cursor = tail;
+        continue;
+      }
+      for (i = 0; i < n; i++)
+        capture_write(capture, &entries[i]);
+      capture->cursor += n;
+    }
+    if (!stop)
+      nanosleep(&poll, NULL);
+  } while (!stop);
+
+  if (capture->header != NULL)
+    segment_close(capture);
+  return NULL;
+}
+
+canbus_capture_t *canbus_capture_start(canbus_t *bus, const char *name,
+                                       const canbus_capture_config_t *config,
+                                       char *error, size_t error_size) {
+  canbus_capture_t *capture;
+  struct stat st;
+  int rval;
+
+  errno = 0;
+  if (stat(config->directory, &st) < 0 || !S_ISDIR(st.st_mode) ||
+      access(config->directory, W_OK) < 0) {
+    snprintf(error, error_size, "capture directory [%s] error: %s",
+             config->directory,
+             errno != 0 ? strerror(errno) : "not a directory");
+    return NULL;
+  }
+  if (strlen(config->directory) >= sizeof(capture->directory)) {
+    snprintf(error, error_size, "capture directory name too long");
+    return NULL;
+  }
+
+  capture = calloc(1, sizeof(canbus_capture_t));
+  if (capture == NULL) {
+    snprintf(error, error_size, "out of memory");
+    return NULL;
+  }
+  if (config->segment_count > 0) {
+    capture->kept = calloc(config->segment_count, PATH_MAX);
+    if (capture->kept == NULL) {
+      snprintf(error, error_size, "out of memory");
+      free(capture);
+      return NULL;
+    }
+  }
+  capture->ring = canbus_raw_ring(bus);
+  capture->config = *config;
+  snprintf(capture->directory, sizeof(capture->directory), "%s",
+           config->directory);
+  capture->config.directory = capture->directory;
+  snprintf(capture->interface, sizeof(capture->interface), "%s", name);
+  capture->cursor = vscp_buffer_head(capture->ring);
+  capture->fd = -1;
+  if (segment_keep_existing(capture) < 0) {
+    snprintf(error, error_size, "capture directory [%s] error: %s",
+             config->directory, strerror(errno));
+    free(capture->kept);
+    free(capture);
+    return NULL;
+  }
+
+  rval = pthread_create(&(capture->thread), NULL, &capture_thread, capture);
+  if (rval != 0) {
+    snprintf(error, error_size, "capture thread: %s", strerror(rval));
+    free(capture->kept);
+    free(capture);
+    return NULL;
+  }
+  return capture;
+}
+
+void canbus_capture_stop(canbus_capture_t *capture) {
+  __atomic_store_n(&(capture->stop), 1, __ATOMIC_RELEASE);
+  pthread_join(capture->thread, NULL);
+  free(capture->kept);
+  free(capture);
+}
+
+int canbus_capture_export(const char *path, FILE *out, char *error,
+                          size_t error_size) {
+  canbus_capture_header_t header;
+  canbus_capture_record_t records[CAPTURE_BATCH];
+  uint64_t left;
+  size_t i, n;
+  int j, k;
+  char line[80];
+  FILE *in;
+
+  in = fopen(path, "rb");
+  if (in == NULL) {
+    snprintf(error, error_size, "%s: %s", path, strerror(errno));
+    return -1;
+  }
+  if (fread(&header, sizeof(header), 1, in) != 1 ||
+      memcmp(header.magic, CANBUS_CAPTURE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != CANBUS_CAPTURE_VERSION ||
+      header.record_size != sizeof(canbus_capture_record_t) ||
+      fseek(in, header.records_offset, SEEK_SET) < 0) {
+    snprintf(error, error_size, "%s: not a capture segment", path);
+    fclose(in);
+    return -1;
+  }
+  header.interface[sizeof(header.interface) - 1] = 0;
+
+  /* (<seconds>.<microseconds>) <interface> <id>#<data>, as candump -l */
+  left = header.count;
+  while (left > 0 &&
+         (n = fread(records, sizeof(records[0]),
+                    left < CAPTURE_BATCH ? left : CAPTURE_BATCH, in)) > 0) {
+    for (i = 0; i < n; i++) {
+      if (records[i].can_id & CAN_ERR_FLAG)
+        k = snprintf(line, sizeof(line), "%08X#",
+                     records[i].can_id & (CAN_ERR_FLAG | CAN_ERR_MASK));
+      else if (records[i].can_id & CAN_EFF_FLAG)
+        k = snprintf(line, sizeof(line), "%08X#",
+                     records[i].can_id & CAN_EFF_MASK);
+      else
+        k = snprintf(line, sizeof(line), "%03X#",
+                     records[i].can_id & CAN_SFF_MASK);
+      if (records[i].can_id & CAN_RTR_FLAG)
+        line[k++] = 'R';
+      else
+        for (j = 0; j < records[i].dlc && j < 8; j++)
+          k += snprintf(line + k, sizeof(line) - k, "%02X",
+                        records[i].data[j]);
+      line[k] = 0;
+      fprintf(out, "(%" PRIu64 ".%06" PRIu64 ") %s %s\n",
+              records[i].timestamp / 1000000, records[i].timestamp % 1000000,
+              header.interface, line);
+    }
+    left -= n;
+  }
+  fclose(in);
+  return 0;
+}
@@ -0,0 +1,107 @@
+// uvscpd - Minimalist VSCP Daemon
+// Copyright (C) 2019 Maarten Zanders
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _CANBUS_CAPTURE_H_
+#define _CANBUS_CAPTURE_H_
+
+/* Capture of all bus traffic to disk. A thread of its own follows the bus
+ * ring like a client would and appends every frame to a segment file, a
+ * header followed by fixed size records, written through a shared mapping.
+ * Segments are rotated by size or age. The event loop never waits for it: a
+ * capture that can't keep up loses the frames the ring overwrote, and counts
+ * them in the segment header.
+ *
+ * For looking up frames later on without reading all of them, the header
+ * tells which classes and nicknames a segment holds, and an index between
+ * the header and the records tells, for every block of records, the time it
+ * spans and a small bloom filter of its classes and nicknames. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include "canbus.h"
+
+#define CANBUS_CAPTURE_MAGIC "UVSCPCAP"
+#define CANBUS_CAPTURE_VERSION 2
+#define CANBUS_CAPTURE_HEADER_SIZE 4096
+#define CANBUS_CAPTURE_BLOCK 1024 // records per index entry
+
+// A segment starts with this, in host byte order, padded to the header size
+typedef struct {
+  char magic[8];            // CANBUS_CAPTURE_MAGIC, not terminated
+  uint32_t version;         // CANBUS_CAPTURE_VERSION
+  uint32_t record_size;     // sizeof(canbus_capture_record_t)
+  char interface[16];       // the CAN interface, terminated
+  uint64_t first_timestamp; // the earliest record, microseconds since epoch
+  uint64_t last_timestamp;  // the latest record
+  uint64_t count;           // number of records
+  uint64_t lost;            // frames the capture missed while writing it
+  uint64_t records_offset;  // where the records start in the file
+  uint32_t block_records;   // records per index entry
+  uint32_t index_count;     // index entries, right after the header
+  uint64_t classes[8];      // a bit for every VSCP class in the segment
+  uint64_t nicknames[4];    // and for every nickname
+} canbus_capture_header_t;
+
+// The index entry of a block of records
+typedef struct {
+  uint64_t first_timestamp; // the earliest of its records
+  uint64_t last_timestamp;  // the latest
+  uint64_t classes;         // bit (class % 64) for every class in it
+  uint64_t nicknames;       // bit (nickname % 64) for every nickname
+} canbus_capture_block_t;
+
+// One frame, as received or sent
+typedef struct {
+  uint64_t timestamp; // microseconds since the epoch
+  uint32_t can_id;    // with the CAN_EFF_FLAG as on the socket
+  uint8_t dlc;
+  uint8_t flags; // CANBUS_CAPTURE_TX
+  uint8_t reserved[2];
+  uint8_t data[8];
+} canbus_capture_record_t;
+
+#define CANBUS_CAPTURE_TX 0x01 // sent by a client of uvscpd
+
+typedef struct {
+  const char *directory;      // where the segments go
+  unsigned int segment_mib;   // rotate when a segment is this large
+  unsigned int segment_secs;  // or spans this many seconds, 0 for no limit
+  unsigned int segment_count; // keep this many, 0 keeps all of them
+} canbus_capture_config_t;
+
+typedef struct canbus_capture canbus_capture_t;
+
+// Parse "<MiB>[,<seconds>[,<segments>]]" into 'config'. Returns 0 on success.
+int canbus_capture_parse_rotate(const char *input,
+                                canbus_capture_config_t *config);
+
+// Start capturing what comes into the raw ring of 'bus' from now on, on the
+// interface 'name'. The bus has to keep one, see canbus_keep_raw().
+// Returns NULL on failure, with a description of the problem in 'error'.
+canbus_capture_t *canbus_capture_start(canbus_t *bus, const char *name,
+                                       const canbus_capture_config_t *config,
+                                       char *error, size_t error_size);
+
+// Write out what is left in the ring, close the segment and stop. To be
+// called before the bus is closed.
+void canbus_capture_stop(canbus_capture_t *capture);
+
+// Write segment 'path' to 'out' in candump log format. Returns 0 on success,
+// -1 with a description of the problem in 'error'.
+int canbus_capture_export(const char *path, FILE *out, char *error,
+                          size_t error_size);
+
+#endif /* _CANBUS_CAPTURE_H_ */
@@ -0,0 +1,305 @@
+// uvscpd - Minimalist VSCP Daemon
+// Copyright (C) 2019 Maarten Zanders
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "canbus_history.h"
+#include "vscp.h"
+
+#define CLASS(id) (((id) >> 16) & 0x1FF)
+#define NICKNAME(id) ((id)&0xFF)
+
+typedef struct canbus_history {
+  uint64_t from, to;
+  struct can_filter filters[VSCP_SUBSCRIPTION_MAX_FILTERS];
+  unsigned int count; /* 0: all */
+  /* the classes and nicknames the filters may pass, and the same folded as
+   * the index entries are */
+  uint64_t classes[8];
+  uint64_t nicknames[4];
+  uint64_t block_classes;
+  uint64_t block_nicknames;
+  /* the segment files, in the order they were started */
+  char **paths;
+  unsigned int path_count;
+  unsigned int next_path;
+  /* the segment being read, fd < 0 when none */
+  int fd;
+  canbus_capture_header_t header;
+  canbus_capture_block_t *index;
+  uint64_t blocks; /* in the index */
+  uint64_t block;  /* next one to look at */
+  canbus_history_stats_t stats;
+} canbus_history_t;
+
+/* same semantics as a CAN_RAW_FILTER on the socket */
+static int history_match(const canbus_history_t *history, canid_t id) {
+  unsigned int i;
+  int hit;
+
+  if (history->count == 0)
+    return 1;
+  for (i = 0; i < history->count; i++) {
+    hit = ((id ^ history->filters[i].can_id) & history->filters[i].can_mask &
+           ~(canid_t)CAN_INV_FILTER) == 0;
+    if (history->filters[i].can_id & CAN_INV_FILTER ? !hit : hit)
+      return 1;
+  }
+  return 0;
+}
+
+/* a capture has the other frames on the bus too, they are no events */
+static int records_vscp(const canbus_capture_record_t *record) {
+  struct can_frame frame;
+
+  frame.can_id = record->can_id;
+  frame.can_dlc = record->dlc;
+  return vscp_frame_check(&frame) == 0;
+}
+
+/* which classes and nicknames any of the filters lets through */
+static void history_keys(canbus_history_t *history) {
+  const struct can_filter *filter;
+  unsigned int i, key;
+
+  if (history->count == 0) {
+    memset(history->classes, 0xFF, sizeof(history->classes));
+    memset(history->nicknames, 0xFF, sizeof(history->nicknames));
+  }
+  for (i = 0; i < history->count; i++) {
+    filter = &(history->filters[i]);
+    for (key = 0; key < 512; key++)
+      if ((filter->can_id & CAN_INV_FILTER) ||
+          CLASS((key << 16 ^ filter->can_id) & filter->can_mask) == 0)
+        history->classes[key / 64] |= 1ULL << (key % 64);
+    for (key = 0; key < 256; key++)
+      if ((filter->can_id & CAN_INV_FILTER) ||
+          NICKNAME((key ^ filter->can_id) & filter->can_mask) == 0)
+        history->nicknames[key / 64] |= 1ULL << (key % 64);
+  }
+  for (i = 0; i < 8; i++)
+    history->block_classes |= history->classes[i];
+  for (i = 0; i < 4; i++)
+    history->block_nicknames |= history->nicknames[i];
+}
+
+static int bits_meet(const uint64_t *a, const uint64_t *b, unsigned int n) {
+  unsigned int i;
+  for (i = 0; i < n; i++)
+    if (a[i] & b[i])
+      return 1;
+  return 0;
+}
+
+/* "<interface>-<first timestamp>.cap", by timestamp */
+static int path_compare(const void *a, const void *b) {
+  const char *pa = *(const char *const *)a, *pb = *(const char *const *)b;
+  const char *ta = strrchr(pa, '-'), *tb = strrchr(pb, '-');
+  int rval = strcmp(ta != NULL ? ta : pa, tb != NULL ? tb : pb);
+  return rval != 0 ? rval : strcmp(pa, pb);
+}
+
+static int history_list(canbus_history_t *history, const char *directory) {
+  struct dirent *de;
+  unsigned int room = 0;
+  size_t length;
+  char **paths;
+  DIR *dir;
+
+  dir = opendir(directory);
+  if (dir == NULL)
+    return -1;
+  while ((de = readdir(dir)) != NULL) {
+    length = strlen(de->d_name);
+    if (length < 4 || strcmp(de->d_name + length - 4, ".cap") != 0)
+      continue;
+    if (history->path_count == room) {
+      room = room > 0 ? 2 * room : 64;
+      paths = realloc(history->paths, room * sizeof(char *));
+      if (paths == NULL)
+        break;
+      history->paths = paths;
+    }
+    length += strlen(directory) + 2;
+    history->paths[history->path_count] = malloc(length);
+    if (history->paths[history->path_count] == NULL)
+      break;
+    snprintf(history->paths[history->path_count++], length, "%s/%s",
+             directory, de->d_name);
+  }
+  closedir(dir);
+  if (de != NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  qsort(history->paths, history->path_count, sizeof(char *), path_compare);
+  return 0;
+}
+
+canbus_history_t *canbus_history_open(const char *directory, uint64_t from,
+                                      uint64_t to,
+                                      const struct can_filter *filters,
+                                      unsigned int count, char *error,
+                                      size_t error_size) {
+  canbus_history_t *history;
+
+  history = calloc(1, sizeof(canbus_history_t));
+  if (history == NULL) {
+    snprintf(error, error_size, "out of memory");
+    return NULL;
+  }
+  history->from = from;
+  history->to = to;
+  if (count > VSCP_SUBSCRIPTION_MAX_FILTERS)
+    count = VSCP_SUBSCRIPTION_MAX_FILTERS;
+  memcpy(history->filters, filters, count * sizeof(struct can_filter));
+  history->count = count;
+  history->fd = -1;
+  history_keys(history);
+
+  if (history_list(history, directory) < 0) {
+    snprintf(error, error_size, "capture directory [%s] error: %s",
+             directory, strerror(errno));
+    canbus_history_close(history);
+    return NULL;
+  }
+  return history;
+}
+
+/* open the next segment that may hold matches. Returns -1 when there are
+ * none left, -2 on a read error */
+static int history_next_segment(canbus_history_t *history) {
+  canbus_capture_header_t *header = &(history->header);
+  canbus_capture_block_t *index;
+  size_t size;
+
+  while (history->next_path < history->path_count) {
+    history->fd = open(history->paths[history->next_path++],
+                       O_RDONLY | O_CLOEXEC);
+    if (history->fd < 0)
+      continue; /* rotated away in the meantime */
+    history->stats.segments++;
+
+    if (pread(history->fd, header, sizeof(*header), 0) != sizeof(*header) ||
+        memcmp(header->magic, CANBUS_CAPTURE_MAGIC, sizeof(header->magic)) ||
+        header->version != CANBUS_CAPTURE_VERSION ||
+        header->record_size != sizeof(canbus_capture_record_t) ||
+        header->block_records != CANBUS_CAPTURE_BLOCK || header->count == 0 ||
+        header->first_timestamp >= history->to ||
+        header->last_timestamp < history->from ||
+        !bits_meet(header->classes, history->classes, 8) ||
+        !bits_meet(header->nicknames, history->nicknames, 4)) {
+      history->stats.segments_skipped++;
+      close(history->fd);
+      history->fd = -1;
+      continue;
+    }
+
+    history->blocks = (header->count + CANBUS_CAPTURE_BLOCK - 1) /
+                      CANBUS_CAPTURE_BLOCK;
+    if (history->blocks > header->index_count)
+      history->blocks = header->index_count;
+    size = history->blocks * sizeof(canbus_capture_block_t);
+    index = realloc(history->index, size);
+    if (index == NULL ||
+        pread(history->fd, index, size, CANBUS_CAPTURE_HEADER_SIZE) !=
+            (ssize_t)size) {
+      if (index != NULL)
+        history->index = index;
+      close(history->fd);
+      history->fd = -1;
+      return -2;
+    }
+    history->index = index;
+    history->block = 0;
+    return 0;
+  }
+  return -1;
+}
+
+int canbus_history_read(canbus_history_t *history,
+                        canbus_capture_record_t *records) {
+  canbus_capture_header_t *header = &(history->header);
+  canbus_capture_block_t *entry;
+  uint64_t first;
+  ssize_t size;
+  int i, n, rval;
+
+  while (1) {
+    if (history->fd < 0) {
+      rval = history_next_segment(history);
+      if (rval < 0)
+        return rval;
+    }
+    if (history->block == history->blocks) {
+      close(history->fd);
+      history->fd = -1;
+      continue;
+    }
+
+    entry = &(history->index[history->block++]);
+    if (entry->first_timestamp >= history->to ||
+        entry->last_timestamp < history->from ||
+        !(entry->classes & history->block_classes) ||
+        !(entry->nicknames & history->block_nicknames)) {
+      history->stats.blocks_skipped++;
+      continue;
+    }
+
+    first = (history->block - 1) * CANBUS_CAPTURE_BLOCK;
+    n = header->count - first < CANBUS_CAPTURE_BLOCK ? header->count - first
+                                                     : CANBUS_CAPTURE_BLOCK;
+    size = pread(history->fd, records, n * sizeof(canbus_capture_record_t),
+                 header->records_offset +
+                     first * sizeof(canbus_capture_record_t));
+    if (size != (ssize_t)(n * sizeof(canbus_capture_record_t)))
+      return -2;
+    history->stats.blocks++;
+
+    /* the index only tells what may be there */
+    rval = 0;
+    for (i = 0; i < n; i++)
+      if (records_vscp(&records[i]) &&
+          records[i].timestamp >= history->from &&
+          records[i].timestamp < history->to &&
+          history_match(history, records[i].can_id))
+        records[rval++] = records[i];
+    return rval;
+  }
+}
+
+void canbus_history_stats(canbus_history_t *history,
+                          canbus_history_stats_t *stats) {
+  *stats = history->stats;
+}
+
+void canbus_history_close(canbus_history_t *history) {
+  unsigned int i;
+
+  if (history->fd >= 0)
+    close(history->fd);
+  for (i = 0; i < history->path_count; i++)
+    free(history->paths[i]);
+  free(history->paths);
+  free(history->index);
+  free(history);
+}
@@ -0,0 +1,61 @@
+// uvscpd - Minimalist VSCP Daemon
+// Copyright (C) 2019 Maarten Zanders
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _CANBUS_HISTORY_H_
+#define _CANBUS_HISTORY_H_
+
+/* Lookup of captured frames by time, class, type and nickname. Segments are
+ * passed over by their header when their time span, classes or nicknames
+ * don't fit, and blocks of records by their index entry, so only the blocks
+ * that may hold a match are read. A lookup is read a block at a time, the
+ * caller decides how much to do at once. */
+
+#include <stdint.h>
+#include <linux/can.h>
+#include "canbus_capture.h"
+
+typedef struct canbus_history canbus_history_t;
+
+typedef struct {
+  unsigned int segments;         // segment files looked at
+  unsigned int segments_skipped; // by their header alone
+  unsigned long blocks;          // blocks of records read
+  unsigned long blocks_skipped;  // by their index entry alone
+} canbus_history_stats_t;
+
+// Look up the frames captured in 'directory' from 'from' up to, not
+// including, 'to' (microseconds since the epoch) that pass any of the
+// CAN_RAW_FILTER pairs in 'filters', all of them when 'count' is 0. Returns
+// NULL on failure, with a description of the problem in 'error'.
+canbus_history_t *canbus_history_open(const char *directory, uint64_t from,
+                                      uint64_t to,
+                                      const struct can_filter *filters,
+                                      unsigned int count, char *error,
+                                      size_t error_size);
+
+// Read the next block that may hold matches, keeping those that do in
+// 'records', which has room for CANBUS_CAPTURE_BLOCK. Returns their number,
+// which may be 0, -1 when there are no more, -2 on a read error.
+int canbus_history_read(canbus_history_t *history,
+                        canbus_capture_record_t *records);
+
+// What the lookup read and passed over so far
+void canbus_history_stats(canbus_history_t *history,
+                          canbus_history_stats_t *stats);
+
+void canbus_history_close(canbus_history_t *history);
+
+#endif /* _CANBUS_HISTORY_H_ */
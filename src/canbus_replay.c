@@ -0,0 +1,302 @@
+// uvscpd - Minimalist VSCP Daemon
+// Copyright (C) 2019 Maarten Zanders
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "canbus_backend.h"
+
+/* Frames from a candump log, "(<seconds>.<fraction>) <interface>
+ * <id>#<data>" per line as candump -l and --export write them. They are
+ * received at the pace of their timestamps, divided by the speed, counting
+ * from the first one; a timer tells the event loop when the next is due. */
+
+static const char *ModuleName = "CANReplay";
+
+typedef struct {
+  canbus_backend_t backend;
+  FILE *log;
+  char *path;
+  double speed;   /* 1 for as logged, 0 for as fast as they're taken */
+  int timer;      /* timerfd, readable when the next frame is due */
+  uint64_t start; /* CLOCK_MONOTONIC when the first frame was due */
+  uint64_t first; /* timestamp of the first frame in the log */
+  int have_next;
+  struct can_frame next;
+  uint64_t next_timestamp;
+  unsigned long line; /* of the log, for errors */
+  unsigned long frames, skipped;
+} replay_t;
+
+static uint64_t monotonic_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int hex_digit(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+/* a frame of the log, 0 on success. CAN FD and malformed lines are -1 */
+static int parse_line(const char *line, struct can_frame *frame,
+                      uint64_t *timestamp) {
+  unsigned long seconds, fraction;
+  const char *p, *id, *hash;
+  int digits, high, low;
+
+  if (sscanf(line, "(%lu.%lu)", &seconds, &fraction) != 2)
+    return -1;
+  p = strchr(line, '.') + 1;
+  for (digits = 0; p[digits] >= '0' && p[digits] <= '9'; digits++)
+    ;
+  for (; digits < 6; digits++)
+    fraction *= 10;
+  for (; digits > 6; digits--)
+    fraction /= 10;
+  *timestamp = (uint64_t)seconds * 1000000 + fraction;
+
+  /* the identifier follows the interface */
+  p = strchr(line, ')');
+  if (p == NULL || p[1] != ' ' || (id = strchr(p + 2, ' ')) == NULL)
+    return -1;
+  id++;
+  hash = strchr(id, '#');
+  if (hash == NULL || hash == id || hash - id > 8 || hash[1] == '#')
+    return -1;
+
+  memset(frame, 0, sizeof(*frame));
+  for (p = id; p < hash; p++) {
+    if ((high = hex_digit(*p)) < 0)
+      return -1;
+    frame->can_id = frame->can_id << 4 | high;
+  }
+  /* 29 bit identifiers are written with 8 digits, 11 bit ones with 3 */
+  if (hash - id > 3)
+    frame->can_id |= CAN_EFF_FLAG;
+
+  p = hash + 1;
+  if (*p == 'R' || *p == 'r') {
+    frame->can_id |= CAN_RTR_FLAG;
+    return 0;
+  }
+  while ((high = hex_digit(p[0])) >= 0 && (low = hex_digit(p[1])) >= 0) {
+    if (frame->can_dlc == 8)
+      return -1;
+    frame->data[frame->can_dlc++] = high << 4 | low;
+    p += 2;
+    if (*p == '.')
+      p++;
+  }
+  /* an odd digit or anything else left in the data is an error */
+  if (*p != 0 && *p != ' ' && *p != '\r' && *p != '\n')
+    return -1;
+  return 0;
+}
+
+/* read the next frame of the log, 0 when there was one */
+static int replay_next(replay_t *replay) {
+  char line[256];
+  size_t length;
+  int c, too_long;
+
+  while (fgets(line, sizeof(line), replay->log) != NULL) {
+    replay->line++;
+    /* no frame is that long, pass over the rest of it */
+    length = strlen(line);
+    too_long = length == sizeof(line) - 1 && line[length - 1] != '\n';
+    if (too_long)
+      while ((c = fgetc(replay->log)) != EOF && c != '\n')
+        ;
+    if (!too_long &&
+        parse_line(line, &(replay->next), &(replay->next_timestamp)) == 0) {
+      replay->have_next = 1;
+      return 0;
+    }
+    syslog(LOG_ERR, "%s - %s:%lu - not a candump frame, skipped", ModuleName,
+           replay->path, replay->line);
+    replay->skipped++;
+  }
+  replay->have_next = 0;
+  syslog(LOG_INFO, "%s - %s - done, %lu frames, %lu lines skipped",
+         ModuleName, replay->path, replay->frames, replay->skipped);
+  return -1;
+}
+
+/* CLOCK_MONOTONIC when the next frame is due */
+static uint64_t replay_due(replay_t *replay) {
+  if (replay->speed == 0 || replay->next_timestamp <= replay->first)
+    return replay->start;
+  return replay->start +
+         (uint64_t)((replay->next_timestamp - replay->first) / replay->speed);
+}
+
+/* wake up the event loop at 'due' */
+static void replay_arm(replay_t *replay, uint64_t due) {
+  struct itimerspec its;
+
+  memset(&its, 0, sizeof(its));
+  /* never 0, that would disarm it; one in the past fires right away */
+  if (due == 0)
+    due = 1;
+  its.it_value.tv_sec = due / 1000000;
+  its.it_value.tv_nsec = (due % 1000000) * 1000;
+  timerfd_settime(replay->timer, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/* "<file>[,<speed>]", the file taken whole when what follows its last comma
+ * isn't a number */
+static canbus_backend_t *replay_open(const char *arg, char *error,
+                                     size_t error_size) {
+  const char *comma = strrchr(arg, ',');
+  char *end;
+  replay_t *replay;
+
+  replay = calloc(1, sizeof(replay_t));
+  if (replay == NULL) {
+    snprintf(error, error_size, "out of memory");
+    return NULL;
+  }
+  replay->backend.ops = &canbus_replay;
+  replay->speed = 1;
+  replay->timer = -1;
+  if (comma != NULL) {
+    replay->speed = strtod(comma + 1, &end);
+    if (end == comma + 1 || *end != 0) {
+      replay->speed = 1;
+      comma = NULL;
+    } else if (!isfinite(replay->speed) || replay->speed < 0) {
+      snprintf(error, error_size, "replay [%s] error: speed not valid", arg);
+      free(replay);
+      return NULL;
+    }
+  }
+  replay->path = comma != NULL ? strndup(arg, comma - arg) : strdup(arg);
+  if (replay->path == NULL) {
+    snprintf(error, error_size, "out of memory");
+    free(replay);
+    return NULL;
+  }
+
+  replay->log = fopen(replay->path, "re");
+  if (replay->log == NULL) {
+    snprintf(error, error_size, "replay [%s] error: %s", replay->path,
+             strerror(errno));
+    goto fail;
+  }
+  replay->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (replay->timer < 0) {
+    snprintf(error, error_size, "replay timer error: %s", strerror(errno));
+    goto fail;
+  }
+
+  /* the first frame is due right away */
+  if (replay_next(replay) == 0) {
+    replay->first = replay->next_timestamp;
+    replay->start = monotonic_us();
+    replay_arm(replay, replay->start);
+  }
+  return &(replay->backend);
+
+fail:
+  if (replay->log != NULL)
+    fclose(replay->log);
+  free(replay->path);
+  free(replay);
+  return NULL;
+}
+
+static void replay_close(canbus_backend_t *backend) {
+  replay_t *replay = (replay_t *)backend;
+
+  close(replay->timer);
+  fclose(replay->log);
+  free(replay->path);
+  free(replay);
+}
+
+static int replay_fd(canbus_backend_t *backend) {
+  return ((replay_t *)backend)->timer;
+}
+
+static int replay_recv(canbus_backend_t *backend, struct can_frame *frames,
+                       uint64_t *timestamps, unsigned int max) {
+  replay_t *replay = (replay_t *)backend;
+  struct timeval tv;
+  uint64_t expirations, now, due, timestamp = 0;
+  unsigned int count = 0;
+
+  if (read(replay->timer, &expirations, sizeof(expirations)) < 0 &&
+      errno != EAGAIN)
+    return -1;
+
+  now = monotonic_us();
+  while (replay->have_next && count < max) {
+    due = replay_due(replay);
+    if (due > now)
+      break;
+    /* received now, the pace is what is replayed */
+    if (timestamp == 0) {
+      gettimeofday(&tv, NULL);
+      timestamp = (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_usec;
+    }
+    frames[count] = replay->next;
+    timestamps[count] = timestamp;
+    count++;
+    replay->frames++;
+    replay_next(replay);
+  }
+  /* when the next one is due, right away when it is already */
+  if (replay->have_next)
+    replay_arm(replay, replay_due(replay));
+
+  if (count == 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+  return count;
+}
+
+/* there is no bus to send on, what is sent is taken at once */
+static int replay_send(canbus_backend_t *backend,
+                       const struct can_frame *frames, unsigned int count) {
+  return count;
+}
+
+const canbus_backend_ops_t canbus_replay = {.name = "replay",
+                                            .open = replay_open,
+                                            .close = replay_close,
+                                            .fd = replay_fd,
+                                            .recv = replay_recv,
+                                            .send = replay_send,
+                                            .filter = NULL,
+                                            .changes_fd = NULL,
+                                            .error_frames = NULL};
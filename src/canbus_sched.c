@@ -0,0 +1,429 @@
+// uvscpd - Minimalist VSCP Daemon
+// Copyright (C) 2019 Maarten Zanders
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "canbus_sched.h"
+
+#define NONE UINT32_MAX
+/* bits on the wire of the largest frame, before bit stuffing: each turn a
+ * flow may send at least one frame */
+#define QUANTUM 131
+/* the rate cap lets this many full frames go at once after an idle spell */
+#define BURST_FRAMES 32
+
+typedef struct {
+  struct can_frame frame;
+  uint64_t queued;
+  uint32_t tag;
+  uint32_t next; /* next frame of the same flow and priority, or free slot */
+} slot_t;
+
+struct canbus_flow {
+  canbus_sched_t *sched;
+  const void *origin;
+  int closed;
+  uint32_t head[CANBUS_SCHED_PRIORITIES]; /* frames by priority, NONE if none */
+  uint32_t tail[CANBUS_SCHED_PRIORITIES];
+  int32_t deficit[CANBUS_SCHED_PRIORITIES]; /* bits it may send this turn */
+  canbus_flow_t *turn[CANBUS_SCHED_PRIORITIES]; /* next flow to take a turn */
+  unsigned int active; /* bit mask of the priorities it has frames for */
+  canbus_flow_stats_t stats;
+  /* refused frames the sender hasn't taken yet */
+  canbus_sched_failure_t *failures;
+  unsigned int failures_count;
+  unsigned int failures_room;
+  canbus_flow_t *next;
+};
+
+struct canbus_sched {
+  slot_t *slots;
+  uint32_t free;
+  unsigned int flow_limit;
+  canbus_flow_t *flows;
+  struct {
+    canbus_flow_t *head, *tail;
+  } turns[CANBUS_SCHED_PRIORITIES]; /* flows taking turns, by priority */
+  uint32_t rate;     /* bits per second, 0 for no cap */
+  int64_t credit;    /* bits that may be sent now, in millionths */
+  int64_t burst;     /* most credit saved up, in millionths */
+  uint64_t refilled; /* when credit was last added */
+  uint64_t deadline; /* when the cap lets the next frame go */
+  canbus_tx_stats_t stats;
+};
+
+/* bits the frame takes on the wire, leaving out bit stuffing */
+static int32_t frame_bits(const struct can_frame *frame) {
+  int32_t dlc = frame->can_dlc > 8 ? 8 : frame->can_dlc;
+
+  if (frame->can_id & CAN_RTR_FLAG)
+    dlc = 0;
+  return (frame->can_id & CAN_EFF_FLAG ? 67 : 47) + 8 * dlc;
+}
+
+/* VSCP keeps the priority in the top bits of the identifier */
+static unsigned int frame_priority(const struct can_frame *frame) {
+  if (!(frame->can_id & CAN_EFF_FLAG))
+    return CANBUS_SCHED_PRIORITIES - 1;
+  return (frame->can_id >> 26) & (CANBUS_SCHED_PRIORITIES - 1);
+}
+
+static void turn_append(canbus_sched_t *sched, canbus_flow_t *flow,
+                        unsigned int p) {
+  flow->turn[p] = NULL;
+  if (sched->turns[p].tail != NULL)
+    sched->turns[p].tail->turn[p] = flow;
+  else
+    sched->turns[p].head = flow;
+  sched->turns[p].tail = flow;
+}
+
+static void turn_prepend(canbus_sched_t *sched, canbus_flow_t *flow,
+                         unsigned int p) {
+  flow->turn[p] = sched->turns[p].head;
+  sched->turns[p].head = flow;
+  if (sched->turns[p].tail == NULL)
+    sched->turns[p].tail = flow;
+}
+
+static void turn_remove_head(canbus_sched_t *sched, unsigned int p) {
+  sched->turns[p].head = sched->turns[p].head->turn[p];
+  if (sched->turns[p].head == NULL)
+    sched->turns[p].tail = NULL;
+}
+
+/* link the frame in slot 'i' in front of or behind the others of its flow,
+ * which joins the turns of that priority when it had none */
+static void slot_link(canbus_flow_t *flow, uint32_t i, int in_front,
+                      int32_t deficit) {
+  canbus_sched_t *sched = flow->sched;
+  unsigned int p = frame_priority(&sched->slots[i].frame);
+
+  if (flow->head[p] == NONE) {
+    sched->slots[i].next = NONE;
+    flow->head[p] = flow->tail[p] = i;
+  } else if (in_front) {
+    sched->slots[i].next = flow->head[p];
+    flow->head[p] = i;
+  } else {
+    sched->slots[i].next = NONE;
+    sched->slots[flow->tail[p]].next = i;
+    flow->tail[p] = i;
+  }
+
+  if (flow->active & (1u << p)) {
+    if (in_front)
+      flow->deficit[p] += deficit;
+  } else {
+    flow->active |= 1u << p;
+    flow->deficit[p] = deficit;
+    if (in_front)
+      turn_prepend(sched, flow, p);
+    else
+      turn_append(sched, flow, p);
+  }
+
+  flow->stats.length++;
+  sched->stats.length++;
+  if (sched->stats.length > sched->stats.high_watermark)
+    sched->stats.high_watermark = sched->stats.length;
+}
+
+static void flow_unlink(canbus_flow_t *flow) {
+  canbus_flow_t **pp = &(flow->sched->flows);
+
+  while (*pp != flow)
+    pp = &((*pp)->next);
+  *pp = flow->next;
+}
+
+/* free the flows whose sender went away and whose frames all left */
+static void flows_reap(canbus_sched_t *sched) {
+  canbus_flow_t **pp = &(sched->flows);
+
+  while (*pp != NULL) {
+    canbus_flow_t *flow = *pp;
+    if (flow->closed && flow->stats.length == 0) {
+      *pp = flow->next;
+      free(flow);
+    } else
+      pp = &(flow->next);
+  }
+}
+
+canbus_sched_t *canbus_sched_create(unsigned int size) {
+  canbus_sched_t *sched;
+  unsigned int i;
+
+  assert(size > 0);
+  sched = calloc(1, sizeof(canbus_sched_t));
+  if (sched == NULL)
+    return NULL;
+  sched->slots = malloc(size * sizeof(slot_t));
+  if (sched->slots == NULL) {
+    free(sched);
+    return NULL;
+  }
+  for (i = 0; i < size; i++)
+    sched->slots[i].next = i + 1 < size ? i + 1 : NONE;
+  sched->free = 0;
+  sched->flow_limit = size > 1 ? size / 2 : 1;
+  sched->stats.size = size;
+  return sched;
+}
+
+void canbus_sched_free(canbus_sched_t *sched) {
+  while (sched->flows != NULL) {
+    canbus_flow_t *flow = sched->flows;
+    sched->flows = flow->next;
+    free(flow->failures);
+    free(flow);
+  }
+  free(sched->slots);
+  free(sched);
+}
+
+void canbus_sched_set_rate(canbus_sched_t *sched, uint32_t bits_per_second) {
+  sched->rate = bits_per_second;
+  sched->burst = (int64_t)bits_per_second * 1000000 / 50; /* 20 ms */
+  if (sched->burst < (int64_t)QUANTUM * BURST_FRAMES * 1000000)
+    sched->burst = (int64_t)QUANTUM * BURST_FRAMES * 1000000;
+  sched->credit = sched->burst;
+  sched->refilled = 0;
+  sched->deadline = 0;
+}
+
+canbus_flow_t *canbus_sched_flow_open(canbus_sched_t *sched,
+                                      const void *origin) {
+  canbus_flow_t *flow;
+  unsigned int p;
+
+  flow = calloc(1, sizeof(canbus_flow_t));
+  if (flow == NULL)
+    return NULL;
+  flow->sched = sched;
+  flow->origin = origin;
+  for (p = 0; p < CANBUS_SCHED_PRIORITIES; p++)
+    flow->head[p] = flow->tail[p] = NONE;
+  flow->next = sched->flows;
+  sched->flows = flow;
+  return flow;
+}
+
+void canbus_sched_flow_close(canbus_flow_t *flow) {
+  flow->origin = NULL;
+  flow->closed = 1;
+  free(flow->failures); /* nobody left to tell */
+  flow->failures = NULL;
+  flow->failures_count = flow->failures_room = 0;
+  if (flow->stats.length == 0) {
+    flow_unlink(flow);
+    free(flow);
+  }
+}
+
+const void *canbus_sched_flow_origin(canbus_flow_t *flow) {
+  return flow->origin;
+}
+
+int canbus_sched_push(canbus_flow_t *flow, const struct can_frame *frame,
+                      uint32_t tag, uint64_t now) {
+  canbus_sched_t *sched = flow->sched;
+  uint32_t i;
+
+  /* a single flow can't keep the others out */
+  if (sched->free == NONE || flow->stats.length >= sched->flow_limit) {
+    flow->stats.full++;
+    sched->stats.full++;
+    return -1;
+  }
+  i = sched->free;
+  sched->free = sched->slots[i].next;
+  sched->slots[i].frame = *frame;
+  sched->slots[i].queued = now;
+  sched->slots[i].tag = tag;
+  slot_link(flow, i, 0, QUANTUM);
+  flow->stats.queued++;
+  sched->stats.queued++;
+  return 0;
+}
+
+unsigned int canbus_sched_pop(canbus_sched_t *sched,
+                              canbus_sched_entry_t *entries, unsigned int max,
+                              uint64_t now) {
+  canbus_flow_t *flow;
+  unsigned int n = 0, p;
+  int32_t cost;
+  uint32_t i;
+
+  /* nothing refers to flows outside the scheduler now */
+  flows_reap(sched);
+
+  if (sched->rate > 0) {
+    if (sched->refilled == 0 || now - sched->refilled >= 1000000)
+      sched->credit = sched->burst; /* idle long enough to save up in full */
+    else
+      sched->credit += (int64_t)(now - sched->refilled) * sched->rate;
+    if (sched->credit > sched->burst)
+      sched->credit = sched->burst;
+    sched->refilled = now;
+  }
+  sched->deadline = 0;
+
+  while (n < max) {
+    for (p = 0; p < CANBUS_SCHED_PRIORITIES; p++)
+      if (sched->turns[p].head != NULL)
+        break;
+    if (p == CANBUS_SCHED_PRIORITIES)
+      break; /* empty */
+
+    flow = sched->turns[p].head;
+    i = flow->head[p];
+    cost = frame_bits(&sched->slots[i].frame);
+    if (cost > flow->deficit[p]) {
+      /* its turn is over */
+      flow->deficit[p] += QUANTUM;
+      turn_remove_head(sched, p);
+      turn_append(sched, flow, p);
+      continue;
+    }
+    if (sched->rate > 0) {
+      if (sched->credit < (int64_t)cost * 1000000) {
+        sched->deadline = now + ((int64_t)cost * 1000000 - sched->credit +
+                                 sched->rate - 1) / sched->rate;
+        break;
+      }
+      sched->credit -= (int64_t)cost * 1000000;
+    }
+    flow->deficit[p] -= cost;
+
+    entries[n].frame = sched->slots[i].frame;
+    entries[n].flow = flow;
+    entries[n].queued = sched->slots[i].queued;
+    entries[n].tag = sched->slots[i].tag;
+    n++;
+
+    flow->head[p] = sched->slots[i].next;
+    if (flow->head[p] == NONE) {
+      flow->tail[p] = NONE;
+      flow->active &= ~(1u << p);
+      flow->deficit[p] = 0;
+      turn_remove_head(sched, p);
+    }
+    sched->slots[i].next = sched->free;
+    sched->free = i;
+    flow->stats.length--;
+    sched->stats.length--;
+  }
+  return n;
+}
+
+void canbus_sched_unpop(canbus_sched_t *sched,
+                        const canbus_sched_entry_t *entries,
+                        unsigned int count) {
+  int32_t cost;
+  uint32_t i;
+
+  /* last first, so they end up in the order they were taken */
+  while (count-- > 0) {
+    const canbus_sched_entry_t *entry = &entries[count];
+    i = sched->free;
+    assert(i != NONE); /* they were just taken */
+    sched->free = sched->slots[i].next;
+    sched->slots[i].frame = entry->frame;
+    sched->slots[i].queued = entry->queued;
+    sched->slots[i].tag = entry->tag;
+    cost = frame_bits(&entry->frame);
+    slot_link(entry->flow, i, 1, cost);
+    if (sched->rate > 0)
+      sched->credit += (int64_t)cost * 1000000;
+  }
+}
+
+void canbus_sched_sent(canbus_sched_t *sched,
+                       const canbus_sched_entry_t *entries, unsigned int count,
+                       uint64_t now) {
+  canbus_flow_stats_t *stats;
+  unsigned int i;
+  uint32_t wait;
+
+  for (i = 0; i < count; i++) {
+    stats = &(entries[i].flow->stats);
+    wait = (uint32_t)(now - entries[i].queued);
+    stats->sent++;
+    stats->wait_total_us += wait;
+    if (wait > stats->wait_max_us)
+      stats->wait_max_us = wait;
+    sched->stats.wait_total_us += wait;
+    if (wait > sched->stats.wait_max_us)
+      sched->stats.wait_max_us = wait;
+  }
+}
+
+void canbus_sched_failed(canbus_sched_t *sched,
+                         const canbus_sched_entry_t *entry, int error) {
+  canbus_flow_t *flow = entry->flow;
+  canbus_sched_failure_t *failures;
+  unsigned int room;
+
+  flow->stats.errors++;
+  sched->stats.errors++;
+  if (error == 0 || flow->closed)
+    return;
+  if (flow->failures_count == flow->failures_room) {
+    room = flow->failures_room > 0 ? 2 * flow->failures_room : 16;
+    failures = realloc(flow->failures, room * sizeof(*failures));
+    if (failures == NULL)
+      return; /* still counted */
+    flow->failures = failures;
+    flow->failures_room = room;
+  }
+  flow->failures[flow->failures_count].tag = entry->tag;
+  flow->failures[flow->failures_count].error = error;
+  flow->failures_count++;
+}
+
+unsigned int canbus_sched_flow_failures(canbus_flow_t *flow,
+                                        canbus_sched_failure_t *failures,
+                                        unsigned int max) {
+  unsigned int n = flow->failures_count < max ? flow->failures_count : max;
+
+  if (n == 0)
+    return 0;
+  memcpy(failures, flow->failures, n * sizeof(*failures));
+  flow->failures_count -= n;
+  memmove(flow->failures, flow->failures + n,
+          flow->failures_count * sizeof(*failures));
+  return n;
+}
+
+unsigned int canbus_sched_length(canbus_sched_t *sched) {
+  return sched->stats.length;
+}
+
+uint64_t canbus_sched_deadline(canbus_sched_t *sched) {
+  return sched->deadline;
+}
+
+void canbus_sched_stats(canbus_sched_t *sched, canbus_tx_stats_t *stats) {
+  *stats = sched->stats;
+}
+
+void canbus_sched_flow_stats(canbus_flow_t *flow, canbus_flow_stats_t *stats) {
+  *stats = flow->stats;
+}
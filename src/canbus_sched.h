@@ -0,0 +1,131 @@
+// uvscpd - Minimalist VSCP Daemon
+// Copyright (C) 2019 Maarten Zanders
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _CANBUS_SCHED_H_
+#define _CANBUS_SCHED_H_
+
+/* Transmit scheduler of a CAN interface. Every sender has its own flow of
+ * frames. Frames leave by VSCP priority first; senders of the same priority
+ * take turns by deficit round robin, weighed by the bits each frame takes on
+ * the wire. Optionally the bits sent per second are capped. */
+
+#include <stdint.h>
+#include <linux/can.h>
+
+// VSCP priorities, 0 is the highest
+#define CANBUS_SCHED_PRIORITIES 8
+
+typedef struct canbus_sched canbus_sched_t;
+typedef struct canbus_flow canbus_flow_t;
+
+// a frame taken from the scheduler
+typedef struct {
+  struct can_frame frame;
+  canbus_flow_t *flow;
+  uint64_t queued; // CLOCK_MONOTONIC, microseconds
+  uint32_t tag;    // given by the sender to tell its frames apart
+} canbus_sched_entry_t;
+
+// a frame the interface refused after canbus_sched_pop()
+typedef struct {
+  uint32_t tag; // as given to canbus_sched_push()
+  int error;    // the errno the interface gave
+} canbus_sched_failure_t;
+
+typedef struct {
+  unsigned int length;         // frames waiting now
+  unsigned int size;           // most frames that can wait
+  unsigned int high_watermark; // most frames ever waiting
+  unsigned long queued;        // frames accepted
+  unsigned long full;          // frames refused as the queue was full
+  unsigned long errors;        // frames the interface refused
+  uint64_t wait_total_us;      // time spent waiting by all frames sent
+  uint32_t wait_max_us;        // longest time a frame waited
+} canbus_tx_stats_t;
+
+typedef struct {
+  unsigned int length;    // frames waiting now
+  unsigned long queued;   // frames accepted
+  unsigned long sent;     // frames that went out
+  unsigned long full;     // frames refused as the queue was full
+  unsigned long errors;   // frames the interface refused
+  uint64_t wait_total_us; // time spent waiting by the frames sent
+  uint32_t wait_max_us;   // longest time a frame waited
+} canbus_flow_stats_t;
+
+// Create a scheduler holding up to 'size' frames, no more than half of them
+// from a single flow. Returns NULL when out of memory.
+canbus_sched_t *canbus_sched_create(unsigned int size);
+
+// Free the scheduler and all flows
+void canbus_sched_free(canbus_sched_t *sched);
+
+// Cap the frames sent to 'bits_per_second' on the wire, 0 for no cap
+void canbus_sched_set_rate(canbus_sched_t *sched, uint32_t bits_per_second);
+
+// Open a flow for 'origin'. Returns NULL when out of memory.
+canbus_flow_t *canbus_sched_flow_open(canbus_sched_t *sched,
+                                      const void *origin);
+
+// The sender goes away. Its queued frames still leave, the flow is freed
+// when they did.
+void canbus_sched_flow_close(canbus_flow_t *flow);
+
+// Who the frames of the flow are from, NULL once it's closed
+const void *canbus_sched_flow_origin(canbus_flow_t *flow);
+
+// Queue a frame with 'tag' at time 'now'. Returns 0 on success, -1 when full.
+int canbus_sched_push(canbus_flow_t *flow, const struct can_frame *frame,
+                      uint32_t tag, uint64_t now);
+
+// Take up to 'max' frames in the order they should leave at time 'now'.
+// Returns the number taken, fewer than are queued when the rate cap says so.
+unsigned int canbus_sched_pop(canbus_sched_t *sched,
+                              canbus_sched_entry_t *entries, unsigned int max,
+                              uint64_t now);
+
+// Put back frames taken by canbus_sched_pop() that didn't leave, in front
+void canbus_sched_unpop(canbus_sched_t *sched,
+                        const canbus_sched_entry_t *entries,
+                        unsigned int count);
+
+// Frames taken left at time 'now'
+void canbus_sched_sent(canbus_sched_t *sched,
+                       const canbus_sched_entry_t *entries, unsigned int count,
+                       uint64_t now);
+
+// A frame taken was refused by the interface with 'error'. Unless 'error' is
+// 0, an open flow keeps it for canbus_sched_flow_failures().
+void canbus_sched_failed(canbus_sched_t *sched,
+                         const canbus_sched_entry_t *entry, int error);
+
+// Take up to 'max' of the refused frames the flow kept, oldest first.
+// Returns the number taken.
+unsigned int canbus_sched_flow_failures(canbus_flow_t *flow,
+                                        canbus_sched_failure_t *failures,
+                                        unsigned int max);
+
+// Number of frames queued
+unsigned int canbus_sched_length(canbus_sched_t *sched);
+
+// When the rate cap lets the next frame go, 0 when it doesn't hold it back
+uint64_t canbus_sched_deadline(canbus_sched_t *sched);
+
+// Statistics of the scheduler and of a single flow
+void canbus_sched_stats(canbus_sched_t *sched, canbus_tx_stats_t *stats);
+void canbus_sched_flow_stats(canbus_flow_t *flow, canbus_flow_stats_t *stats);
+
+#endif /* _CANBUS_SCHED_H_ */
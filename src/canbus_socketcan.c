@@ -0,0 +1,228 @@
+// uvscpd - Minimalist VSCP Daemon
+// Copyright (C) 2019 Maarten Zanders
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#define _GNU_SOURCE /* recvmmsg */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/can/bcm.h>
+#include <linux/can/raw.h>
+#include <net/if.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "canbus_backend.h"
+
+/* frames fetched with a single recvmmsg() or sent with a single sendmmsg() */
+#define SOCKETCAN_BATCH 32
+
+typedef struct {
+  canbus_backend_t backend;
+  int socket;
+  int bcm; /* CAN_BCM socket, -1 when the kernel has none */
+} socketcan_t;
+
+static canbus_backend_t *socketcan_open(const char *name, char *error,
+                                        size_t error_size) {
+  struct sockaddr_can addr;
+  struct ifreq ifr;
+  int sock_flags;
+  socketcan_t *can;
+
+  can = calloc(1, sizeof(socketcan_t));
+  if (can == NULL) {
+    snprintf(error, error_size, "out of memory");
+    return NULL;
+  }
+  can->backend.ops = &canbus_socketcan;
+  can->bcm = -1;
+
+  can->socket = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+  if (can->socket < 0) {
+    snprintf(error, error_size, "interface [%s] error: %s", name,
+             strerror(errno));
+    free(can);
+    return NULL;
+  }
+
+  memset(&addr, 0, sizeof(struct sockaddr_can));
+  strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+  ifr.ifr_name[IFNAMSIZ - 1] = 0;
+  if (ioctl(can->socket, SIOCGIFINDEX, &ifr) == -1) {
+    snprintf(error, error_size, "interface [%s] error: %s", name,
+             strerror(errno));
+    goto fail;
+  }
+
+  addr.can_family = AF_CAN;
+  addr.can_ifindex = ifr.ifr_ifindex;
+
+  /* set to non-blocking mode */
+  sock_flags = fcntl(can->socket, F_GETFL, 0);
+  fcntl(can->socket, F_SETFL, sock_flags | O_NONBLOCK);
+
+  /* receive timestamps along with the frames instead of asking for each */
+  int enable = 1;
+  setsockopt(can->socket, SOL_SOCKET, SO_TIMESTAMP, &enable, sizeof(enable));
+
+  if (bind(can->socket, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    snprintf(error, error_size, "error binding to CAN bus: %s",
+             strerror(errno));
+    goto fail;
+  }
+
+  /* change-only subscriptions, when the kernel has the broadcast manager */
+  can->bcm = socket(PF_CAN, SOCK_DGRAM | SOCK_NONBLOCK, CAN_BCM);
+  if (can->bcm >= 0 &&
+      connect(can->bcm, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(can->bcm);
+    can->bcm = -1;
+  }
+  return &(can->backend);
+
+fail:
+  close(can->socket);
+  free(can);
+  return NULL;
+}
+
+static void socketcan_close(canbus_backend_t *backend) {
+  socketcan_t *can = (socketcan_t *)backend;
+
+  if (can->bcm >= 0)
+    close(can->bcm);
+  close(can->socket);
+  free(can);
+}
+
+static int socketcan_fd(canbus_backend_t *backend) {
+  return ((socketcan_t *)backend)->socket;
+}
+
+static int socketcan_changes_fd(canbus_backend_t *backend) {
+  return ((socketcan_t *)backend)->bcm;
+}
+
+/* timestamp of a received frame, from its control message */
+static int frame_timestamp(struct msghdr *hdr, struct timeval *tv) {
+  struct cmsghdr *cmsg;
+
+  for (cmsg = CMSG_FIRSTHDR(hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMP) {
+      memcpy(tv, CMSG_DATA(cmsg), sizeof(struct timeval));
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static int socketcan_recv(canbus_backend_t *backend, struct can_frame *frames,
+                          uint64_t *timestamps, unsigned int max) {
+  socketcan_t *can = (socketcan_t *)backend;
+  struct can_frame received[SOCKETCAN_BATCH];
+  struct mmsghdr msgs[SOCKETCAN_BATCH];
+  struct iovec iov[SOCKETCAN_BATCH];
+  char control[SOCKETCAN_BATCH][CMSG_SPACE(sizeof(struct timeval))];
+  struct timeval tv, now;
+  int have_now = 0;
+  int n, i, count = 0;
+
+  if (max > SOCKETCAN_BATCH)
+    max = SOCKETCAN_BATCH;
+  for (i = 0; i < (int)max; i++) {
+    iov[i].iov_base = &received[i];
+    iov[i].iov_len = sizeof(struct can_frame);
+    memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_control = control[i];
+    msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+  }
+
+  n = recvmmsg(can->socket, msgs, max, MSG_DONTWAIT, NULL);
+  if (n < 0)
+    return -1;
+  for (i = 0; i < n; i++) {
+    if (msgs[i].msg_len != sizeof(struct can_frame))
+      continue;
+    if (frame_timestamp(&msgs[i].msg_hdr, &tv)) {
+      if (!have_now) {
+        gettimeofday(&now, NULL);
+        have_now = 1;
+      }
+      tv = now;
+    }
+    frames[count] = received[i];
+    timestamps[count] = (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_usec;
+    count++;
+  }
+  return count;
+}
+
+/* write frames with a single system call */
+static int socketcan_send(canbus_backend_t *backend,
+                          const struct can_frame *frames, unsigned int count) {
+  socketcan_t *can = (socketcan_t *)backend;
+  struct mmsghdr msgs[SOCKETCAN_BATCH];
+  struct iovec iov[SOCKETCAN_BATCH];
+  unsigned int i;
+  int sent;
+
+  if (count > SOCKETCAN_BATCH)
+    count = SOCKETCAN_BATCH;
+  memset(msgs, 0, count * sizeof(struct mmsghdr));
+  for (i = 0; i < count; i++) {
+    iov[i].iov_base = (void *)&frames[i];
+    iov[i].iov_len = sizeof(struct can_frame);
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  do {
+    sent = sendmmsg(can->socket, msgs, count, 0);
+  } while (sent < 0 && errno == EINTR);
+  return sent;
+}
+
+static int socketcan_filter(canbus_backend_t *backend,
+                            const struct can_filter *filters,
+                            unsigned int count) {
+  return setsockopt(((socketcan_t *)backend)->socket, SOL_CAN_RAW,
+                    CAN_RAW_FILTER, filters,
+                    count * sizeof(struct can_filter));
+}
+
+static int socketcan_error_frames(canbus_backend_t *backend) {
+  can_err_mask_t mask = CAN_ERR_MASK;
+
+  return setsockopt(((socketcan_t *)backend)->socket, SOL_CAN_RAW,
+                    CAN_RAW_ERR_FILTER, &mask, sizeof(mask));
+}
+
+const canbus_backend_ops_t canbus_socketcan = {
+    .name = "socketcan",
+    .open = socketcan_open,
+    .close = socketcan_close,
+    .fd = socketcan_fd,
+    .recv = socketcan_recv,
+    .send = socketcan_send,
+    .filter = socketcan_filter,
+    .changes_fd = socketcan_changes_fd,
+    .error_frames = socketcan_error_frames};
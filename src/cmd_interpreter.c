@@ -16,22 +16,44 @@
 
 
 #include <assert.h>
-#include <ctype.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "cmd_interpreter.h"
 
+/* seeds tried for a perfect hash of the commands before growing the table */
+#define MAX_HASH_SEED 1000
+
+/* the perfect hash of a command list, built once and shared by every context
+ * using that list. Kept until the process ends. */
+typedef struct cmd_hash_table {
+  const cmd_interpreter_cmd_list_t *cmd_list;
+  int num_commands;
+  uint32_t seed;
+  uint32_t mask;
+  int16_t *slots; /* index in cmd_list, -1 when empty */
+  struct cmd_hash_table *next;
+} cmd_hash_table_t;
+
+static cmd_hash_table_t *hash_tables;
+static pthread_mutex_t hash_tables_lock = PTHREAD_MUTEX_INITIALIZER;
+
 typedef struct cmd_interpreter_ctx {
   char *linebuffer;
-  char *linebuffer_work;
   char *linebuffer_history;
+  size_t history_length; /* the history line is tokenized in place too */
   int to_lower;
   int num_commands;
   size_t max_line_length;
-  char *delimiters;
+  char delimiter;           /* first of the delimiters */
+  uint8_t is_delimiter[256];
   char *writepointer;
   const cmd_interpreter_cmd_list_t *cmd_list;
+  uint32_t hash_seed;      /* copied from the shared table */
+  uint32_t hash_mask;
+  const int16_t *hash_slots;
   int max_argc;
   char **argv;
   int history_disable;
@@ -47,6 +69,68 @@ static void *my_calloc(size_t __nmemb, size_t __size) {
   return rv;
 }
 
+/* FNV-1a with a seed, mixed at the end so the low bits depend on all of it */
+static uint32_t cmd_hash(uint32_t seed, const char *cmd) {
+  uint32_t hash = 2166136261u ^ seed;
+  while (*cmd)
+    hash = (hash ^ (uint8_t)*cmd++) * 16777619u;
+  hash ^= hash >> 16;
+  hash *= 0x85EBCA6Bu;
+  hash ^= hash >> 13;
+  return hash;
+}
+
+/* find a seed that puts every command in a slot of its own, so a lookup is
+ * a single hash and string compare. The table grows until one is found. */
+static void cmd_hash_build(cmd_hash_table_t *table) {
+  uint32_t seed, slot, size = 1;
+  int i;
+
+  while (size < 2 * (uint32_t)table->num_commands)
+    size <<= 1;
+
+  for (;; size <<= 1) {
+    free(table->slots);
+    table->slots = my_calloc(size, sizeof(int16_t));
+    table->mask = size - 1;
+
+    for (seed = 0; seed < MAX_HASH_SEED; seed++) {
+      memset(table->slots, 0xFF, size * sizeof(int16_t));
+      for (i = 0; i < table->num_commands; i++) {
+        slot = cmd_hash(seed, table->cmd_list[i].cmd_string) & table->mask;
+        if (table->slots[slot] >= 0)
+          break;
+        table->slots[slot] = i;
+      }
+      if (i == table->num_commands) {
+        table->seed = seed;
+        return;
+      }
+    }
+  }
+}
+
+/* the table for 'cmd_list', built by the first context that uses it */
+static const cmd_hash_table_t *
+cmd_hash_get(const cmd_interpreter_cmd_list_t *cmd_list, int num_commands) {
+  cmd_hash_table_t *table;
+
+  pthread_mutex_lock(&hash_tables_lock);
+  for (table = hash_tables; table != NULL; table = table->next)
+    if (table->cmd_list == cmd_list && table->num_commands == num_commands)
+      break;
+  if (table == NULL) {
+    table = my_calloc(1, sizeof(cmd_hash_table_t));
+    table->cmd_list = cmd_list;
+    table->num_commands = num_commands;
+    cmd_hash_build(table);
+    table->next = hash_tables;
+    hash_tables = table;
+  }
+  pthread_mutex_unlock(&hash_tables_lock);
+  return table;
+}
+
 cmd_interpreter_ctx_t *
 cmd_interpreter_ctx_create(const cmd_interpreter_cmd_list_t *cmd_list,
                            int num_commands, int max_argc, int to_lower,
@@ -55,6 +139,7 @@ cmd_interpreter_ctx_create(const cmd_interpreter_cmd_list_t *cmd_list,
   assert(max_line_length > 1);
   assert(delimiters != NULL);
   assert(max_argc > 0);
+  assert(num_commands > 0 && num_commands < INT16_MAX);
 
   int i;
   for (i = 0; i < num_commands; i++) {
@@ -65,18 +150,26 @@ cmd_interpreter_ctx_create(const cmd_interpreter_cmd_list_t *cmd_list,
   cmd_interpreter_ctx_t *ctx = my_calloc(1, sizeof(cmd_interpreter_ctx_t));
 
   ctx->linebuffer = my_calloc(1, max_line_length + 1);
-  ctx->linebuffer_work = my_calloc(1, max_line_length + 1);
   ctx->linebuffer_history = my_calloc(1, max_line_length + 1);
+  ctx->history_length = 0;
   ctx->to_lower = to_lower;
   ctx->num_commands = num_commands;
   ctx->max_line_length = max_line_length;
-  ctx->delimiters = strdup(delimiters);
+  ctx->delimiter = delimiters[0];
+  for (i = 0; delimiters[i] != 0; i++)
+    ctx->is_delimiter[(uint8_t)delimiters[i]] = 1;
+  ctx->is_delimiter[0] = 1; /* the end of a token for sure */
   ctx->writepointer = ctx->linebuffer;
   ctx->cmd_list = cmd_list;
   ctx->max_argc = max_argc;
   ctx->argv = my_calloc(max_argc, sizeof(char *));
   ctx->history_disable = 0;
 
+  const cmd_hash_table_t *table = cmd_hash_get(cmd_list, num_commands);
+  ctx->hash_seed = table->seed;
+  ctx->hash_mask = table->mask;
+  ctx->hash_slots = table->slots;
+
   return ctx;
 }
 
@@ -84,53 +177,65 @@ void *cmd_interpreter_free(cmd_interpreter_ctx_t *ctx) {
   assert(ctx != NULL);
 
   free(ctx->argv);
-  free(ctx->delimiters);
-  free(ctx->linebuffer_work);
   free(ctx->linebuffer_history);
   free(ctx->linebuffer);
   free(ctx);
   return NULL;
 }
 
+/* split 'line' in place, returns argc */
+static int cmd_interpreter_tokenize(cmd_interpreter_ctx_t *ctx, char *line) {
+  char *p = line;
+  int argc = 0;
+
+  while (argc < ctx->max_argc) {
+    while (*p != 0 && ctx->is_delimiter[(uint8_t)*p])
+      p++;
+    if (*p == 0)
+      break;
+    ctx->argv[argc++] = p;
+    while (!ctx->is_delimiter[(uint8_t)*p])
+      p++;
+    if (*p == 0)
+      break;
+    *p++ = 0;
+  }
+  return argc;
+}
+
+static int cmd_interpreter_lookup(cmd_interpreter_ctx_t *ctx, const char *cmd) {
+  int i = ctx->hash_slots[cmd_hash(ctx->hash_seed, cmd) & ctx->hash_mask];
+  if (i < 0 || strcmp(ctx->cmd_list[i].cmd_string, cmd) != 0)
+    return -1;
+  return i;
+}
+
 static int cmd_interpreter_process_line(cmd_interpreter_ctx_t *ctx, char *line,
                                         void *obj) {
   assert(ctx != NULL);
   assert(line != NULL);
 
-  char *saveptr;
-  int rval;
-  int i;
-
-  strncpy(ctx->linebuffer_work, line, ctx->max_line_length);
-
-  ctx->argv[0] = strtok_r(ctx->linebuffer_work, ctx->delimiters, &saveptr);
+  int argc, i;
 
-  if (ctx->argv[0] == NULL) {
-    rval = CMD_INTERPRETER_EMPTY_INPUT;
-  } else {
+  argc = cmd_interpreter_tokenize(ctx, line);
+  if (argc == 0)
+    return CMD_INTERPRETER_EMPTY_INPUT;
 
-    for (i = 0; i < ctx->num_commands; i++) {
-      if (strcmp(ctx->cmd_list[i].cmd_string, ctx->argv[0]) == 0)
-        break;
-    }
-    if (i == ctx->num_commands)
-      rval = CMD_INTERPRETER_INVALID_COMMAND;
-    else {
-      int j;
-      for (j = 1; j < ctx->max_argc; j++) {
-        ctx->argv[j] = strtok_r(NULL, ctx->delimiters, &saveptr);
-        if (ctx->argv[j] == NULL)
-          break;
-      }
-      rval = ctx->cmd_list[i].callback(obj, j, ctx->argv);
-    }
-  }
+  i = cmd_interpreter_lookup(ctx, ctx->argv[0]);
+  if (i < 0)
+    return CMD_INTERPRETER_INVALID_COMMAND;
 
-  return rval;
+  return ctx->cmd_list[i].callback(obj, argc, ctx->argv);
 }
 
 int cmd_interpreter_repeat(cmd_interpreter_ctx_t *ctx, void *obj) {
   assert(ctx != NULL);
+  size_t i;
+
+  /* undo the tokenizing of the last time */
+  for (i = 0; i < ctx->history_length; i++)
+    if (ctx->linebuffer_history[i] == 0)
+      ctx->linebuffer_history[i] = ctx->delimiter;
   ctx->history_disable = 1;
   return cmd_interpreter_process_line(ctx, ctx->linebuffer_history, obj);
 }
@@ -143,39 +248,44 @@ int cmd_interpreter_process(cmd_interpreter_ctx_t *ctx, char **buffer_start,
   if (buffer_len == 0)
     return CMD_INTERPRETER_NO_MORE_DATA; /* nothing to do */
 
-  int i;
+  const char *src = *buffer_start;
+  const char *newline = memchr(src, '\n', buffer_len);
+  const char *stop = newline != NULL ? newline : src + buffer_len;
+  const char *limit = ctx->linebuffer + ctx->max_line_length;
+  char *wp = ctx->writepointer;
+  int got_line = (newline != NULL);
 
   /* copy up to the newline into our own buffer */
-  int got_line = 0;
-  for (i = 0; i < buffer_len; i++) {
-    if (**buffer_start == '\n') {
-      (*buffer_start)++;
-      *(ctx->writepointer) = 0; /* NULL terminate */
-      got_line = 1;
-      break;
-    } else {
-      if ((**buffer_start >= ' ') /* only copy printable chars */
-          && ((ctx->writepointer - ctx->linebuffer) < ctx->max_line_length)) {
-        if (ctx->to_lower)
-          *(ctx->writepointer) = tolower(**buffer_start);
-        else
-          *(ctx->writepointer) = **buffer_start;
-        ctx->writepointer++;
-      }
-      (*buffer_start)++;
+  for (; src < stop; src++) {
+    char c = *src;
+    if ((c >= ' ') /* only copy printable chars */
+        && (wp < limit)) {
+      if (ctx->to_lower && c >= 'A' && c <= 'Z')
+        c += 'a' - 'A'; /* the daemon runs in the C locale */
+      *wp++ = c;
     }
   }
-  if (!got_line)
+  ctx->writepointer = wp;
+  if (!got_line) {
+    *buffer_start = (char *)stop;
     return CMD_INTERPRETER_NO_MORE_DATA; /* thank you, come again */
+  }
+  *buffer_start = (char *)newline + 1;
+  *wp = 0; /* NULL terminate */
 
   int rval;
   if ((ctx->writepointer - ctx->linebuffer) == ctx->max_line_length) {
     rval = CMD_INTERPRETER_LINE_LENGTH_EXCEEDED;
   } else {
+    size_t length = ctx->writepointer - ctx->linebuffer;
     rval = cmd_interpreter_process_line(ctx, ctx->linebuffer, obj);
-    if (!ctx->history_disable)
-      strncpy(ctx->linebuffer_history, ctx->linebuffer,
-              ctx->max_line_length);
+    if (!ctx->history_disable) {
+      /* keep the line by swapping buffers rather than copying it */
+      char *history = ctx->linebuffer_history;
+      ctx->linebuffer_history = ctx->linebuffer;
+      ctx->linebuffer = history;
+      ctx->history_length = length;
+    }
     ctx->history_disable = 0;
   }
 
@@ -29,7 +29,9 @@ typedef struct {
   cmd_interpreter_callback_t callback;
 } cmd_interpreter_cmd_list_t;
 
-// create a context for the command interpreter to work in
+// create a context for the command interpreter to work in. The lookup table
+// for 'cmd_list' is built by the first context and shared by all later ones,
+// so the list has to stay as it is for as long as the process runs.
 cmd_interpreter_ctx_t* cmd_interpreter_ctx_create(
     const cmd_interpreter_cmd_list_t* cmd_list,  // command list structure
     int num_commands,                            // number of elements in above
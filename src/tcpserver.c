@@ -16,54 +16,117 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "canbus.h"
+#include "canbus_capture.h"
 #include "syserror.h"
 #include "tcpserver.h"
+#include "tcpserver_output.h"
+#include "tcpserver_route.h"
 #include "tcpserver_worker.h"
 
-#define NUM_CONNECTIONS 5
+#define MAX_EVENTS 64
+#define TICK_MS 200
+#define BUS_RING_SIZE 1024
+/* when capturing: 8 seconds of a saturated 1 Mbit/s bus, for the capture
+ * thread to fall behind when a segment is rotated */
+#define CAPTURE_RING_SIZE 65536
+#define FANOUT_BATCH 32
 
 static const char *ModuleName = "TCPServer";
+
+extern vscp_guid_t gGuid;
 static int tcpserver_running = 0;
 
-pthread_t dispatch_tid;
+static pthread_t reactor_tid;
+static int listenfd, epollfd;
+static const char *server_can_bus;
+static time_t server_started;
+static unsigned int max_connections;
+static unsigned int session_depth;
+static unsigned int bus_tx_queue;
+static uint32_t bus_tx_rate;
+static unsigned int bus_cache;
+static unsigned int bus_retain; /* messages kept for resuming, 0: none */
+static const canbus_capture_config_t *capture_config; /* NULL: none */
+static canbus_capture_t *bus_capture;
+static unsigned int num_connections;
+static context_t *sessions;
+/* sessions reading from the bus, by slot, and the index routing to them */
+static context_t **slots;
+static tcpserver_route_t *route;
+static event_source_t listen_source = {source_listen, NULL};
+static event_source_t can_source = {source_can, NULL};
+static event_source_t can_changes_source = {source_can_changes, NULL};
+
+/* the bus is shared by all sessions and opened when the first one needs it,
+ * or right away to capture */
+static canbus_t *bus;
+static uint64_t fanout_seq; /* next message in the ring to hand out */
+static uint32_t bus_events; /* epoll events the bus socket waits for */
+
+static void *reactor_thread(void *arg);
+static canbus_t *bus_get(char *error, size_t error_size);
+
+static void set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    SysMError("fcntl O_NONBLOCK");
+}
 
-typedef struct {
-  pthread_t thread_tid;
-  sem_t start_sem;
-  int connfd;
-  const char * can_bus;
-  time_t started;
-  pthread_mutex_t connfd_lock;
-} Thread;
-
-Thread *tptr;
-/* thread ID */
-/* # connections handled */
-/* array of Thread structures; calloc'ed */
-int listenfd, nthreads;
-socklen_t addrlen;
-pthread_mutex_t mlock;
-
-void *dispatch_thread(void *arg);
-void *worker_thread(void *arg);
-
-void tcpserver_start(const char * can_bus, uint32_t ip_addr, uint16_t port) {
-  int i;
+static void epoll_add(int fd, event_source_t *source) {
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = source;
+  if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    SysMError("epoll_ctl add");
+}
+
+void tcpserver_start(const char *can_bus, uint32_t ip_addr, uint16_t port,
+                     unsigned int connections, unsigned int depth,
+                     unsigned int tx_queue, uint32_t tx_rate,
+                     unsigned int cache, unsigned int retain,
+                     const canbus_capture_config_t *capture) {
   struct sockaddr_in servaddr;
-  time_t now = time(NULL);
+  char error[120];
 
   assert(tcpserver_running == 0);
+  assert(connections > 0);
+  assert(depth > 0);
+  assert(tx_queue > 0);
+
+  server_can_bus = can_bus;
+  server_started = time(NULL);
+  max_connections = connections;
+  session_depth = depth;
+  bus_tx_queue = tx_queue;
+  bus_tx_rate = tx_rate;
+  bus_cache = cache;
+  bus_retain = retain;
+  capture_config = capture;
+  num_connections = 0;
+  sessions = NULL;
+  bus = NULL;
+
+  slots = calloc(connections, sizeof(context_t *));
+  route = tcpserver_route_create(connections);
+  if (slots == NULL || route == NULL)
+    NonSysError(ModuleName, "out of memory");
+
   /* Create a socket */
   if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
     SysMError("socket");
@@ -82,140 +145,425 @@ void tcpserver_start(const char * can_bus, uint32_t ip_addr, uint16_t port) {
     SysMError("bind");
 
   /* set the socket in passive listen mode */
-  if ((listen(listenfd, 5)) < 0)
+  if ((listen(listenfd, SOMAXCONN)) < 0)
     SysMError("listen");
 
-  /* create the thread pool */
-  nthreads = NUM_CONNECTIONS;
-  tptr = calloc(nthreads, sizeof(Thread));
-  if (tptr == NULL)
-    SysMError("thread calloc");
-
-  /* create worker threads first, they will block on the semaphore */
-  for (i = 0; i < nthreads; i++) {
-    sem_init(&(tptr[i].start_sem), 0, 0);
-    tptr[i].can_bus = can_bus;
-    tptr[i].started = now;
-    if (pthread_create(&tptr[i].thread_tid, NULL, &worker_thread, &(tptr[i])) !=
-        0)
-      NonSysError(ModuleName, "pthread_create worker");
-  }
+  set_nonblocking(listenfd);
+
+  if ((epollfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    SysMError("epoll_create1");
+
+  epoll_add(listenfd, &listen_source);
 
-  /* create the dispatcher thread */
-  if (pthread_create(&dispatch_tid, NULL, &dispatch_thread, NULL) != 0)
-    NonSysError(ModuleName, "pthread_create dispatch");
+  /* a capture doesn't wait for the first client */
+  if (capture_config != NULL && bus_get(error, sizeof(error)) == NULL)
+    NonSysError(ModuleName, error);
+
+  /* all connections are served from a single event loop */
+  if (pthread_create(&reactor_tid, NULL, &reactor_thread, NULL) != 0)
+    NonSysError(ModuleName, "pthread_create reactor");
 
   tcpserver_running = 1;
   return;
 }
 
-void *dispatch_thread(void *arg) {
+/* returns the bus, opening it when needed. NULL on failure */
+static canbus_t *bus_get(char *error, size_t error_size) {
+  unsigned int ring_size;
+
+  if (bus == NULL) {
+    /* the ring holds the backlog of the slowest client, and what is
+     * retained for those coming back */
+    ring_size = session_depth > BUS_RING_SIZE ? session_depth : BUS_RING_SIZE;
+    if (bus_retain > ring_size)
+      ring_size = bus_retain;
+    bus = canbus_open(server_can_bus, ring_size, bus_tx_queue, bus_cache,
+                      &gGuid, error, error_size);
+    if (bus != NULL &&
+        (((bus_retain > 0 || capture_config != NULL) &&
+          canbus_keep_all(bus) < 0) ||
+         (capture_config != NULL &&
+          canbus_keep_raw(bus, CAPTURE_RING_SIZE) < 0))) {
+      snprintf(error, error_size, "interface [%s] error: %s", server_can_bus,
+               strerror(errno));
+      canbus_close(bus);
+      bus = NULL;
+    }
+    if (bus != NULL && capture_config != NULL) {
+      bus_capture = canbus_capture_start(bus, canbus_name(bus),
+                                         capture_config, error, error_size);
+      if (bus_capture == NULL) {
+        canbus_close(bus);
+        bus = NULL;
+      }
+    }
+    if (bus != NULL) {
+      fanout_seq = vscp_buffer_head(canbus_ring(bus));
+      epoll_add(canbus_fd(bus), &can_source);
+      if (canbus_changes_fd(bus) >= 0)
+        epoll_add(canbus_changes_fd(bus), &can_changes_source);
+      bus_events = EPOLLIN;
+      canbus_tx_set_rate(bus, bus_tx_rate);
+    }
+  }
+  return bus;
+}
+
+static void bus_lost(void) {
+  context_t *context;
+
+  for (context = sessions; context != NULL; context = context->next)
+    if (!context->stop_session)
+      tcpserver_session_bus_lost(context);
+
+  /* closing the sockets removes them from the epoll set as well */
+  if (bus_capture != NULL) {
+    canbus_capture_stop(bus_capture);
+    bus_capture = NULL;
+  }
+  canbus_close(bus);
+  bus = NULL;
+}
+
+/* hand out the messages added to the ring since last time to the sessions
+ * they are routed to */
+static void fanout(void) {
+  vscp_buffer_ctx_t *ring;
+  vscp_buffer_entry_t entries[FANOUT_BATCH];
+  context_t *context;
+  const uint64_t *map;
+  unsigned int i, n, w, words;
+  uint64_t bits;
+
+  if (bus == NULL)
+    return;
+
+  ring = canbus_ring(bus);
+  if (fanout_seq < vscp_buffer_tail(ring))
+    fanout_seq = vscp_buffer_tail(ring);
+
+  words = tcpserver_route_words(route);
+  while ((n = vscp_buffer_get_bulk(ring, fanout_seq, entries, FANOUT_BATCH)) >
+         0) {
+    for (i = 0; i < n; i++) {
+      map = tcpserver_route_lookup(route, entries[i].frame.can_id);
+      for (w = 0; w < words; w++)
+        for (bits = map[w]; bits != 0; bits &= bits - 1) {
+          context = slots[w * 64 + __builtin_ctzll(bits)];
+          if (!context->stop_session)
+            tcpserver_session_deliver(context, fanout_seq + i, &entries[i]);
+        }
+    }
+    fanout_seq += n;
+  }
+}
+
+/* a free slot, there is one for every connection */
+static unsigned int slot_get(void) {
+  unsigned int slot;
+
+  for (slot = 0; slots[slot] != NULL; slot++)
+    assert(slot + 1 < max_connections);
+  return slot;
+}
+
+/* write the frames queued for the bus, waiting for its socket to become
+ * writable when it's full. Returns the time to wait in ms until trying again,
+ * -1 when there's nothing to retry */
+static int bus_transmit(void) {
+  struct epoll_event ev;
+  uint64_t now, deadline;
+  int state = CANBUS_TX_DONE;
+
+  if (bus == NULL)
+    return -1;
+  if (canbus_tx_pending(bus) > 0) {
+    state = canbus_tx_flush(bus);
+    fanout(); /* the frames that went out */
+  }
+
+  ev.events = EPOLLIN;
+  if (state == CANBUS_TX_WRITABLE)
+    ev.events |= EPOLLOUT;
+  if (ev.events != bus_events) {
+    ev.data.ptr = &can_source;
+    if (epoll_ctl(epollfd, EPOLL_CTL_MOD, canbus_fd(bus), &ev) < 0)
+      SysMError("epoll_ctl mod");
+    bus_events = ev.events;
+  }
+  if (state != CANBUS_TX_RETRY)
+    return -1;
+  now = tcpserver_output_now();
+  deadline = canbus_tx_deadline(bus);
+  return deadline > now ? (deadline - now + 999) / 1000 : 0;
+}
+
+static void accept_connections(void) {
+  char error[120];
+  canbus_t *session_bus;
+
   int connfd;
   struct sockaddr_in cliaddr;
   socklen_t clilen;
-  int found, i;
+  context_t *context;
+  unsigned int slot;
 
   while (1) {
     clilen = sizeof(cliaddr);
 
-    if ((connfd = accept(listenfd, (struct sockaddr *)&cliaddr, &clilen)) < 0)
-      SysMError("thread accept");
-
-    found = 0;
-    i = 0;
-    while ((found == 0) && (i < nthreads)) {
-      if (pthread_mutex_lock(&(tptr[i].connfd_lock)) != 0)
-        NonSysError("TCPServer", "dispatch mutex lock");
+    if ((connfd = accept(listenfd, (struct sockaddr *)&cliaddr, &clilen)) < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return;
+      if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE ||
+          errno == ENFILE)
+        return; /* try again on the next wakeup */
+      SysMError("accept");
+    }
 
-      if (tptr[i].connfd == 0) {
-        found = 1;
-        tptr[i].connfd = connfd;
-        sem_post(&(tptr[i].start_sem));
+    if (num_connections >= max_connections) {
+      const char *msg = "-OK - too many connections\r\n";
+      if (write(connfd, msg, strlen(msg)) < 0) {
+        /* nothing we can do, we're closing anyway */
       }
+      if (close(connfd) < 0)
+        SysMError("close rejected connection");
+      continue;
+    }
 
-      if (pthread_mutex_unlock(&(tptr[i].connfd_lock)) != 0)
-        NonSysError("TCPServer", "dispatch mutex unlock");
+    /* a stalled client should never hold up the event loop */
+    set_nonblocking(connfd);
 
-      i++;
+    /* output is already gathered per event loop round, don't delay it more */
+    if (tcpserver_output_get_policy()->mode == flush_immediate) {
+      int nodelay = 1;
+      setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
     }
 
-    if (found == 0) {
+    context = tcpserver_session_open(
+        connfd, server_can_bus, server_started, session_depth,
+        capture_config != NULL ? capture_config->directory : NULL);
+    if (context == NULL) {
       if (close(connfd) < 0)
-        SysMError("thread close connection");
+        SysMError("close connection");
+      continue;
     }
-  }
-}
 
-void *worker_thread(void *arg) {
-  Thread *info = arg;
-  int connection;
-  int status;
+    context->next = sessions;
+    sessions = context;
+    num_connections++;
 
-  while (1) {
+    epoll_add(context->tcpfd, &(context->tcp_source));
+    context->epoll_events = EPOLLIN;
 
-    if ((status = sem_wait(&(info->start_sem))) != 0) {
-      if (status != EINTR)
-        SysMError("worker semaphore wait");
+    session_bus = bus_get(error, sizeof(error));
+    if (session_bus != NULL) {
+      slot = slot_get();
+      slots[slot] = context;
+      tcpserver_session_attach(context, session_bus, route, slot);
     } else {
-      if (pthread_mutex_lock(&(info->connfd_lock)) != 0)
-        NonSysError("TCPServer", "worker mutex Lock");
+      status_reply(context, 1, error);
+      context->stop_session = 1;
+    }
+  }
+}
 
-      connection = info->connfd;
+/* only take commands from a client that reads its replies and whose 'hist'
+ * or 'resume' is done, and wait for its socket to become writable when it's full */
+static void session_update_events(context_t *context) {
+  struct epoll_event ev;
+
+  ev.events = tcpserver_output_full(context->output) ||
+                      context->history != NULL || context->resuming
+                  ? 0
+                  : EPOLLIN;
+  if (context->output_blocked)
+    ev.events |= EPOLLOUT;
+  if (ev.events == context->epoll_events)
+    return;
+  ev.data.ptr = &(context->tcp_source);
+  if (epoll_ctl(epollfd, EPOLL_CTL_MOD, context->tcpfd, &ev) < 0)
+    SysMError("epoll_ctl mod");
+  context->epoll_events = ev.events;
+}
+
+/* go on with the 'hist' lookups and 'resume' replays the clients have room
+ * for. The commands that waited for one to finish run then, and may send
+ * frames */
+static void stream_sessions(void) {
+  context_t *context;
+
+  for (context = sessions; context != NULL; context = context->next)
+    if (!context->stop_session && !context->output_blocked) {
+      if (context->history != NULL)
+        tcpserver_session_history(context);
+      else if (context->resuming)
+        tcpserver_session_resume_stream(context);
+    }
+  fanout();
+}
 
-      if (pthread_mutex_unlock(&(info->connfd_lock)) != 0)
-        NonSysError("TCPServer", "worker mutex unlock");
+/* write out the sessions whose output is due. Returns the time to wait in ms
+ * until the next one is, at most TICK_MS */
+static int flush_sessions(void) {
+  uint64_t now = tcpserver_output_now();
+  uint64_t next = now + TICK_MS * 1000;
+  uint64_t deadline;
+  context_t *context;
+
+  for (context = sessions; context != NULL; context = context->next) {
+    if (context->stop_session)
+      continue;
+    if (!context->output_blocked &&
+        tcpserver_output_due(context->output, now))
+      tcpserver_session_flush(context);
+    /* more of the 'hist' or 'resume' right away when there's room for it */
+    if ((context->history != NULL || context->resuming) &&
+        !context->output_blocked &&
+        !tcpserver_output_full(context->output))
+      next = now;
+    /* conflated messages may have taken the room the flush made */
+    if (!context->output_blocked &&
+        (deadline = tcpserver_output_deadline(context->output)) < next)
+      next = deadline < now ? now : deadline;
+    if (!context->stop_session)
+      session_update_events(context);
+  }
+  return (next - now + 999) / 1000;
+}
 
-      if (connection != 0) {
-        tcpserver_work(connection, info->can_bus, info->started);
+/* closing is deferred until all events of an epoll_wait round are handled,
+ * as later events in the same round may still refer to the session */
+static void reap_sessions(void) {
+  context_t **pp = &sessions;
+
+  while (*pp != NULL) {
+    context_t *context = *pp;
+    if (context->stop_session) {
+      *pp = context->next;
+      if (context->route != NULL) {
+        tcpserver_route_clear(route, context->route_slot);
+        slots[context->route_slot] = NULL;
+      }
+      tcpserver_session_close(context);
+      num_connections--;
+    } else
+      pp = &(context->next);
+  }
+}
 
-        if (close(connection) < 0)
-          SysMError("thread close FD");
+static void *reactor_thread(void *arg) {
+  struct epoll_event events[MAX_EVENTS];
+  struct timespec now, last_tick;
+  context_t *context;
+  int n, i, retry, timeout = TICK_MS;
 
-        if (pthread_mutex_lock(&(info->connfd_lock)) != 0)
-          NonSysError("TCPServer", "worker mutex Lock");
+  clock_gettime(CLOCK_MONOTONIC_RAW, &last_tick);
 
-        info->connfd = 0;
+  while (1) {
+    n = epoll_wait(epollfd, events, MAX_EVENTS, timeout);
+    if (n < 0) {
+      if (errno != EINTR)
+        SysMError("epoll_wait");
+      n = 0;
+    }
 
-        if (pthread_mutex_unlock(&(info->connfd_lock)) != 0)
-          NonSysError("TCPServer", "worker mutex unlock");
+    for (i = 0; i < n; i++) {
+      event_source_t *source = events[i].data.ptr;
+      switch (source->type) {
+      case source_listen:
+        accept_connections();
+        break;
+      case source_tcp:
+        if (!source->context->stop_session) {
+          tcpserver_session_tcp_event(source->context, events[i].events);
+          fanout(); /* frames sent by this session */
+        }
+        break;
+      case source_can:
+        if (bus == NULL)
+          break;
+        if ((events[i].events & EPOLLIN) && canbus_read(bus) < 0)
+          bus_lost();
+        else if (events[i].events & (EPOLLERR | EPOLLHUP))
+          bus_lost();
+        else {
+          if (events[i].events & EPOLLOUT)
+            canbus_tx_writable(bus); /* room again, bus_transmit() */
+          fanout();
+        }
+        break;
+      case source_can_changes:
+        if (bus == NULL)
+          break;
+        if ((events[i].events & EPOLLIN) && canbus_read_changes(bus) < 0)
+          bus_lost();
+        else if (events[i].events & (EPOLLERR | EPOLLHUP))
+          bus_lost();
+        else
+          fanout();
+        break;
       }
     }
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+    if ((now.tv_sec - last_tick.tv_sec) * 1000 +
+            (now.tv_nsec - last_tick.tv_nsec) / 1000000 >=
+        TICK_MS) {
+      for (context = sessions; context != NULL; context = context->next)
+        if (!context->stop_session)
+          tcpserver_session_tick(context, &now);
+      last_tick = now;
+    }
+
+    stream_sessions();
+    retry = bus_transmit();
+    /* acknowledge the numbered sends that went out, or tell they didn't */
+    for (context = sessions; context != NULL; context = context->next)
+      if (!context->stop_session && context->tx_queued > 0)
+        tcpserver_session_send_ack(context);
+    timeout = flush_sessions();
+    if (retry >= 0 && retry < timeout)
+      timeout = retry;
+    reap_sessions();
   }
+  return NULL;
 }
 
 void tcpserver_stop(void) {
-  int i;
   void *res;
+  context_t *context;
 
-  /* stop the dispatcher first */
-  if (pthread_cancel(dispatch_tid) < 0)
-    NonSysError(ModuleName, "pthread_cancel");
-  if (pthread_join(dispatch_tid, &res) < 0)
+  /* stop the event loop first */
+  if (pthread_cancel(reactor_tid) != 0)
     NonSysError(ModuleName, "pthread_cancel");
+  if (pthread_join(reactor_tid, &res) != 0)
+    NonSysError(ModuleName, "pthread_join");
   if (close(listenfd) < 0)
     SysMError("Close listener");
 
-  /* stop all the workers */
-  for (i = 0; i < nthreads; i++) {
-    if (pthread_cancel(tptr[i].thread_tid) < 0)
-      NonSysError(ModuleName, "pthread_cancel");
+  /* then clean up all sessions */
+  while (sessions != NULL) {
+    context = sessions;
+    sessions = context->next;
+    tcpserver_session_close(context);
   }
+  num_connections = 0;
 
-  for (i = 0; i < nthreads; i++) {
-    if (pthread_join(tptr[i].thread_tid, &res) < 0)
-      NonSysError(ModuleName, "pthread_join");
-
-    if (tptr[i].connfd != 0) {
-      if (close(tptr[i].connfd) < 0)
-        SysMError("Close cleanup");
-      tptr[i].connfd = 0;
-    }
-
-    if (sem_destroy(&(tptr[i].start_sem)) < 0)
-      SysMError("close sem destroy");
+  if (bus_capture != NULL) {
+    canbus_capture_stop(bus_capture);
+    bus_capture = NULL;
   }
+  if (bus != NULL) {
+    canbus_close(bus);
+    bus = NULL;
+  }
+
+  if (close(epollfd) < 0)
+    SysMError("Close epoll");
 
-  free(tptr);
+  tcpserver_route_free(route);
+  free(slots);
 
+  tcpserver_running = 0;
   return;
 }
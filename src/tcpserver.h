@@ -18,9 +18,19 @@
 #define _TCPSERVER_H_
 
 #include <stdint.h>
+#include "canbus_capture.h"
 
-  /* start a TCP server */
-  void tcpserver_start (const char * can_bus, uint32_t ip_addr, uint16_t port) ;
+  /* start a TCP server, serving up to max_connections clients and buffering
+   * up to depth messages for each of them. Up to tx_queue frames wait for a
+   * busy CAN interface, sent at up to tx_rate bits per second (0: no cap).
+   * The latest message of up to cache events is remembered (0: none), and
+   * the last retain messages of all traffic for clients resuming (0: none).
+   * All traffic is captured to disk as capture says (NULL: not) */
+  void tcpserver_start (const char * can_bus, uint32_t ip_addr, uint16_t port,
+                        unsigned int max_connections, unsigned int depth,
+                        unsigned int tx_queue, uint32_t tx_rate,
+                        unsigned int cache, unsigned int retain,
+                        const canbus_capture_config_t *capture) ;
   void tcpserver_stop (void);
 
 
@@ -15,20 +15,27 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <errno.h>
+#include <inttypes.h>
 #include <linux/can.h>
 #include <linux/can/raw.h>
 #include <net/if.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 
+#include "canbus.h"
+#include "canbus_history.h"
 #include "tcpserver_commands.h"
+#include "tcpserver_conflate.h"
 #include "tcpserver_context.h"
+#include "tcpserver_output.h"
 #include "tcpserver_worker.h"
 #include "unistd.h"
 #include "version.h"
 #include "vscp.h"
 #include "vscp_buffer.h"
+#include "vscp_cache.h"
 
 /* Global stuff */
 char *cmd_user = NULL;
@@ -52,10 +59,18 @@ static int do_setguid(void *obj, int argc, char *argv[]);
 static int do_wcyd(void *obj, int argc, char *argv[]);
 static int do_version(void *obj, int argc, char *argv[]);
 static int do_stat(void *obj, int argc, char *argv[]);
+static int do_info(void *obj, int argc, char *argv[]);
 static int do_chid(void *obj, int argc, char *argv[]);
 static int do_setfilter(void *obj, int argc, char *argv[]);
 static int do_setmask(void *obj, int argc, char *argv[]);
 static int do_interface(void *obj, int argc, char *argv[]);
+static int do_sendwindow(void *obj, int argc, char *argv[]);
+static int do_subscribe(void *obj, int argc, char *argv[]);
+static int do_conflate(void *obj, int argc, char *argv[]);
+static int do_snapshot(void *obj, int argc, char *argv[]);
+static int do_sequence(void *obj, int argc, char *argv[]);
+static int do_resume(void *obj, int argc, char *argv[]);
+static int do_history(void *obj, int argc, char *argv[]);
 
 const cmd_interpreter_cmd_list_t command_descr[] = {
     {"+", do_repeat},
@@ -66,6 +81,8 @@ const cmd_interpreter_cmd_list_t command_descr[] = {
     {"restart", do_restart},
     {"shutdown", do_restart},
     {"send", do_send},
+    {"swnd", do_sendwindow},
+    {"sendwindow", do_sendwindow},
     {"retr", do_retrieve},
     {"rcvloop", do_rcvloop},
     {"quitloop", do_quitloop},
@@ -81,11 +98,23 @@ const cmd_interpreter_cmd_list_t command_descr[] = {
     {"vers", do_version},
     {"version", do_version},
     {"stat", do_stat},
+    {"info", do_info},
     {"chid", do_chid},
     {"sflt", do_setfilter},
     {"setfilter", do_setfilter},
     {"smsk", do_setmask},
     {"setmask", do_setmask},
+    {"sub", do_subscribe},
+    {"subscribe", do_subscribe},
+    {"conf", do_conflate},
+    {"conflate", do_conflate},
+    {"snap", do_snapshot},
+    {"snapshot", do_snapshot},
+    {"seq", do_sequence},
+    {"sequence", do_sequence},
+    {"resume", do_resume},
+    {"hist", do_history},
+    {"history", do_history},
     {"interface", do_interface}};
 
 const int command_descr_num =
@@ -110,7 +139,7 @@ int do_quit(void *obj, int argc, char *argv[]) {
     return CMD_WRONG_ARGUMENT_COUNT;
   }
   status_reply(context, 0, "bye");
-  context->stop_thread = 1;
+  context->stop_session = 1;
   return 0;
 }
 
@@ -190,19 +219,43 @@ static int do_send(void *obj, int argc, char *argv[]) {
   if (argc != 2) {
     return CMD_WRONG_ARGUMENT_COUNT;
   }
+  if (context->tx_window > 0)
+    context->tx_seq++;
   if (vscp_parse_msg(argv[1], &msg, &(context->guid))) {
-    status_reply(context, 1, "format error in CAN frame");
+    tcpserver_session_send_failed(context, "format error in CAN frame");
     return 0;
   }
   vscp_to_can(&msg, &tx);
   context->stat_tx_data += 4 + tx.can_dlc;
   context->stat_tx_frame++;
-  if (write(context->can_socket, &tx, sizeof(struct can_frame)) !=
-      sizeof(struct can_frame)) {
-    status_reply(context, 1, "problem when writing to CAN socket");
+  /* sent together with the sends that follow, the reply comes then */
+  tcpserver_session_send(context, &tx);
+  return 0;
+}
+
+static int do_sendwindow(void *obj, int argc, char *argv[]) {
+  context_t *context = (context_t *)obj;
+  unsigned int window;
+  char guard;
+  char buf[40];
+  if (argc != 2) {
+    return CMD_WRONG_ARGUMENT_COUNT;
+  }
+  if (sscanf(argv[1], "%u%c", &window, &guard) != 1 || window > 65535) {
+    return CMD_FORMAT_ERROR;
+  }
+  /* settle the sends of the current mode first */
+  tcpserver_session_send_ack(context);
+  if (context->tx_queued > 0) {
+    snprintf(buf, sizeof(buf), "%u sends still queued",
+             context->tx_queued);
+    status_reply(context, 1, buf);
     return 0;
   }
-  status_reply(context, 0, NULL);
+  context->tx_window = window;
+  context->tx_seq = 0;
+  snprintf(buf, sizeof(buf), "window %u", window);
+  status_reply(context, 0, buf);
   return 0;
 }
 
@@ -211,9 +264,8 @@ static int do_retrieve(void *obj, int argc, char *argv[]) {
   unsigned int num_msgs;
   char guard;
   int empty_buffer = 0;
-  vscp_msg_t msg;
-  char buf[120];
-  int n;
+  vscp_buffer_entry_t entry;
+  uint64_t seq;
   if (argc > 2) {
     return CMD_WRONG_ARGUMENT_COUNT;
   }
@@ -226,11 +278,9 @@ static int do_retrieve(void *obj, int argc, char *argv[]) {
     num_msgs = 1;
 
   while (num_msgs > 0 && !empty_buffer) {
-    empty_buffer = vscp_buffer_pop(context->rx_buffer, &msg);
-    if (!empty_buffer) {
-      n = print_vscp(&msg, buf, sizeof(buf));
-      writen(context, buf, n);
-    }
+    empty_buffer = tcpserver_session_pop(context, &seq, &entry);
+    if (!empty_buffer)
+      tcpserver_session_reply_event(context, seq, &entry);
     num_msgs--;
   }
 
@@ -244,10 +294,6 @@ static int do_retrieve(void *obj, int argc, char *argv[]) {
 
 static int do_rcvloop(void *obj, int argc, char *argv[]) {
   context_t *context = (context_t *)obj;
-  int empty_buffer = 0;
-  char buf[120];
-  int n;
-  vscp_msg_t msg;
   if (argc != 1) {
     return CMD_WRONG_ARGUMENT_COUNT;
   }
@@ -256,13 +302,7 @@ static int do_rcvloop(void *obj, int argc, char *argv[]) {
   clock_gettime(CLOCK_MONOTONIC_RAW, &(context->last_keepalive));
   status_reply(context, 0, NULL);
 
-  while (!empty_buffer) {
-    empty_buffer = vscp_buffer_pop(context->rx_buffer, &msg);
-    if (!empty_buffer) {
-      n = print_vscp(&msg, buf, sizeof(buf));
-      writen(context, buf, n);
-    }
-  }
+  tcpserver_session_drain(context);
   return 0;
 }
 
@@ -283,7 +323,7 @@ static int do_checkdata(void *obj, int argc, char *argv[]) {
   if (argc != 1) {
     return CMD_WRONG_ARGUMENT_COUNT;
   }
-  n = snprintf(buf, 20, "%u \r\n", vscp_buffer_used(context->rx_buffer));
+  n = snprintf(buf, 20, "%u \r\n", tcpserver_session_pending(context));
   writen(context, buf, n);
   status_reply(context, 0, NULL);
   return 0;
@@ -294,7 +334,7 @@ static int do_clearall(void *obj, int argc, char *argv[]) {
   if (argc != 1) {
     return CMD_WRONG_ARGUMENT_COUNT;
   }
-  vscp_buffer_flush(context->rx_buffer);
+  tcpserver_session_clear(context);
   status_reply(context, 0, "All events cleared.");
   return 0;
 }
@@ -330,6 +370,7 @@ static int do_setguid(void *obj, int argc, char *argv[]) {
     status_reply(context, 1, "Invalid GUID");
   } else {
     context->guid = guid;
+    vscp_guid_prefix_set(&(context->guid_prefix), &guid);
     status_reply(context, 0, NULL);
   }
   return 0;
@@ -365,7 +406,8 @@ static int do_stat(void *obj, int argc, char *argv[]) {
     return CMD_WRONG_ARGUMENT_COUNT;
   }
   char string[100];
-  snprintf(string, sizeof(string), "0,0,0,%u,%u,%u,%u\r\n",
+  snprintf(string, sizeof(string), "0,0,%u,%u,%u,%u,%u\r\n",
+           context->stat_overflows + tcpserver_output_dropped(context->output),
            context->stat_rx_data, context->stat_rx_frame, context->stat_tx_data,
            context->stat_tx_frame);
   writen(context, string, strlen(string));
@@ -373,6 +415,43 @@ static int do_stat(void *obj, int argc, char *argv[]) {
   return 0;
 }
 
+static int do_info(void *obj, int argc, char *argv[]) {
+  context_t *context = (context_t *)obj;
+  if (argc != 1) {
+    return CMD_WRONG_ARGUMENT_COUNT;
+  }
+  char string[100];
+  snprintf(string, sizeof(string), "%u,%u,%u,%u,%u,%u\r\n", context->rx_depth,
+           tcpserver_session_pending(context), context->rx_high_watermark,
+           context->stat_overflows, tcpserver_output_dropped(context->output),
+           context->stat_conflated);
+  writen(context, string, strlen(string));
+  if (context->bus != NULL) {
+    canbus_tx_stats_t tx;
+    canbus_flow_stats_t flow;
+    uint64_t sent;
+    canbus_tx_stats(context->bus, &tx);
+    /* frames that left the queue, for the average time they spent in it */
+    sent = tx.queued - tx.errors - tx.length;
+    snprintf(string, sizeof(string), "%u,%u,%u,%lu,%lu,%lu,%lu,%u\r\n",
+             tx.length, tx.size, tx.high_watermark, tx.queued, tx.full,
+             tx.errors,
+             (unsigned long)(sent > 0 ? tx.wait_total_us / sent : 0),
+             tx.wait_max_us);
+    writen(context, string, strlen(string));
+    /* and our own share of it */
+    canbus_flow_stats(context->tx_flow, &flow);
+    snprintf(string, sizeof(string), "%u,%lu,%lu,%lu,%lu,%lu,%u\r\n",
+             flow.length, flow.queued, flow.sent, flow.full, flow.errors,
+             (unsigned long)(flow.sent > 0 ? flow.wait_total_us / flow.sent
+                                           : 0),
+             flow.wait_max_us);
+    writen(context, string, strlen(string));
+  }
+  status_reply(context, 0, NULL);
+  return 0;
+}
+
 static int do_chid(void *obj, int argc, char *argv[]) {
   context_t *context = (context_t *)obj;
   if (argc != 1) {
@@ -385,7 +464,7 @@ static int do_chid(void *obj, int argc, char *argv[]) {
 }
 
 static int do_setfilter(void *obj, int argc, char *argv[]) {
-  canid_t filter;
+  canid_t filter, filter_old;
   context_t *context = (context_t *)obj;
   if (argc != 2) {
     return CMD_WRONG_ARGUMENT_COUNT;
@@ -394,17 +473,20 @@ static int do_setfilter(void *obj, int argc, char *argv[]) {
     status_reply(context, 1, "format error in filter frame");
     return 0;
   }
+  filter_old = context->filter.can_id;
   context->filter.can_id = filter;
-
-  setsockopt(context->can_socket, SOL_CAN_RAW, CAN_RAW_FILTER,
-             &(context->filter), sizeof(struct can_filter));
+  if (tcpserver_session_refilter(context)) {
+    context->filter.can_id = filter_old;
+    status_reply(context, 1, "filter not accepted by the CAN interface");
+    return 0;
+  }
   status_reply(context, 0, NULL);
   return 0;
 
 }
 
 static int do_setmask(void *obj, int argc, char *argv[]) {
-  canid_t mask;
+  canid_t mask, mask_old;
   context_t *context = (context_t *)obj;
   if (argc != 2) {
     return CMD_WRONG_ARGUMENT_COUNT;
@@ -413,14 +495,373 @@ static int do_setmask(void *obj, int argc, char *argv[]) {
     status_reply(context, 1, "format error in mask frame");
     return 0;
   }
+  mask_old = context->filter.can_mask;
   context->filter.can_mask = mask;
+  if (tcpserver_session_refilter(context)) {
+    context->filter.can_mask = mask_old;
+    status_reply(context, 1, "mask not accepted by the CAN interface");
+    return 0;
+  }
+  status_reply(context, 0, NULL);
+  return 0;
+}
+
+/* add subscription 'spec', with 'change' only for the frames whose data
+ * changed, and then 'timeout_ms' also for those that didn't come in time */
+static void subscription_add(context_t *context, const char *spec, int change,
+                             uint32_t timeout_ms) {
+  canid_t ids[VSCP_SUBSCRIPTION_MAX_FILTERS];
+  subscription_t *sub;
+  char string[40];
+  int count, i;
+
+  if (context->subscription_count == TCPSERVER_MAX_SUBSCRIPTIONS) {
+    status_reply(context, 1, "too many subscriptions");
+    return;
+  }
+  if (strlen(spec) >= sizeof(sub->spec)) {
+    status_reply(context, 1, "format error in subscription");
+    return;
+  }
+  sub = &(context->subscriptions[context->subscription_count]);
+  count = vscp_parse_subscription(spec, sub->filters,
+                                  VSCP_SUBSCRIPTION_MAX_FILTERS);
+  if (count == -2) {
+    status_reply(context, 1, "subscription takes too many filters");
+    return;
+  }
+  if (count < 0) {
+    status_reply(context, 1, "format error in subscription");
+    return;
+  }
+  if (change) {
+    /* the broadcast manager watches single ids */
+    count = vscp_subscription_ids(sub->filters, count, ids,
+                                  VSCP_SUBSCRIPTION_MAX_FILTERS);
+    if (count < 0) {
+      status_reply(context, 1, "change subscription leaves class, type or "
+                               "nickname open");
+      return;
+    }
+    for (i = 0; i < count; i++) {
+      sub->filters[i].can_id = ids[i];
+      sub->filters[i].can_mask = CAN_EFF_FLAG | CAN_EFF_MASK;
+    }
+  }
+  strcpy(sub->spec, spec);
+  sub->count = count;
+  sub->change = change;
+  sub->timeout_ms = timeout_ms;
+  context->subscription_count++;
+  if (tcpserver_session_refilter(context)) {
+    context->subscription_count--;
+    status_reply(context, 1, "subscription not accepted by the CAN interface");
+    return;
+  }
+  snprintf(string, sizeof(string), "subscription %u",
+           context->subscription_count);
+  status_reply(context, 0, string);
+}
+
+/* sub add [!]<priority>,<class>,<type>,<nickname>,
+ * sub change <priority>,<class>,<type>,<nickname> [<timeout ms>],
+ * sub del <N>, sub list and sub clear */
+static int do_subscribe(void *obj, int argc, char *argv[]) {
+  context_t *context = (context_t *)obj;
+  subscription_t *sub;
+  char string[120];
+  unsigned int i;
+  long n;
+  char *endptr;
+
+  if (argc == 2 && !strcmp(argv[1], "list")) {
+    for (i = 0; i < context->subscription_count; i++) {
+      sub = &(context->subscriptions[i]);
+      if (!sub->change)
+        snprintf(string, sizeof(string), "%u,%s,%u\r\n", i + 1, sub->spec,
+                 sub->count);
+      else
+        snprintf(string, sizeof(string), "%u,%s,%u,change,%u\r\n", i + 1,
+                 sub->spec, sub->count, sub->timeout_ms);
+      writen(context, string, strlen(string));
+    }
+    status_reply(context, 0, NULL);
+    return 0;
+  }
+
+  if (argc == 2 && !strcmp(argv[1], "clear")) {
+    context->subscription_count = 0;
+    tcpserver_session_refilter(context); /* fewer filters, never refused */
+    status_reply(context, 0, NULL);
+    return 0;
+  }
+
+  if (argc == 3 && !strcmp(argv[1], "add")) {
+    subscription_add(context, argv[2], 0, 0);
+    return 0;
+  }
+
+  if ((argc == 3 || argc == 4) && !strcmp(argv[1], "change")) {
+    n = 0;
+    if (argc == 4) {
+      n = strtol(argv[3], &endptr, 10);
+      if (*endptr != 0 || n < 0 || n > TCPSERVER_MAX_WATCH_TIMEOUT) {
+        status_reply(context, 1, "format error in timeout");
+        return 0;
+      }
+    }
+    subscription_add(context, argv[2], 1, (uint32_t)n);
+    return 0;
+  }
+
+  if (argc == 3 && !strcmp(argv[1], "del")) {
+    n = strtol(argv[2], &endptr, 10);
+    if (*endptr != 0 || n < 1 || n > (long)context->subscription_count) {
+      status_reply(context, 1, "no such subscription");
+      return 0;
+    }
+    memmove(&(context->subscriptions[n - 1]), &(context->subscriptions[n]),
+            (context->subscription_count - n) * sizeof(subscription_t));
+    context->subscription_count--;
+    tcpserver_session_refilter(context);
+    status_reply(context, 0, NULL);
+    return 0;
+  }
+
+  return CMD_WRONG_ARGUMENT_COUNT;
+}
+
+/* conf on, conf index, conf off, or conf to show which */
+static int do_conflate(void *obj, int argc, char *argv[]) {
+  context_t *context = (context_t *)obj;
+  const char *state;
+  char string[20];
+  int index;
+
+  if (argc == 1) {
+    if (!context->conflating)
+      state = "off";
+    else if (tcpserver_conflate_index(context->conflate))
+      state = "index";
+    else
+      state = "on";
+    snprintf(string, sizeof(string), "%s\r\n", state);
+    writen(context, string, strlen(string));
+    status_reply(context, 0, NULL);
+    return 0;
+  }
+  if (argc != 2) {
+    return CMD_WRONG_ARGUMENT_COUNT;
+  }
 
-  setsockopt(context->can_socket, SOL_CAN_RAW, CAN_RAW_FILTER,
-             &(context->filter), sizeof(struct can_filter));
+  if (!strcmp(argv[1], "off")) {
+    tcpserver_session_unconflate(context);
+    status_reply(context, 0, NULL);
+    return 0;
+  }
+  if (!strcmp(argv[1], "on"))
+    index = 0;
+  else if (!strcmp(argv[1], "index"))
+    index = 1;
+  else
+    return CMD_FORMAT_ERROR;
+  if (tcpserver_session_conflate(context, index)) {
+    status_reply(context, 1, "out of memory");
+    return 0;
+  }
+  status_reply(context, 0, NULL);
+  return 0;
+}
+
+#define SNAPSHOT_BATCH 64
+
+/* does 'id' pass any of the CAN_RAW_FILTER pairs? */
+static int filters_match(const struct can_filter *filters, unsigned int count,
+                         canid_t id) {
+  unsigned int i;
+  int hit;
+
+  for (i = 0; i < count; i++) {
+    hit = ((id ^ filters[i].can_id) & filters[i].can_mask &
+           ~(canid_t)CAN_INV_FILTER) == 0;
+    if (filters[i].can_id & CAN_INV_FILTER ? !hit : hit)
+      return 1;
+  }
+  return 0;
+}
+
+/* snap, or snap [!]<priority>,<class>,<type>,<nickname> for the events that
+ * match, like sub add */
+static int do_snapshot(void *obj, int argc, char *argv[]) {
+  context_t *context = (context_t *)obj;
+  struct can_filter filters[VSCP_SUBSCRIPTION_MAX_FILTERS];
+  vscp_buffer_entry_t entries[SNAPSHOT_BATCH];
+  vscp_cache_t *cache;
+  vscp_msg_t msg;
+  char buf[VSCP_TEXT_MAX];
+  unsigned int start = 0, sent = 0, i, n;
+  int count = 0;
+
+  if (argc > 2) {
+    return CMD_WRONG_ARGUMENT_COUNT;
+  }
+  cache = context->bus != NULL ? canbus_cache(context->bus) : NULL;
+  if (cache == NULL) {
+    status_reply(context, 1, "no event cache, see --cache");
+    return 0;
+  }
+  if (argc == 2) {
+    count = vscp_parse_subscription(argv[1], filters,
+                                    VSCP_SUBSCRIPTION_MAX_FILTERS);
+    if (count == -2) {
+      status_reply(context, 1, "snapshot takes too many filters");
+      return 0;
+    }
+    if (count < 0) {
+      status_reply(context, 1, "format error in snapshot");
+      return 0;
+    }
+  }
+
+  /* all of it goes out with the reply, in a single write */
+  while ((n = vscp_cache_get(cache, start, entries, SNAPSHOT_BATCH)) > 0) {
+    for (i = 0; i < n; i++) {
+      if (argc == 2 && !filters_match(filters, count, entries[i].frame.can_id))
+        continue;
+      can_to_vscp(&entries[i].frame, entries[i].timestamp, &msg,
+                  canbus_guid(context->bus));
+      writen(context, buf,
+             print_vscp_prefix(&msg, &(context->guid_prefix), buf,
+                               sizeof(buf)));
+      sent++;
+    }
+    start += n;
+  }
+  snprintf(buf, sizeof(buf), "%u events", sent);
+  status_reply(context, 0, buf);
+  return 0;
+}
+
+/* seq on, seq off, or seq to show which and the number of the next event */
+static int do_sequence(void *obj, int argc, char *argv[]) {
+  context_t *context = (context_t *)obj;
+  char string[40];
+  uint64_t next;
+
+  if (argc == 1) {
+    next = context->bus != NULL ? vscp_buffer_head(canbus_ring(context->bus))
+                                : 0;
+    snprintf(string, sizeof(string), "%s,%" PRIu64 "\r\n",
+             context->rx_numbered ? "on" : "off", next);
+    writen(context, string, strlen(string));
+    status_reply(context, 0, NULL);
+    return 0;
+  }
+  if (argc != 2) {
+    return CMD_WRONG_ARGUMENT_COUNT;
+  }
+
+  if (!strcmp(argv[1], "on"))
+    context->rx_numbered = 1;
+  else if (!strcmp(argv[1], "off"))
+    context->rx_numbered = 0;
+  else
+    return CMD_FORMAT_ERROR;
   status_reply(context, 0, NULL);
   return 0;
 }
 
+/* resume <seq>, the events from sequence number seq on: those missed while
+ * disconnected */
+static int do_resume(void *obj, int argc, char *argv[]) {
+  context_t *context = (context_t *)obj;
+  char *endptr;
+  uint64_t seq;
+
+  if (argc != 2) {
+    return CMD_WRONG_ARGUMENT_COUNT;
+  }
+  if (context->bus == NULL || !canbus_keeps_all(context->bus)) {
+    status_reply(context, 1, "no retention, see --retain");
+    return 0;
+  }
+  errno = 0;
+  seq = strtoull(argv[1], &endptr, 10);
+  if (*argv[1] < '0' || *argv[1] > '9' || *endptr != 0 || errno != 0) {
+    status_reply(context, 1, "format error in sequence number");
+    return 0;
+  }
+
+  /* sent by the event loop, the reply comes after the last event */
+  switch (tcpserver_session_resume(context, seq)) {
+  case -1:
+    status_reply(context, 1, "sequence number not reached yet");
+    break;
+  case -2:
+    status_reply(context, 1, "unknown sequence number, from an earlier run");
+    break;
+  }
+  return 0;
+}
+
+/* hist <from> <to> [[!]<priority>,<class>,<type>,<nickname>], the captured
+ * events from 'from' up to 'to', times as "YYYY-MM-DDTHH:MM:SS" in UTC or
+ * seconds since the epoch. They go out as fast as the client reads them, the
+ * reply comes after the last one */
+static int do_history(void *obj, int argc, char *argv[]) {
+  context_t *context = (context_t *)obj;
+  struct can_filter filters[VSCP_SUBSCRIPTION_MAX_FILTERS];
+  char error[120];
+  uint64_t from, to;
+  int count = 0;
+
+  if (argc != 3 && argc != 4) {
+    return CMD_WRONG_ARGUMENT_COUNT;
+  }
+  if (context->capture_directory == NULL) {
+    status_reply(context, 1, "no capture, see --capture");
+    return 0;
+  }
+  if (context->mode == loop) {
+    status_reply(context, 1, "not in rcvloop");
+    return 0;
+  }
+  if (context->history != NULL) {
+    status_reply(context, 1, "history lookup in progress");
+    return 0;
+  }
+  if (vscp_parse_time(argv[1], &from) || vscp_parse_time(argv[2], &to)) {
+    status_reply(context, 1, "format error in time");
+    return 0;
+  }
+  if (from >= to) {
+    status_reply(context, 1, "nothing from then to then");
+    return 0;
+  }
+  if (argc == 4) {
+    count = vscp_parse_subscription(argv[3], filters,
+                                    VSCP_SUBSCRIPTION_MAX_FILTERS);
+    if (count == -2) {
+      status_reply(context, 1, "history takes too many filters");
+      return 0;
+    }
+    if (count < 0) {
+      status_reply(context, 1, "format error in history");
+      return 0;
+    }
+  }
+
+  /* sent by the event loop, no other commands are taken meanwhile */
+  context->history =
+      canbus_history_open(context->capture_directory, from, to, filters, count,
+                          error, sizeof(error));
+  if (context->history == NULL) {
+    status_reply(context, 1, error);
+    return 0;
+  }
+  context->history_sent = 0;
+  return 0;
+}
 
 static int do_interface(void *obj, int argc, char *argv[]) {
   context_t *context = (context_t *)obj;
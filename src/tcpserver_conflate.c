@@ -0,0 +1,178 @@
+// uvscpd - Minimalist VSCP Daemon
+// Copyright (C) 2019 Maarten Zanders
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tcpserver_conflate.h"
+
+#define NONE UINT32_MAX
+
+/* a key with its pending message */
+typedef struct {
+  uint64_t key;
+  uint64_t seq;
+  vscp_buffer_entry_t entry;
+  uint32_t next;  /* next key in arrival order, or on the free list */
+  uint32_t chain; /* next key in the same hash bucket */
+} slot_t;
+
+typedef struct tcpserver_conflate {
+  int index;
+  unsigned int size;
+  unsigned int length;
+  slot_t *slots;
+  uint32_t *buckets; /* first slot of every hash bucket */
+  uint32_t mask;     /* buckets - 1 */
+  uint32_t head;     /* the key pending the longest */
+  uint32_t tail;     /* the key pending the shortest */
+  uint32_t free;
+} tcpserver_conflate_t;
+
+/* class, type and nickname from the CAN id, the first data byte when asked
+ * for and present; a frame without data differs from one with a 0 */
+static uint64_t entry_key(const tcpserver_conflate_t *table,
+                          const vscp_buffer_entry_t *entry) {
+  uint64_t key = entry->frame.can_id & 0x1FFFFFF;
+
+  if (table->index && entry->frame.can_dlc > 0)
+    key |= (uint64_t)(0x100 | entry->frame.data[0]) << 25;
+  return key;
+}
+
+static uint32_t key_hash(const tcpserver_conflate_t *table, uint64_t key) {
+  return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & table->mask;
+}
+
+tcpserver_conflate_t *tcpserver_conflate_create(unsigned int size, int index) {
+  tcpserver_conflate_t *table;
+  uint32_t buckets = 1;
+
+  /* at most half full, for short chains */
+  while (buckets < 2 * size)
+    buckets <<= 1;
+
+  table = calloc(1, sizeof(tcpserver_conflate_t));
+  if (table == NULL)
+    return NULL;
+  table->slots = malloc(size * sizeof(slot_t));
+  table->buckets = malloc(buckets * sizeof(uint32_t));
+  if (table->slots == NULL || table->buckets == NULL) {
+    tcpserver_conflate_free(table);
+    return NULL;
+  }
+  table->index = index;
+  table->size = size;
+  table->mask = buckets - 1;
+  tcpserver_conflate_clear(table);
+  return table;
+}
+
+void tcpserver_conflate_free(tcpserver_conflate_t *table) {
+  free(table->slots);
+  free(table->buckets);
+  free(table);
+}
+
+int tcpserver_conflate_index(const tcpserver_conflate_t *table) {
+  return table->index;
+}
+
+int tcpserver_conflate_put(tcpserver_conflate_t *table, uint64_t seq,
+                           const vscp_buffer_entry_t *entry) {
+  uint64_t key = entry_key(table, entry);
+  uint32_t *bucket = &(table->buckets[key_hash(table, key)]);
+  uint32_t i;
+  slot_t *slot;
+
+  for (i = *bucket; i != NONE; i = table->slots[i].chain) {
+    slot = &(table->slots[i]);
+    if (slot->key == key) {
+      /* in place, it keeps the turn of the value it replaces */
+      slot->seq = seq;
+      slot->entry = *entry;
+      slot->entry.text = NULL; /* owned by the ring */
+      return 1;
+    }
+  }
+
+  if (table->free == NONE)
+    return -1;
+  i = table->free;
+  slot = &(table->slots[i]);
+  table->free = slot->next;
+
+  slot->key = key;
+  slot->seq = seq;
+  slot->entry = *entry;
+  slot->entry.text = NULL;
+  slot->chain = *bucket;
+  *bucket = i;
+  slot->next = NONE;
+  if (table->tail == NONE)
+    table->head = i;
+  else
+    table->slots[table->tail].next = i;
+  table->tail = i;
+  table->length++;
+  return 0;
+}
+
+int tcpserver_conflate_get(tcpserver_conflate_t *table, uint64_t *seq,
+                           vscp_buffer_entry_t *entry) {
+  uint32_t i = table->head;
+  uint32_t *p;
+  slot_t *slot;
+
+  if (i == NONE)
+    return -1;
+  slot = &(table->slots[i]);
+  if (seq != NULL)
+    *seq = slot->seq;
+  if (entry != NULL)
+    *entry = slot->entry;
+
+  /* unlink it from its bucket and the arrival order */
+  for (p = &(table->buckets[key_hash(table, slot->key)]); *p != i;
+       p = &(table->slots[*p].chain))
+    ;
+  *p = slot->chain;
+  table->head = slot->next;
+  if (table->head == NONE)
+    table->tail = NONE;
+  slot->next = table->free;
+  table->free = i;
+  table->length--;
+  return 0;
+}
+
+unsigned int tcpserver_conflate_length(const tcpserver_conflate_t *table) {
+  return table->length;
+}
+
+void tcpserver_conflate_clear(tcpserver_conflate_t *table) {
+  unsigned int i;
+
+  for (i = 0; i <= table->mask; i++)
+    table->buckets[i] = NONE;
+  for (i = 0; i < table->size; i++)
+    table->slots[i].next = i + 1 < table->size ? i + 1 : NONE;
+  table->free = table->size > 0 ? 0 : NONE;
+  table->head = NONE;
+  table->tail = NONE;
+  table->length = 0;
+}
@@ -0,0 +1,57 @@
+// uvscpd - Minimalist VSCP Daemon
+// Copyright (C) 2019 Maarten Zanders
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _TCPSERVER_CONFLATE_H_
+#define _TCPSERVER_CONFLATE_H_
+
+/* Pending messages of a session that only wants the latest value of every
+ * event: one message per key of VSCP class, type, nickname and optionally the
+ * first data byte (sensor index). A newer message replaces the pending one of
+ * its key in place, so the table never holds more than one message per key,
+ * however fast they come. Messages leave oldest key first. */
+
+#include <stdint.h>
+#include "vscp_buffer.h"
+
+typedef struct tcpserver_conflate tcpserver_conflate_t;
+
+// Create a table for up to 'size' keys, 'index' nonzero to tell messages
+// apart by their first data byte as well. Returns NULL when out of memory.
+tcpserver_conflate_t *tcpserver_conflate_create(unsigned int size, int index);
+
+void tcpserver_conflate_free(tcpserver_conflate_t *table);
+
+// Does the table key on the first data byte?
+int tcpserver_conflate_index(const tcpserver_conflate_t *table);
+
+// Keep message 'seq' of the bus ring, a copy of 'entry', as the latest of its
+// key. Returns 0 when it is pending now, 1 when it replaced a pending message,
+// -1 when all keys are taken.
+int tcpserver_conflate_put(tcpserver_conflate_t *table, uint64_t seq,
+                           const vscp_buffer_entry_t *entry);
+
+// Take the message of the key pending the longest. 'entry' gets a copy
+// without text. Returns 0 if there was one, -1 if none.
+int tcpserver_conflate_get(tcpserver_conflate_t *table, uint64_t *seq,
+                           vscp_buffer_entry_t *entry);
+
+// Number of keys with a pending message
+unsigned int tcpserver_conflate_length(const tcpserver_conflate_t *table);
+
+// Discard all pending messages
+void tcpserver_conflate_clear(tcpserver_conflate_t *table);
+
+#endif /* _TCPSERVER_CONFLATE_H_ */
@@ -17,32 +17,113 @@
 #ifndef _TCPSERVER_CONTEXT_H_
 #define _TCPSERVER_CONTEXT_H_
 
+#include <stdint.h>
 #include <time.h>
+#include "canbus.h"
 #include "cmd_interpreter.h"
+#include "vscp.h"
 #include "vscp_buffer.h"
 
+/* most subscriptions a client can have at once */
+#define TCPSERVER_MAX_SUBSCRIPTIONS 16
+/* longest a frame watched with 'sub change' may stay away, in ms */
+#define TCPSERVER_MAX_WATCH_TIMEOUT 3600000
+
 typedef enum { normal, loop } servermode_t;
 
+/* frames a client asked for with 'sub add' or 'sub change' */
 typedef struct {
+  char spec[48]; /* as given */
+  struct can_filter filters[VSCP_SUBSCRIPTION_MAX_FILTERS];
+  unsigned int count;
+  int change;          /* only when the data changes, filters are exact ids */
+  uint32_t timeout_ms; /* change: tell when it didn't come for this long */
+} subscription_t;
+
+/* what an epoll event refers to */
+typedef enum {
+  source_listen,
+  source_tcp,
+  source_can,
+  source_can_changes
+} source_type_t;
+
+typedef struct {
+  source_type_t type;
+  struct context *context;
+} event_source_t;
+
+typedef struct context {
   int tcpfd;
   servermode_t mode;
-  int can_socket;
+  canbus_t *bus;
+  canbus_flow_t *tx_flow; /* our frames in the bus transmit scheduler */
+  struct tcpserver_output *output; /* replies and events waiting to be sent */
+  int output_blocked;              /* socket full, waiting for EPOLLOUT */
+  uint32_t epoll_events;           /* events registered for tcpfd */
   char command_buffer[120];
   int command_buffer_wp;
-  int stop_thread;
+  struct can_frame tx_batch[CANBUS_TX_BATCH]; /* sends waiting for a reply */
+  uint32_t tx_batch_seq[CANBUS_TX_BATCH];      /* their sequence numbers */
+  unsigned int tx_batch_count;
+  unsigned int tx_window;  /* sends in flight without a reply, 0 when each
+                              send gets its own reply */
+  uint32_t tx_seq;         /* sequence number of the last send */
+  unsigned int tx_queued;  /* numbered sends queued, not sent or refused yet */
+  unsigned int tx_unacked; /* sent since the last acknowledgement */
+  int stop_session;
   cmd_interpreter_ctx_t *cmd_interpreter;
   int user_ok;
   int password_ok;
   vscp_guid_t guid;
-  vscp_buffer_ctx_t * rx_buffer;
+  vscp_guid_prefix_t guid_prefix;
+  uint64_t rx_cursor;       /* next message in the bus ring to look at */
+  unsigned int rx_pending;  /* messages for us between cursor and head */
+  unsigned int rx_depth;    /* max number of pending messages */
+  unsigned int rx_high_watermark; /* most messages ever pending */
+  /* latest message per key, NULL unless conflating or still draining */
+  struct tcpserver_conflate *conflate;
+  int conflating; /* new messages replace pending ones of the same key */
+  int rx_numbered; /* messages go out with their sequence number */
+  const char *capture_directory; /* NULL without a capture */
+  /* the 'hist' lookup being sent, NULL when none */
+  struct canbus_history *history;
+  unsigned int history_sent;
+  /* the 'resume' being sent: up to which sequence number, how many so far,
+   * and how many the ring lost before they could go out */
+  int resuming;
+  uint64_t resume_end;
+  unsigned int resume_sent;
+  uint64_t resume_evicted;
+  /* input read after a 'hist' or 'resume', taken once its events are out */
+  char *held_input;
+  size_t held_length;
   struct timespec last_keepalive;
+  int loop_active;
   unsigned int stat_rx_data;
   unsigned int stat_rx_frame;
   unsigned int stat_tx_data;
   unsigned int stat_tx_frame;
+  unsigned int stat_overflows; /* messages lost for exceeding the depth */
+  unsigned int stat_conflated; /* messages replaced by a newer one */
   const char * can_bus;
   time_t started;
-  struct can_filter filter;
+  struct can_filter filter; /* setfilter/setmask, without subscriptions */
+  subscription_t subscriptions[TCPSERVER_MAX_SUBSCRIPTIONS];
+  unsigned int subscription_count;
+  /* what we receive: the filters of all subscriptions, or 'filter' */
+  struct can_filter rx_filters[TCPSERVER_MAX_SUBSCRIPTIONS *
+                               VSCP_SUBSCRIPTION_MAX_FILTERS];
+  unsigned int rx_filter_count;
+  /* what we receive only when it changes: the ids of all 'sub change' */
+  canbus_watch_t rx_watches[TCPSERVER_MAX_SUBSCRIPTIONS *
+                            VSCP_SUBSCRIPTION_MAX_FILTERS];
+  unsigned int rx_watch_count;
+  struct tcpserver_route *route; /* where the event loop looks us up */
+  unsigned int route_slot;
+  int rx_exact; /* the route alone decides what we receive */
+  event_source_t tcp_source;
+  struct context *next;
 } context_t;
 
 #endif /* _TCPSERVER_CONTEXT_H_ */
@@ -0,0 +1,378 @@
+// uvscpd - Minimalist VSCP Daemon
+// Copyright (C) 2019 Maarten Zanders
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "tcpserver_output.h"
+
+/* room for copied data is allocated in chunks of this size */
+#define INLINE_CHUNK 1024
+/* iovecs handed to a single writev() */
+#define MAX_IOV 64
+/* smallest queue that still fits a few events */
+#define MIN_QUEUE_BYTES 1024
+
+typedef struct {
+  vscp_text_t *text; /* referenced shared text, or NULL */
+  char *data;        /* owned copy when text is NULL */
+  uint32_t length;
+  uint32_t capacity;
+  uint32_t sent; /* bytes of this segment already written */
+  int event;     /* an event, which may be dropped */
+} segment_t;
+
+typedef struct tcpserver_output {
+  segment_t *segments; /* ring, 'capacity' is a power of two */
+  unsigned int capacity;
+  unsigned int head;
+  unsigned int count;
+  size_t pending;
+  size_t events;  /* bytes of 'pending' that are events */
+  unsigned int dropped;
+  uint64_t first; /* when the oldest unwritten byte was queued */
+  char *spare;    /* an INLINE_CHUNK kept for reuse */
+} tcpserver_output_t;
+
+static flush_policy_t output_policy = {flush_immediate, 0, 0};
+static overflow_policy_t overflow_policy = {overflow_drop_oldest, 65536};
+
+void tcpserver_output_set_policy(const flush_policy_t *policy) {
+  output_policy = *policy;
+}
+
+const flush_policy_t *tcpserver_output_get_policy(void) {
+  return &output_policy;
+}
+
+int tcpserver_output_parse_policy(const char *input, flush_policy_t *policy) {
+  unsigned long bytes = 16384, usec = 2000;
+  char guard;
+  int n;
+
+  if (strcmp(input, "immediate") == 0) {
+    policy->mode = flush_immediate;
+    policy->batch_bytes = 0;
+    policy->batch_usec = 0;
+    return 0;
+  }
+  if (strncmp(input, "batch", 5) != 0)
+    return -1;
+  if (input[5] != 0) {
+    n = sscanf(input + 5, ",%lu,%lu%c", &bytes, &usec, &guard);
+    if (n != 2) {
+      n = sscanf(input + 5, ",%lu%c", &bytes, &guard);
+      if (n != 1)
+        return -1;
+    }
+  }
+  if (bytes == 0 || usec == 0 || usec > 1000000)
+    return -1;
+  policy->mode = flush_batch;
+  policy->batch_bytes = bytes;
+  policy->batch_usec = (unsigned int)usec;
+  return 0;
+}
+
+void tcpserver_output_set_overflow(const overflow_policy_t *policy) {
+  overflow_policy = *policy;
+}
+
+const overflow_policy_t *tcpserver_output_get_overflow(void) {
+  return &overflow_policy;
+}
+
+int tcpserver_output_parse_overflow(const char *input,
+                                    overflow_policy_t *policy) {
+  static const struct {
+    const char *name;
+    overflow_mode_t mode;
+  } modes[] = {{"oldest", overflow_drop_oldest},
+               {"newest", overflow_drop_newest},
+               {"disconnect", overflow_disconnect}};
+  unsigned long bytes = 65536;
+  size_t length;
+  char guard;
+  unsigned int i;
+
+  for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+    length = strlen(modes[i].name);
+    if (strncmp(input, modes[i].name, length) == 0 &&
+        (input[length] == 0 || input[length] == ','))
+      break;
+  }
+  if (i == sizeof(modes) / sizeof(modes[0]))
+    return -1;
+  if (input[length] != 0 &&
+      sscanf(input + length, ",%lu%c", &bytes, &guard) != 1)
+    return -1;
+  if (bytes < MIN_QUEUE_BYTES)
+    return -1;
+  policy->mode = modes[i].mode;
+  policy->queue_bytes = bytes;
+  return 0;
+}
+
+uint64_t tcpserver_output_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+tcpserver_output_t *tcpserver_output_create(void) {
+  tcpserver_output_t *out = calloc(1, sizeof(tcpserver_output_t));
+  if (out == NULL)
+    return NULL;
+  out->capacity = 16;
+  out->segments = calloc(out->capacity, sizeof(segment_t));
+  if (out->segments == NULL) {
+    free(out);
+    return NULL;
+  }
+  return out;
+}
+
+static void segment_release(tcpserver_output_t *out, segment_t *seg) {
+  if (seg->event)
+    out->events -= seg->length - seg->sent;
+  if (seg->text != NULL)
+    vscp_text_unref(seg->text);
+  else if (seg->capacity == INLINE_CHUNK && out->spare == NULL)
+    out->spare = seg->data;
+  else
+    free(seg->data);
+  memset(seg, 0, sizeof(segment_t));
+}
+
+void tcpserver_output_free(tcpserver_output_t *out) {
+  assert(out != NULL);
+  while (out->count > 0) {
+    segment_release(out, &out->segments[out->head]);
+    out->head = (out->head + 1) & (out->capacity - 1);
+    out->count--;
+  }
+  free(out->spare);
+  free(out->segments);
+  free(out);
+}
+
+/* get a new segment at the tail, NULL when out of memory */
+static segment_t *segment_add(tcpserver_output_t *out) {
+  if (out->count == out->capacity) {
+    segment_t *grown = calloc(out->capacity * 2, sizeof(segment_t));
+    unsigned int i;
+    if (grown == NULL)
+      return NULL;
+    for (i = 0; i < out->count; i++)
+      grown[i] = out->segments[(out->head + i) & (out->capacity - 1)];
+    free(out->segments);
+    out->segments = grown;
+    out->capacity *= 2;
+    out->head = 0;
+  }
+  out->count++;
+  return &out->segments[(out->head + out->count - 1) & (out->capacity - 1)];
+}
+
+static void mark_queued(tcpserver_output_t *out, size_t length) {
+  if (out->pending == 0 && output_policy.mode == flush_batch)
+    out->first = tcpserver_output_now();
+  out->pending += length;
+}
+
+int tcpserver_output_append(tcpserver_output_t *out, const void *data,
+                            size_t length) {
+  segment_t *seg = NULL;
+
+  if (length == 0)
+    return 0;
+
+  /* add to the last chunk of copied data if it has room */
+  if (out->count > 0) {
+    seg = &out->segments[(out->head + out->count - 1) & (out->capacity - 1)];
+    if (seg->text != NULL || seg->event ||
+        seg->capacity - seg->length < length)
+      seg = NULL;
+  }
+
+  if (seg == NULL) {
+    if ((seg = segment_add(out)) == NULL)
+      return -1;
+    if (length <= INLINE_CHUNK && out->spare != NULL) {
+      seg->data = out->spare;
+      out->spare = NULL;
+      seg->capacity = INLINE_CHUNK;
+    } else {
+      seg->capacity = length > INLINE_CHUNK ? length : INLINE_CHUNK;
+      seg->data = malloc(seg->capacity);
+      if (seg->data == NULL) {
+        out->count--;
+        return -1;
+      }
+    }
+    seg->text = NULL;
+    seg->length = 0;
+    seg->sent = 0;
+    seg->event = 0;
+  }
+
+  memcpy(seg->data + seg->length, data, length);
+  seg->length += length;
+  mark_queued(out, length);
+  return 0;
+}
+
+int tcpserver_output_append_text(tcpserver_output_t *out, vscp_text_t *text) {
+  segment_t *seg;
+
+  if ((seg = segment_add(out)) == NULL)
+    return -1;
+  seg->text = vscp_text_ref(text);
+  seg->data = NULL;
+  seg->length = text->length;
+  seg->capacity = 0;
+  seg->sent = 0;
+  seg->event = 0;
+  mark_queued(out, text->length);
+  return 0;
+}
+
+/* drop the oldest event nothing was written of yet. Returns 0, -1 if none */
+static int drop_oldest(tcpserver_output_t *out) {
+  unsigned int i, k;
+  segment_t *seg;
+
+  /* only replies can be queued before it, there won't be many */
+  for (i = 0; i < out->count; i++) {
+    seg = &out->segments[(out->head + i) & (out->capacity - 1)];
+    if (seg->event && seg->sent == 0)
+      break;
+  }
+  if (i == out->count)
+    return -1;
+
+  out->pending -= seg->length;
+  segment_release(out, seg);
+  /* close the gap by moving what's in front of it up */
+  for (k = i; k > 0; k--)
+    out->segments[(out->head + k) & (out->capacity - 1)] =
+        out->segments[(out->head + k - 1) & (out->capacity - 1)];
+  memset(&out->segments[out->head], 0, sizeof(segment_t));
+  out->head = (out->head + 1) & (out->capacity - 1);
+  out->count--;
+  out->dropped++;
+  return 0;
+}
+
+int tcpserver_output_append_event(tcpserver_output_t *out, vscp_text_t *text) {
+  int rval = 0;
+
+  while (out->events + text->length > overflow_policy.queue_bytes) {
+    if (overflow_policy.mode == overflow_disconnect)
+      return -1;
+    if (overflow_policy.mode == overflow_drop_newest ||
+        drop_oldest(out) != 0) {
+      out->dropped++;
+      return 1;
+    }
+    rval = 1;
+  }
+
+  if (tcpserver_output_append_text(out, text))
+    return -1;
+  out->segments[(out->head + out->count - 1) & (out->capacity - 1)].event = 1;
+  out->events += text->length;
+  return rval;
+}
+
+unsigned int tcpserver_output_dropped(tcpserver_output_t *out) {
+  return out->dropped;
+}
+
+int tcpserver_output_full(tcpserver_output_t *out) {
+  return out->pending >= overflow_policy.queue_bytes;
+}
+
+size_t tcpserver_output_pending(tcpserver_output_t *out) {
+  return out->pending;
+}
+
+int tcpserver_output_due(tcpserver_output_t *out, uint64_t now) {
+  if (out->pending == 0)
+    return 0;
+  if (output_policy.mode == flush_immediate)
+    return 1;
+  /* don't wait for a batch that would overflow the queue */
+  return out->pending >= output_policy.batch_bytes ||
+         out->pending >= overflow_policy.queue_bytes / 2 ||
+         now >= out->first + output_policy.batch_usec;
+}
+
+uint64_t tcpserver_output_deadline(tcpserver_output_t *out) {
+  if (out->pending == 0)
+    return UINT64_MAX;
+  if (output_policy.mode == flush_immediate)
+    return 0;
+  return out->first + output_policy.batch_usec;
+}
+
+int tcpserver_output_flush(tcpserver_output_t *out, int fd) {
+  struct iovec iov[MAX_IOV];
+  unsigned int i, n;
+  ssize_t written;
+
+  while (out->count > 0) {
+    /* gather as many segments as one writev() takes */
+    for (n = 0; n < out->count && n < MAX_IOV; n++) {
+      segment_t *seg = &out->segments[(out->head + n) & (out->capacity - 1)];
+      const char *base = seg->text != NULL ? seg->text->data : seg->data;
+      iov[n].iov_base = (void *)(base + seg->sent);
+      iov[n].iov_len = seg->length - seg->sent;
+    }
+
+    written = writev(fd, iov, n);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 1;
+      return -1;
+    }
+    out->pending -= written;
+
+    /* release what went out completely, remember where we are in the rest */
+    for (i = 0; i < n && written > 0; i++) {
+      segment_t *seg = &out->segments[out->head];
+      size_t left = seg->length - seg->sent;
+      if ((size_t)written < left) {
+        seg->sent += written;
+        if (seg->event)
+          out->events -= written;
+        break;
+      }
+      written -= left;
+      segment_release(out, seg);
+      out->head = (out->head + 1) & (out->capacity - 1);
+      out->count--;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,109 @@
+// uvscpd - Minimalist VSCP Daemon
+// Copyright (C) 2019 Maarten Zanders
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _TCPSERVER_OUTPUT_H_
+#define _TCPSERVER_OUTPUT_H_
+
+/* Per connection output buffer. Replies and events are gathered and written
+ * with a single writev() when the flush policy says so. Shared texts are
+ * referenced, not copied. The buffer is bounded: events that don't fit are
+ * handled according to the overflow policy, replies are always kept. */
+
+#include <stddef.h>
+#include <stdint.h>
+#include "vscp_text.h"
+
+typedef enum {
+  flush_immediate, // write at the end of every event loop round
+  flush_batch      // write when enough bytes gathered or on a deadline
+} flush_mode_t;
+
+typedef struct {
+  flush_mode_t mode;
+  size_t batch_bytes;       // flush_batch: write once this much is gathered
+  unsigned int batch_usec;  // flush_batch: or when the oldest byte is this old
+} flush_policy_t;
+
+typedef enum {
+  overflow_drop_oldest, // make room by dropping the oldest queued events
+  overflow_drop_newest, // drop the event that doesn't fit
+  overflow_disconnect   // give up on the client
+} overflow_mode_t;
+
+typedef struct {
+  overflow_mode_t mode;
+  size_t queue_bytes;  // max bytes of events waiting to be written
+} overflow_policy_t;
+
+typedef struct tcpserver_output tcpserver_output_t;
+
+// Set the policy for all connections, defaults to flush_immediate
+void tcpserver_output_set_policy(const flush_policy_t *policy);
+const flush_policy_t *tcpserver_output_get_policy(void);
+
+// Parse "immediate" or "batch[,<bytes>[,<usec>]]". Returns 0 on success.
+int tcpserver_output_parse_policy(const char *input, flush_policy_t *policy);
+
+// Set the overflow policy for all connections, defaults to dropping the
+// oldest events beyond 64 KiB
+void tcpserver_output_set_overflow(const overflow_policy_t *policy);
+const overflow_policy_t *tcpserver_output_get_overflow(void);
+
+// Parse "oldest", "newest" or "disconnect", optionally followed by
+// ",<bytes>". Returns 0 on success.
+int tcpserver_output_parse_overflow(const char *input,
+                                    overflow_policy_t *policy);
+
+// Create/free an output buffer
+tcpserver_output_t *tcpserver_output_create(void);
+void tcpserver_output_free(tcpserver_output_t *out);
+
+// Queue a copy of 'length' bytes. Returns 0, -1 when out of memory.
+int tcpserver_output_append(tcpserver_output_t *out, const void *data,
+                            size_t length);
+
+// Queue a shared text, a reference is taken. Returns 0, -1 when out of memory.
+int tcpserver_output_append_text(tcpserver_output_t *out, vscp_text_t *text);
+
+// Queue an event, subject to the overflow policy. A reference to the text is
+// taken. Returns 0 when queued, 1 when an event was dropped, -1 when the
+// client should be disconnected.
+int tcpserver_output_append_event(tcpserver_output_t *out, vscp_text_t *text);
+
+// Number of events dropped so far
+unsigned int tcpserver_output_dropped(tcpserver_output_t *out);
+
+// Is the buffer over its limit? Stop taking commands from the client then.
+int tcpserver_output_full(tcpserver_output_t *out);
+
+// Number of bytes waiting to be written
+size_t tcpserver_output_pending(tcpserver_output_t *out);
+
+// Should the buffer be written now, according to the policy? 'now' is in
+// microseconds on CLOCK_MONOTONIC.
+int tcpserver_output_due(tcpserver_output_t *out, uint64_t now);
+
+// When the buffer has to be written at the latest, UINT64_MAX if empty
+uint64_t tcpserver_output_deadline(tcpserver_output_t *out);
+
+// Write as much as possible to the non-blocking 'fd'. Returns 0 when
+// everything was written, 1 when the socket is full, -1 on error.
+int tcpserver_output_flush(tcpserver_output_t *out, int fd);
+
+// Current CLOCK_MONOTONIC time in microseconds
+uint64_t tcpserver_output_now(void);
+
+#endif /* _TCPSERVER_OUTPUT_H_ */
@@ -0,0 +1,157 @@
+// uvscpd - Minimalist VSCP Daemon
+// Copyright (C) 2019 Maarten Zanders
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tcpserver_route.h"
+
+#define CLASSES 512
+#define TYPES 256
+#define CLASS_SHIFT 16
+#define TYPE_SHIFT 8
+#define CLASS_BITS (0x1FFU << CLASS_SHIFT)
+#define TYPE_BITS (0xFFU << TYPE_SHIFT)
+
+typedef struct tcpserver_route {
+  unsigned int words; /* per bitmap */
+  uint64_t *classes;  /* CLASSES bitmaps: slots wanting every type */
+  uint64_t *types[CLASSES]; /* TYPES bitmaps each, when a class is split */
+} tcpserver_route_t;
+
+tcpserver_route_t *tcpserver_route_create(unsigned int slots) {
+  tcpserver_route_t *route;
+
+  route = calloc(1, sizeof(tcpserver_route_t));
+  if (route == NULL)
+    return NULL;
+  route->words = (slots + 63) / 64;
+  route->classes = calloc(CLASSES * route->words, sizeof(uint64_t));
+  if (route->classes == NULL) {
+    free(route);
+    return NULL;
+  }
+  return route;
+}
+
+void tcpserver_route_free(tcpserver_route_t *route) {
+  unsigned int c;
+
+  for (c = 0; c < CLASSES; c++)
+    free(route->types[c]);
+  free(route->classes);
+  free(route);
+}
+
+/* give class 'c' a bitmap per type. Returns -1 when out of memory */
+static int class_split(tcpserver_route_t *route, unsigned int c) {
+  unsigned int t, words = route->words;
+
+  if (route->types[c] != NULL)
+    return 0;
+  route->types[c] = malloc(TYPES * words * sizeof(uint64_t));
+  if (route->types[c] == NULL)
+    return -1;
+  for (t = 0; t < TYPES; t++)
+    memcpy(&route->types[c][t * words], &route->classes[c * words],
+           words * sizeof(uint64_t));
+  return 0;
+}
+
+static void class_set(tcpserver_route_t *route, unsigned int c,
+                      unsigned int slot) {
+  unsigned int t, words = route->words;
+  uint64_t bit = 1ULL << (slot % 64);
+
+  route->classes[c * words + slot / 64] |= bit;
+  if (route->types[c] != NULL)
+    for (t = 0; t < TYPES; t++)
+      route->types[c][t * words + slot / 64] |= bit;
+}
+
+void tcpserver_route_clear(tcpserver_route_t *route, unsigned int slot) {
+  unsigned int c, t, words = route->words;
+  uint64_t mask = ~(1ULL << (slot % 64));
+
+  for (c = 0; c < CLASSES; c++) {
+    route->classes[c * words + slot / 64] &= mask;
+    if (route->types[c] != NULL)
+      for (t = 0; t < TYPES; t++)
+        route->types[c][t * words + slot / 64] &= mask;
+  }
+}
+
+int tcpserver_route_set(tcpserver_route_t *route, unsigned int slot,
+                        const struct can_filter *filters, unsigned int count) {
+  unsigned int i, c, t, words = route->words;
+  unsigned int class_id, class_mask, type_id, type_mask;
+  int exact = 1;
+
+  assert(slot < words * 64);
+  tcpserver_route_clear(route, slot);
+
+  for (i = 0; i < count; i++) {
+    canid_t id = filters[i].can_id, mask = filters[i].can_mask;
+
+    /* VSCP frames are extended frames */
+    if ((mask & CAN_EFF_FLAG) && !(id & CAN_EFF_FLAG) &&
+        !(id & CAN_INV_FILTER))
+      continue;
+    if ((id & CAN_INV_FILTER) ||
+        (mask & ~(CLASS_BITS | TYPE_BITS | CAN_EFF_FLAG)) != 0)
+      exact = 0;
+    if (id & CAN_INV_FILTER) {
+      /* the frames it lets through may be of any class and type */
+      mask = 0;
+    }
+
+    class_id = (id & CLASS_BITS) >> CLASS_SHIFT;
+    class_mask = (mask & CLASS_BITS) >> CLASS_SHIFT;
+    type_id = (id & TYPE_BITS) >> TYPE_SHIFT;
+    type_mask = (mask & TYPE_BITS) >> TYPE_SHIFT;
+
+    for (c = 0; c < CLASSES; c++) {
+      if (((c ^ class_id) & class_mask) != 0)
+        continue;
+      if (type_mask == 0 || class_split(route, c) < 0) {
+        /* out of memory routes the whole class, which is more than needed */
+        if (type_mask != 0)
+          exact = 0;
+        class_set(route, c, slot);
+        continue;
+      }
+      for (t = 0; t < TYPES; t++)
+        if (((t ^ type_id) & type_mask) == 0)
+          route->types[c][t * words + slot / 64] |= 1ULL << (slot % 64);
+    }
+  }
+  return exact;
+}
+
+const uint64_t *tcpserver_route_lookup(const tcpserver_route_t *route,
+                                       canid_t id) {
+  unsigned int c = (id & CLASS_BITS) >> CLASS_SHIFT;
+  unsigned int t = (id & TYPE_BITS) >> TYPE_SHIFT;
+
+  if (route->types[c] != NULL)
+    return &route->types[c][t * route->words];
+  return &route->classes[c * route->words];
+}
+
+unsigned int tcpserver_route_words(const tcpserver_route_t *route) {
+  return route->words;
+}
@@ -0,0 +1,54 @@
+// uvscpd - Minimalist VSCP Daemon
+// Copyright (C) 2019 Maarten Zanders
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _TCPSERVER_ROUTE_H_
+#define _TCPSERVER_ROUTE_H_
+
+/* Routing index from VSCP class and type to the sessions whose filters may
+ * want a frame, as a bitmap of session slots. A class holds a single bitmap
+ * for all its types until some session wants only some of them, then one per
+ * type. Looking up a frame takes the same time however many sessions and
+ * filters there are. */
+
+#include <stdint.h>
+#include <linux/can.h>
+
+typedef struct tcpserver_route tcpserver_route_t;
+
+// Create an index for sessions in slots 0 .. 'slots' - 1. Returns NULL when
+// out of memory.
+tcpserver_route_t *tcpserver_route_create(unsigned int slots);
+
+void tcpserver_route_free(tcpserver_route_t *route);
+
+// Route the frames matching any of the CAN_RAW_FILTER pairs 'filters' to
+// 'slot', instead of what was routed to it before. Returns 1 when the index
+// decides exactly which frames the slot wants, 0 when it only narrows them
+// down (filters on priority or nickname, inverted filters) and each needs
+// checking against the filters still.
+int tcpserver_route_set(tcpserver_route_t *route, unsigned int slot,
+                        const struct can_filter *filters, unsigned int count);
+
+// Route nothing to 'slot'
+void tcpserver_route_clear(tcpserver_route_t *route, unsigned int slot);
+
+// The slots frame 'id' may go to, tcpserver_route_words() words long
+const uint64_t *tcpserver_route_lookup(const tcpserver_route_t *route,
+                                       canid_t id);
+
+unsigned int tcpserver_route_words(const tcpserver_route_t *route);
+
+#endif /* _TCPSERVER_ROUTE_H_ */
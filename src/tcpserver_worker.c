@@ -16,6 +16,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <linux/can/raw.h>
 #include <linux/sockios.h>
 #include <net/if.h>
@@ -25,25 +26,38 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <time.h>
 
+#include "canbus_history.h"
 #include "cmd_interpreter.h"
 #include "syserror.h"
 #include "tcpserver_commands.h"
+#include "tcpserver_conflate.h"
 #include "tcpserver_context.h"
+#include "tcpserver_output.h"
+#include "tcpserver_route.h"
 #include "tcpserver_worker.h"
 #include "config.h"
 #include "vscp.h"
 #include "vscp_buffer.h"
 
-/* helper functions */
-void handle_noop(context_t *context);
-void handle_quit(context_t *context);
-void tcpserver_work_cleanup(void *context);
-int nbytes;
+/* bytes read from a client at once, all complete lines in it are handled
+ * as a batch */
+#define INPUT_BUFFER_SIZE 16384
+/* most blocks of captured frames a 'hist' lookup reads per event loop
+ * round, the other sessions don't wait for a long one */
+#define HISTORY_BLOCKS 8
+/* events of a 'resume' written per event loop round */
+#define RESUME_EVENTS 256
+/* transmit scheduler tag of the frames of sends without a number, numbered
+ * ones carry their sequence number */
+#define TX_TAG_UNNUMBERED 0x80000000u
+
+static const char *ModuleName = "TCPWorker";
 
 extern vscp_guid_t gGuid;
 
@@ -68,167 +82,808 @@ int print_vscp_frame(context_t *context, const struct can_frame *frame) {
   return writen(context, buffer, strlen(buffer));
 }
 
-void tcpserver_work(int connfd, const char * can_bus, time_t started){
-  ssize_t n;
-  char buf[120];
-  context_t context;
+context_t *tcpserver_session_open(int connfd, const char *can_bus,
+                                  time_t started, unsigned int depth,
+                                  const char *capture_directory) {
+  context_t *context;
   char *welcome_message =
       PACKAGE_STRING "\r\n"
       PACKAGE_BUGREPORT "\r\n";
-  struct sockaddr_can addr;
-  struct ifreq ifr;
-  struct can_frame frame;
-  int sock_flags;
-  struct pollfd poll_fd[2];
   const int max_argc = 10;
   const int max_line_length = 320;
 
-  memset(&addr, 0, sizeof(struct sockaddr_can));
-
-  context.user_ok = (cmd_user == NULL);
-  context.password_ok = (cmd_password == NULL);
-  context.stop_thread = 0;
-  context.tcpfd = connfd;
-  context.mode = normal;
-  context.can_socket = socket(PF_CAN, SOCK_RAW, CAN_RAW);
-  context.command_buffer_wp = 0;
-  context.guid = gGuid; /* initialize to default guid provided externally */
-  context.cmd_interpreter = cmd_interpreter_ctx_create(
+  context = calloc(1, sizeof(context_t));
+  if (context == NULL)
+    return NULL;
+  context->output = tcpserver_output_create();
+  if (context->output == NULL) {
+    free(context);
+    return NULL;
+  }
+
+  context->user_ok = (cmd_user == NULL);
+  context->password_ok = (cmd_password == NULL);
+  context->stop_session = 0;
+  context->tcpfd = connfd;
+  context->mode = normal;
+  context->bus = NULL;
+  context->tx_flow = NULL;
+  context->route = NULL;
+  context->route_slot = 0;
+  context->rx_exact = 0;
+  context->command_buffer_wp = 0;
+  context->tx_batch_count = 0;
+  context->tx_window = 0;
+  context->tx_seq = 0;
+  context->tx_queued = 0;
+  context->tx_unacked = 0;
+  context->guid = gGuid; /* initialize to default guid provided externally */
+  vscp_guid_prefix_set(&(context->guid_prefix), &(context->guid));
+  context->cmd_interpreter = cmd_interpreter_ctx_create(
       command_descr, command_descr_num, max_argc, 1, max_line_length, " ");
-  context.rx_buffer = vscp_buffer_ctx_create(100);
-  context.stat_rx_data = 0;
-  context.stat_rx_frame = 0;
-  context.stat_tx_data = 0;
-  context.stat_tx_frame = 0;
-  context.can_bus = can_bus;
-  context.started = started;
-  context.filter.can_id = 0x0;
-  context.filter.can_mask = 0x0;
-  pthread_cleanup_push(tcpserver_work_cleanup, &context);
-
-  writen(&context, welcome_message, strlen(welcome_message));
-
-  strncpy(ifr.ifr_name, can_bus, IFNAMSIZ - 1);
-  if (ioctl(context.can_socket, SIOCGIFINDEX, &ifr) == -1) {
-    snprintf(buf, 120, "interface [%s] error: %s", can_bus, strerror(errno));
-    status_reply(&context, 1, buf);
-    context.stop_thread = 1;
-  } else {
-    addr.can_family = AF_CAN;
-    addr.can_ifindex = ifr.ifr_ifindex;
-
-    /* set to non-blocking mode */
-    sock_flags = fcntl(context.can_socket, F_GETFL, 0);
-    fcntl(context.can_socket, F_SETFL, sock_flags | O_NONBLOCK);
-
-    if (bind(context.can_socket, (struct sockaddr *)&addr, sizeof(addr)) ==
-        -1) {
-      snprintf(buf, 120, "error binding to CAN bus: %s", strerror(errno));
-      status_reply(&context, 1, buf);
-      context.stop_thread = 1;
+  context->rx_cursor = 0;
+  context->rx_pending = 0;
+  context->rx_depth = depth;
+  context->rx_high_watermark = 0;
+  context->conflate = NULL;
+  context->conflating = 0;
+  context->rx_numbered = 0;
+  context->capture_directory = capture_directory;
+  context->history = NULL;
+  context->history_sent = 0;
+  context->resuming = 0;
+  context->resume_end = 0;
+  context->resume_sent = 0;
+  context->resume_evicted = 0;
+  context->held_input = NULL;
+  context->held_length = 0;
+  context->stat_overflows = 0;
+  context->stat_conflated = 0;
+  context->stat_rx_data = 0;
+  context->stat_rx_frame = 0;
+  context->stat_tx_data = 0;
+  context->stat_tx_frame = 0;
+  context->can_bus = can_bus;
+  context->started = started;
+  context->filter.can_id = 0x0;
+  context->filter.can_mask = 0x0;
+  context->subscription_count = 0;
+  context->rx_filters[0] = context->filter;
+  context->rx_filter_count = 1;
+  context->rx_watch_count = 0;
+  context->tcp_source.type = source_tcp;
+  context->tcp_source.context = context;
+  context->next = NULL;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &(context->last_keepalive));
+
+  writen(context, welcome_message, strlen(welcome_message));
+
+  return context;
+}
+
+void tcpserver_session_attach(context_t *context, canbus_t *bus,
+                              tcpserver_route_t *route, unsigned int slot) {
+  char buf[120];
+
+  context->tx_flow = canbus_flow_open(bus, context);
+  if (context->tx_flow == NULL) {
+    status_reply(context, 1, "out of memory");
+    context->stop_session = 1;
+    return;
+  }
+  context->bus = bus;
+  context->rx_cursor = vscp_buffer_head(canbus_ring(bus));
+  context->rx_pending = 0;
+  /* what it had without a bus: everything, unless it set a filter already */
+  canbus_subscribe(bus, context, context->rx_filters, context->rx_filter_count);
+  context->route = route;
+  context->route_slot = slot;
+  context->rx_exact = tcpserver_route_set(route, slot, context->rx_filters,
+                                          context->rx_filter_count);
+
+  snprintf(buf, 120, "Success, connected to %s", context->can_bus);
+  status_reply(context, 0, buf);
+}
+
+void tcpserver_session_bus_lost(context_t *context) {
+  /* gone along with the bus */
+  context->bus = NULL;
+  context->tx_flow = NULL;
+  status_reply(context, 1, "CAN Disconnected - bye!");
+  context->stop_session = 1;
+}
+
+void tcpserver_session_tcp_event(context_t *context, uint32_t events) {
+  ssize_t n;
+  char buf[INPUT_BUFFER_SIZE];
+
+  if (events & EPOLLIN) {
+    n = read(context->tcpfd, buf, sizeof(buf));
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+      /* spurious wakeup, try again later */
+    } else if (n <= 0) {
+      context->stop_session = 1; /* error or closed socket */
     } else {
-      snprintf(buf, 120, "Success, connected to %s", can_bus);
-      status_reply(&context, 0, buf);
+      tcpserver_handle_input(context, buf, n);
     }
   }
+  if (events & EPOLLOUT) {
+    context->output_blocked = 0;
+    if (context->mode == loop)
+      tcpserver_session_drain(context); /* what waited for the socket */
+  }
+  if (events & (EPOLLERR | EPOLLHUP)) {
+    context->stop_session = 1;
+  }
+}
 
-  while (!context.stop_thread) {
-    // Set up the poll structure
-    poll_fd[0].fd = context.tcpfd;
-    poll_fd[0].events = POLLIN;
-    poll_fd[0].revents = 0;
-    poll_fd[1].fd = context.can_socket;
-    poll_fd[1].events = POLLIN;
-    poll_fd[1].revents = 0;
-
-    int poll_rv;
-    poll_rv = poll(poll_fd, 2, 200);
-
-    if (poll_rv < 0) {
-      snprintf(buf, 120, "Poll error - %s", strerror(errno));
-      status_reply(&context, 1, buf);
-      context.stop_thread = 1;
-    } else if (poll_rv > 0) {
-
-      /* handle TCP events */
-      if (poll_fd[0].revents & POLLIN) {
-        n = read(context.tcpfd, buf, sizeof(buf));
-        if(n<=0){
-          context.stop_thread = 1; /* error or closed socket */
-        } else {
-          tcpserver_handle_input(&context, buf, n);
-        }
-      }
-      if (poll_fd[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
-        context.stop_thread = 1;
-      }
+/* same semantics as a CAN_RAW_FILTER on the socket: a frame passes when it
+ * matches any of the filters */
+static int session_match(context_t *context, const vscp_buffer_entry_t *entry) {
+  const struct can_filter *filter = context->rx_filters;
+  const struct can_filter *end = filter + context->rx_filter_count;
+  canid_t id = entry->frame.can_id;
+  unsigned int i;
 
-      /* handle CAN events */
-      if (poll_fd[1].revents & POLLIN) {
-        if (read(context.can_socket, &frame, sizeof(struct can_frame)) ==
-            sizeof(struct can_frame)) {
-          vscp_msg_t msg;
-          struct timeval tv;
-          ioctl(context.can_socket, SIOCGSTAMP, &tv);
-          if (!can_to_vscp(&frame, &tv, &msg, &(context.guid))) {
-            context.stat_rx_data += frame.can_dlc + 4;
-            context.stat_rx_frame++;
-            if (context.mode == loop) {
-              n = print_vscp(&msg, buf, sizeof(buf));
-              writen(&context, buf, n);
-            } else {
-              vscp_buffer_push(context.rx_buffer, &msg);
-            }
-          }
-        }
-      }
-      if (poll_fd[1].revents & (POLLERR | POLLHUP | POLLNVAL)) {
-        status_reply(&context, 1, "CAN Disconnected - bye!");
-        context.stop_thread = 1;
+  if (entry->origin == context)
+    return 0;
+  /* what the broadcast manager tells is only for those watching it */
+  if (entry->origin == CANBUS_CHANGED || entry->origin == CANBUS_SILENT) {
+    for (i = 0; i < context->rx_watch_count; i++)
+      if (context->rx_watches[i].id == id &&
+          (entry->origin == CANBUS_CHANGED ||
+           context->rx_watches[i].timeout_ms != 0))
+        return 1;
+    return 0;
+  }
+  for (; filter < end; filter++) {
+    int hit = ((id ^ filter->can_id) & filter->can_mask &
+               ~(canid_t)CAN_INV_FILTER) == 0;
+    if (filter->can_id & CAN_INV_FILTER ? !hit : hit)
+      return 1;
+  }
+  return 0;
+}
+
+#define RECOUNT_BATCH 64
+
+/* count the messages for us between the cursor and the head of the ring */
+static void session_recount(context_t *context) {
+  vscp_buffer_ctx_t *ring = canbus_ring(context->bus);
+  vscp_buffer_entry_t entries[RECOUNT_BATCH];
+  unsigned int i, n;
+  uint64_t seq;
+
+  if (context->rx_cursor < vscp_buffer_tail(ring))
+    context->rx_cursor = vscp_buffer_tail(ring);
+
+  context->rx_pending = 0;
+  seq = context->rx_cursor;
+  while ((n = vscp_buffer_get_bulk(ring, seq, entries, RECOUNT_BATCH)) > 0) {
+    for (i = 0; i < n; i++)
+      if (session_match(context, &entries[i]))
+        context->rx_pending++;
+    seq += n;
+  }
+}
+
+/* discard the oldest pending messages beyond the depth */
+static void session_trim(context_t *context) {
+  while (context->rx_pending > context->rx_depth) {
+    tcpserver_session_pop(context, NULL, NULL);
+    context->stat_overflows++;
+  }
+}
+
+int tcpserver_session_pop(context_t *context, uint64_t *seq,
+                          vscp_buffer_entry_t *entry) {
+  vscp_buffer_ctx_t *ring = canbus_ring(context->bus);
+  vscp_buffer_entry_t next;
+  unsigned int pending;
+
+  /* conflated messages are older than any pending in the ring */
+  if (context->conflate != NULL) {
+    while (tcpserver_conflate_get(context->conflate, seq, &next) == 0)
+      if (session_match(context, &next)) {
+        if (entry != NULL)
+          *entry = next;
+        return 0;
       }
+    if (!context->conflating) {
+      tcpserver_conflate_free(context->conflate);
+      context->conflate = NULL;
     }
-    /* POLL TIMEOUT */
-    else if (poll_rv == 0) {
-      if (context.mode == loop) {
-        struct timespec now;
-        clock_gettime(CLOCK_MONOTONIC_RAW, &now);
-        /* this is not really accurate, especially on the first run, but close
-         * enough and it will do for the purpose */
-        if ((now.tv_sec - context.last_keepalive.tv_sec) > 1) {
-          status_reply(&context, 0, NULL);
-          context.last_keepalive = now;
-        }
-      }
+  }
+
+  /* messages we didn't get to in time were overwritten by newer ones */
+  if (context->rx_cursor < vscp_buffer_tail(ring)) {
+    pending = context->rx_pending;
+    session_recount(context);
+    if (pending > context->rx_pending)
+      context->stat_overflows += pending - context->rx_pending;
+    session_trim(context);
+  }
+
+  while (context->rx_pending > 0 &&
+         vscp_buffer_get(ring, context->rx_cursor, &next) == 0) {
+    context->rx_cursor++;
+    if (session_match(context, &next)) {
+      context->rx_pending--;
+      if (seq != NULL)
+        *seq = context->rx_cursor - 1;
+      if (entry != NULL)
+        *entry = next;
+      return 0;
     }
   }
-  pthread_cleanup_pop(1);
+  context->rx_pending = 0;
+  return -1;
 }
 
-void tcpserver_work_cleanup(void *context) {
-  context_t *ctx = (context_t *)context;
-  cmd_interpreter_free(ctx->cmd_interpreter);
-  vscp_buffer_free(ctx->rx_buffer);
+/* queue an event for the client, subject to the overflow policy */
+static int session_queue_event(context_t *context, vscp_text_t *text) {
+  int rval = tcpserver_output_append_event(context->output, text);
+  if (rval < 0) {
+    context->stop_session = 1; /* too slow or out of memory */
+    return -1;
+  }
+  return rval == 0 ? (int)text->length : 0;
 }
 
-/* Write "n" bytes to a descriptor. */
-ssize_t writen(context_t * context, const void *vptr, size_t n){
-  size_t nleft;
-  ssize_t nwritten;
-  const char *ptr;
-  ptr = vptr;
-  nleft = n;
-  while (nleft > 0) {
-    if ((nwritten = write(context->tcpfd, ptr, nleft)) <= 0) {
-      if (nwritten < 0 && errno == EINTR){
-        nwritten = 0; /* and call write() again */
-      } else {
-        /* error on the TCP socket */
-        context->stop_thread = 1;
-        return (-1); /* error */
-      }
+/* message 'seq' as the client gets it, a new reference. NULL when it is gone
+ * from the ring and no 'entry' was given, or when out of memory */
+static vscp_text_t *session_render(context_t *context, uint64_t seq,
+                                   const vscp_buffer_entry_t *entry) {
+  const vscp_guid_t *bus_guid = canbus_guid(context->bus);
+  vscp_buffer_entry_t stored;
+  vscp_msg_t msg;
+  vscp_text_t *text;
+  char buf[VSCP_TEXT_MAX + 24];
+  canid_t id;
+  int n = 0;
+
+  if (entry == NULL) {
+    if (vscp_buffer_get(canbus_ring(context->bus), seq, &stored))
+      return NULL;
+    entry = &stored;
+  }
+
+  if (context->rx_numbered)
+    n = snprintf(buf, sizeof(buf), "%" PRIu64 ":", seq);
+
+  if (entry->origin == CANBUS_SILENT) {
+    /* not a message, a watched one that didn't come in time */
+    id = entry->frame.can_id;
+    n += snprintf(buf + n, sizeof(buf) - n, "silent,%u,%u,%u,%u\r\n",
+                  (id >> 26) & 0x7, (id >> 16) & 0x1FF, (id >> 8) & 0xFF,
+                  id & 0xFF);
+  } else {
+    /* clients using the interface GUID all share the same rendered text */
+    if (!context->rx_numbered &&
+        memcmp(&(context->guid), bus_guid, sizeof(vscp_guid_t)) == 0) {
+      text = canbus_text(context->bus, seq);
+      if (text != NULL)
+        return vscp_text_ref(text);
+      /* a conflated message can outlive its place in the ring */
     }
-    nleft -= nwritten;
-    ptr += nwritten;
+    can_to_vscp(&(entry->frame), entry->timestamp, &msg, bus_guid);
+    n += print_vscp_prefix(&msg, &(context->guid_prefix), buf + n,
+                           sizeof(buf) - n);
+  }
+
+  text = vscp_text_create(buf, n);
+  if (text == NULL)
+    context->stop_session = 1;
+  return text;
+}
+
+int tcpserver_session_write_event(context_t *context, uint64_t seq,
+                                  const vscp_buffer_entry_t *entry) {
+  vscp_text_t *text = session_render(context, seq, entry);
+  int n;
+
+  if (text == NULL)
+    return -1;
+  n = session_queue_event(context, text);
+  vscp_text_unref(text);
+  return n;
+}
+
+int tcpserver_session_reply_event(context_t *context, uint64_t seq,
+                                  const vscp_buffer_entry_t *entry) {
+  vscp_text_t *text = session_render(context, seq, entry);
+  int n = -1;
+
+  if (text == NULL)
+    return -1;
+  /* asked for by the client, so kept like any other reply */
+  if (tcpserver_output_append_text(context->output, text) == 0)
+    n = text->length;
+  else
+    context->stop_session = 1; /* out of memory */
+  vscp_text_unref(text);
+  return n;
+}
+
+unsigned int tcpserver_session_pending(context_t *context) {
+  if (context->conflate != NULL)
+    return context->rx_pending + tcpserver_conflate_length(context->conflate);
+  return context->rx_pending;
+}
+
+int tcpserver_session_resume(context_t *context, uint64_t seq) {
+  vscp_buffer_ctx_t *ring = canbus_ring(context->bus);
+
+  if (seq > vscp_buffer_head(ring))
+    return -1;
+  if (seq < vscp_buffer_first(ring))
+    return -2;
+  context->resume_evicted =
+      seq < vscp_buffer_tail(ring) ? vscp_buffer_tail(ring) - seq : 0;
+
+  /* what is pending now is part of the gap, or came after it */
+  if (context->conflate != NULL)
+    tcpserver_conflate_clear(context->conflate);
+  context->rx_cursor = seq;
+  session_recount(context);
+
+  /* sent by the event loop, no other commands are taken meanwhile */
+  context->resuming = 1;
+  context->resume_end = vscp_buffer_head(ring);
+  context->resume_sent = 0;
+  return 0;
+}
+
+/* keep the input after a command that streams its output, it is taken when
+ * the stream is done */
+static void session_hold_input(context_t *context, const char *input,
+                               size_t length) {
+  context->held_input = malloc(length);
+  if (context->held_input == NULL) {
+    context->stop_session = 1; /* out of memory */
+    return;
+  }
+  memcpy(context->held_input, input, length);
+  context->held_length = length;
+}
+
+static void session_take_held_input(context_t *context) {
+  char *input = context->held_input;
+
+  if (input == NULL || context->stop_session)
+    return;
+  context->held_input = NULL;
+  /* may hold what comes after the next 'hist' again */
+  tcpserver_handle_input(context, input, context->held_length);
+  free(input);
+}
+
+void tcpserver_session_resume_stream(context_t *context) {
+  vscp_buffer_ctx_t *ring = canbus_ring(context->bus);
+  vscp_buffer_entry_t entry;
+  uint64_t seq;
+  char buf[80];
+  unsigned int n;
+  int more = 1;
+
+  /* not subject to the depth or the overflow policy, but paced by the
+   * client: what doesn't fit waits for the next round */
+  for (n = 0; n < RESUME_EVENTS && !context->stop_session &&
+              !tcpserver_output_full(context->output);
+       n++) {
+    /* what the ring lost meanwhile counts as evicted */
+    if (context->rx_cursor < vscp_buffer_tail(ring)) {
+      context->resume_evicted += vscp_buffer_tail(ring) - context->rx_cursor;
+      session_recount(context);
+    }
+    if (context->rx_cursor >= context->resume_end ||
+        tcpserver_session_pop(context, &seq, &entry) != 0) {
+      more = 0;
+      break;
+    }
+    if (tcpserver_session_reply_event(context, seq, &entry) < 0)
+      break;
+    context->resume_sent++;
+  }
+  context->loop_active = 1;
+  if (more || context->stop_session)
+    return;
+
+  if (context->resume_evicted > 0)
+    snprintf(buf, sizeof(buf), "%u events, %" PRIu64 " before them evicted",
+             context->resume_sent, context->resume_evicted);
+  else
+    snprintf(buf, sizeof(buf), "%u events", context->resume_sent);
+  status_reply(context, 0, buf);
+  context->resuming = 0;
+
+  /* back to as usual with what came in meanwhile */
+  if (context->mode == loop)
+    tcpserver_session_drain(context);
+  else
+    session_trim(context);
+  session_take_held_input(context);
+}
+
+void tcpserver_session_history(context_t *context) {
+  canbus_capture_record_t records[CANBUS_CAPTURE_BLOCK];
+  canbus_history_stats_t stats;
+  struct can_frame frame;
+  vscp_msg_t msg;
+  char buf[VSCP_TEXT_MAX];
+  unsigned int blocks;
+  int i, n = 0;
+
+  /* paced by the client: what doesn't fit waits for the next round */
+  for (blocks = 0; blocks < HISTORY_BLOCKS && !context->stop_session &&
+                   !tcpserver_output_full(context->output);
+       blocks++) {
+    n = canbus_history_read(context->history, records);
+    if (n < 0)
+      break;
+    for (i = 0; i < n; i++) {
+      memset(&frame, 0, sizeof(frame));
+      frame.can_id = records[i].can_id;
+      frame.can_dlc = records[i].dlc;
+      memcpy(frame.data, records[i].data, sizeof(frame.data));
+      if (can_to_vscp(&frame, records[i].timestamp, &msg, &(context->guid)))
+        continue;
+      writen(context, buf,
+             print_vscp_prefix(&msg, &(context->guid_prefix), buf,
+                               sizeof(buf)));
+      context->history_sent++;
+    }
+  }
+  if (n >= 0 && !context->stop_session)
+    return;
+
+  if (n == -2) {
+    status_reply(context, 1, "error reading the capture");
+  } else {
+    canbus_history_stats(context->history, &stats);
+    snprintf(buf, sizeof(buf), "%u events, %lu of %lu blocks read",
+             context->history_sent, stats.blocks,
+             stats.blocks + stats.blocks_skipped);
+    status_reply(context, 0, buf);
+  }
+  canbus_history_close(context->history);
+  context->history = NULL;
+  session_take_held_input(context);
+}
+
+void tcpserver_session_clear(context_t *context) {
+  context->rx_cursor = vscp_buffer_head(canbus_ring(context->bus));
+  context->rx_pending = 0;
+  if (context->conflate != NULL)
+    tcpserver_conflate_clear(context->conflate);
+}
+
+/* keep message 'seq' as the latest of its key in 'table'. With more keys
+ * than the depth, the one pending the longest is lost. */
+static void session_conflate_put(context_t *context,
+                                 tcpserver_conflate_t *table, uint64_t seq,
+                                 const vscp_buffer_entry_t *entry) {
+  int rval = tcpserver_conflate_put(table, seq, entry);
+
+  if (rval < 0) {
+    tcpserver_conflate_get(table, NULL, NULL);
+    context->stat_overflows++;
+    rval = tcpserver_conflate_put(table, seq, entry);
+  }
+  if (rval == 1)
+    context->stat_conflated++;
+}
+
+int tcpserver_session_conflate(context_t *context, int index) {
+  tcpserver_conflate_t *table;
+  vscp_buffer_entry_t entry;
+  uint64_t seq;
+
+  if (context->conflating &&
+      tcpserver_conflate_index(context->conflate) == index)
+    return 0;
+  table = tcpserver_conflate_create(context->rx_depth, index);
+  if (table == NULL)
+    return -1;
+
+  /* what is pending already is conflated as well, in the order it came */
+  while (tcpserver_session_pop(context, &seq, &entry) == 0)
+    session_conflate_put(context, table, seq, &entry);
+  if (context->conflate != NULL)
+    tcpserver_conflate_free(context->conflate);
+  context->conflate = table;
+  context->conflating = 1;
+  return 0;
+}
+
+void tcpserver_session_unconflate(context_t *context) {
+  /* the table goes once emptied, see tcpserver_session_pop() */
+  context->conflating = 0;
+}
+
+void tcpserver_session_drain(context_t *context) {
+  vscp_buffer_entry_t entry;
+  uint64_t seq;
+
+  /* a client that falls behind leaves its messages in the conflation table,
+   * where newer ones replace them, instead of in its output queue */
+  while (!(context->conflating &&
+           (context->output_blocked ||
+            tcpserver_output_full(context->output))) &&
+         tcpserver_session_pop(context, &seq, &entry) == 0)
+    tcpserver_session_write_event(context, seq, &entry);
+}
+
+int tcpserver_session_refilter(context_t *context) {
+  /* the filters of the frames we take as they come, then of those watched */
+  struct can_filter filters[TCPSERVER_MAX_SUBSCRIPTIONS *
+                            VSCP_SUBSCRIPTION_MAX_FILTERS];
+  canbus_watch_t watches[TCPSERVER_MAX_SUBSCRIPTIONS *
+                         VSCP_SUBSCRIPTION_MAX_FILTERS];
+  unsigned int count = 0, watch_count = 0, i, j;
+  subscription_t *sub;
+  int exact;
+
+  if (context->subscription_count == 0)
+    filters[count++] = context->filter;
+  for (i = 0; i < context->subscription_count; i++) {
+    sub = &(context->subscriptions[i]);
+    if (!sub->change) {
+      memcpy(&filters[count], sub->filters,
+             sub->count * sizeof(struct can_filter));
+      count += sub->count;
+      continue;
+    }
+    for (j = 0; j < sub->count; j++) {
+      watches[watch_count].id = sub->filters[j].can_id;
+      watches[watch_count].timeout_ms = sub->timeout_ms;
+      watch_count++;
+    }
+  }
+
+  if (context->bus != NULL) {
+    if (canbus_watch(context->bus, context, watches, watch_count) < 0)
+      return -1;
+    if (canbus_subscribe(context->bus, context, filters, count) < 0) {
+      /* what we watched before was taken before */
+      canbus_watch(context->bus, context, context->rx_watches,
+                   context->rx_watch_count);
+      return -1;
+    }
+  }
+  memcpy(context->rx_filters, filters, count * sizeof(struct can_filter));
+  context->rx_filter_count = count;
+  memcpy(context->rx_watches, watches, watch_count * sizeof(canbus_watch_t));
+  context->rx_watch_count = watch_count;
+
+  if (context->route != NULL) {
+    /* routed along, session_match() tells the copies from the others */
+    for (i = 0; i < watch_count; i++) {
+      filters[count + i].can_id = watches[i].id;
+      filters[count + i].can_mask = CAN_EFF_FLAG | CAN_EFF_MASK;
+    }
+    exact = tcpserver_route_set(context->route, context->route_slot, filters,
+                                count + watch_count);
+    context->rx_exact = exact && watch_count == 0;
+  }
+
+  if (context->bus != NULL) {
+    session_recount(context);
+    session_trim(context);
+  }
+  return 0;
+}
+
+void tcpserver_session_deliver(context_t *context, uint64_t seq,
+                               const vscp_buffer_entry_t *entry) {
+  unsigned int pending;
+
+  /* the route may only have narrowed it down, and doesn't tell the copies
+   * of the broadcast manager apart */
+  if (entry->origin == context ||
+      ((!context->rx_exact || entry->origin == CANBUS_CHANGED ||
+        entry->origin == CANBUS_SILENT) &&
+       !session_match(context, entry)))
+    return;
+
+  context->stat_rx_data += entry->frame.can_dlc + 4;
+  context->stat_rx_frame++;
+
+  if (context->resuming) {
+    /* after the gap, it goes out once the gap is sent */
+    context->rx_pending++;
+  } else if (context->conflating) {
+    /* nothing stays pending in the ring */
+    context->rx_cursor = seq + 1;
+    session_conflate_put(context, context->conflate, seq, entry);
+  } else {
+    context->rx_pending++;
+    /* when full, discard the oldest */
+    if (context->mode != loop)
+      session_trim(context);
+  }
+  pending = tcpserver_session_pending(context);
+  if (pending > context->rx_high_watermark)
+    context->rx_high_watermark = pending;
+
+  if (context->mode == loop && !context->resuming) {
+    tcpserver_session_drain(context);
+    context->loop_active = 1;
+  }
+}
+
+void tcpserver_session_tick(context_t *context, const struct timespec *now) {
+  /* no keepalive in the middle of a 'resume' */
+  if (context->mode != loop || context->resuming)
+    return;
+
+  /* only send keepalives when nothing else was sent since the last tick */
+  if (context->loop_active) {
+    context->loop_active = 0;
+    return;
+  }
+  if ((now->tv_sec - context->last_keepalive.tv_sec) > 1) {
+    status_reply(context, 0, NULL);
+    context->last_keepalive = *now;
+  }
+}
+
+void tcpserver_session_send(context_t *context, const struct can_frame *frame) {
+  /* a well behaved client never has more in flight than its window */
+  if (context->tx_window > 0 &&
+      context->tx_queued + context->tx_unacked + context->tx_batch_count >=
+          context->tx_window) {
+    tcpserver_session_send_failed(context, "window exceeded");
+    return;
+  }
+  context->tx_batch_seq[context->tx_batch_count] = context->tx_seq;
+  context->tx_batch[context->tx_batch_count++] = *frame;
+  if (context->tx_batch_count == CANBUS_TX_BATCH)
+    tcpserver_session_send_flush(context);
+}
+
+static void session_send_failed_numbered(context_t *context, uint32_t seq,
+                                        const char *reason) {
+  char buf[120];
+  int n;
+
+  /* not through writen(), failures don't wait for the acknowledgement */
+  n = snprintf(buf, sizeof(buf), "-OK - send %u failed: %s\r\n", seq, reason);
+  if (n >= (int)sizeof(buf))
+    n = sizeof(buf) - 1;
+  if (tcpserver_output_append(context->output, buf, n))
+    context->stop_session = 1;
+}
+
+static void session_send_failed_seq(context_t *context, uint32_t seq,
+                                    const char *reason) {
+  if (context->tx_window == 0)
+    status_reply(context, 1, (char *)reason);
+  else
+    session_send_failed_numbered(context, seq, reason);
+}
+
+void tcpserver_session_send_failed(context_t *context, const char *reason) {
+  session_send_failed_seq(context, context->tx_seq, reason);
+}
+
+void tcpserver_session_send_settle(context_t *context) {
+  canbus_sched_failure_t failures[CANBUS_TX_BATCH];
+  canbus_flow_stats_t stats;
+  unsigned int n, i;
+
+  if (context->tx_flow == NULL)
+    return;
+  while ((n = canbus_flow_failures(context->tx_flow, failures,
+                                   CANBUS_TX_BATCH)) > 0)
+    for (i = 0; i < n; i++) {
+      /* unnumbered ones had their +OK already, they are only counted */
+      if (failures[i].tag & TX_TAG_UNNUMBERED || context->tx_queued == 0)
+        continue;
+      context->tx_queued--;
+      session_send_failed_numbered(context, failures[i].tag,
+                                   "problem when writing to CAN socket");
+    }
+  if (context->tx_queued == 0)
+    return;
+
+  /* what isn't queued anymore went out. Unnumbered sends may be queued too,
+   * so this may fall short for now, never over */
+  canbus_flow_stats(context->tx_flow, &stats);
+  n = context->tx_queued > stats.length ? context->tx_queued - stats.length
+                                        : 0;
+  context->tx_queued -= n;
+  context->tx_unacked += n;
+}
+
+void tcpserver_session_send_flush(context_t *context) {
+  unsigned int count = context->tx_batch_count;
+  uint32_t tags[CANBUS_TX_BATCH];
+  int status[CANBUS_TX_BATCH];
+  unsigned int i;
+  const char *reason;
+
+  if (count == 0)
+    return;
+  context->tx_batch_count = 0; /* before replying, that would flush again */
+
+  for (i = 0; i < count; i++)
+    tags[i] = context->tx_window > 0 ? context->tx_batch_seq[i]
+                                     : TX_TAG_UNNUMBERED | i;
+  canbus_send_bulk(context->bus, context->tx_flow, context->tx_batch, tags,
+                   count, status);
+  for (i = 0; i < count; i++) {
+    reason = status[i] == ENOSPC ? "CAN transmit queue full"
+                                 : "problem when writing to CAN socket";
+    if (context->tx_window > 0) {
+      /* acknowledged once they went out, only failures are told now */
+      if (status[i] == 0)
+        context->tx_queued++;
+      else
+        session_send_failed_seq(context, context->tx_batch_seq[i], reason);
+    } else if (status[i] == 0)
+      status_reply(context, 0, NULL);
+    else
+      status_reply(context, 1, (char *)reason);
+  }
+  tcpserver_session_send_settle(context);
+}
+
+void tcpserver_session_send_ack(context_t *context) {
+  char buf[40];
+
+  tcpserver_session_send_flush(context);
+  tcpserver_session_send_settle(context);
+  if (context->tx_unacked == 0)
+    return;
+  snprintf(buf, sizeof(buf), "%u sent", context->tx_unacked);
+  context->tx_unacked = 0; /* before replying, that would ack again */
+  status_reply(context, 0, buf);
+}
+
+int tcpserver_session_flush(context_t *context) {
+  int rval = tcpserver_output_flush(context->output, context->tcpfd);
+  if (rval < 0)
+    context->stop_session = 1; /* error on the TCP socket */
+  /* when full, wait for the socket to become writable again */
+  context->output_blocked = (rval == 1);
+  /* the conflated messages that didn't fit before */
+  if (rval == 0 && context->mode == loop && context->conflate != NULL)
+    tcpserver_session_drain(context);
+  return rval;
+}
+
+void tcpserver_session_close(context_t *context) {
+  /* its queued frames still go out, they're just no longer its own */
+  if (context->tx_flow != NULL)
+    canbus_flow_close(context->tx_flow);
+  if (context->bus != NULL) {
+    canbus_unsubscribe(context->bus, context);
+    canbus_watch(context->bus, context, NULL, 0);
+  }
+  if (context->conflate != NULL)
+    tcpserver_conflate_free(context->conflate);
+  if (context->history != NULL)
+    canbus_history_close(context->history);
+  free(context->held_input);
+  /* last words, like the reply to 'quit', if the socket takes them */
+  tcpserver_output_flush(context->output, context->tcpfd);
+  tcpserver_output_free(context->output);
+  if (close(context->tcpfd) < 0)
+    SysMError("session close TCP");
+  cmd_interpreter_free(context->cmd_interpreter);
+  free(context);
+}
+
+/* Queue "n" bytes for the client, written out by the event loop according to
+ * the flush policy. */
+ssize_t writen(context_t * context, const void *vptr, size_t n){
+  /* replies go out in order, those of batched sends come first */
+  if (context->tx_batch_count > 0 || context->tx_unacked > 0)
+    tcpserver_session_send_ack(context);
+  if (tcpserver_output_append(context->output, vptr, n)) {
+    context->stop_session = 1;
+    return (-1); /* out of memory */
   }
   return (n);
 }
@@ -281,5 +936,16 @@ void tcpserver_handle_input(context_t *context, char *buffer, ssize_t length) {
         break;
       }
     }
+    /* the commands after a 'hist' or 'resume' wait until its events are
+     * out */
+    if ((context->history != NULL || context->resuming) &&
+        rval != CMD_INTERPRETER_NO_MORE_DATA) {
+      if (length > saveptr - buffer)
+        session_hold_input(context, saveptr, length - (saveptr - buffer));
+      break;
+    }
   } while (rval != CMD_INTERPRETER_NO_MORE_DATA);
+
+  /* all complete lines are handled, send what they queued */
+  tcpserver_session_send_ack(context);
 }
@@ -17,12 +17,92 @@
 #ifndef _TCPSERVER_WORKER_H_
 #define _TCPSERVER_WORKER_H_
 
+#include <stdint.h>
 #include <unistd.h>
 #include <time.h>
 #include "tcpserver_context.h"
+#include "tcpserver_route.h"
 
-  /* the actual work being done in a tcpserver */
-  void tcpserver_work(int connfd, const char * can_bus, time_t started);
+  /* set up a session for a freshly accepted connection, holding up to
+   * 'depth' messages for the client. 'capture_directory' is where 'hist'
+   * looks, NULL when there is no capture */
+  context_t *tcpserver_session_open(int connfd, const char *can_bus,
+                                    time_t started, unsigned int depth,
+                                    const char *capture_directory);
+  /* start reading from the bus, the event loop finds the session in 'slot'
+   * of 'route'; replies the outcome to the client */
+  void tcpserver_session_attach(context_t *context, canbus_t *bus,
+                                tcpserver_route_t *route, unsigned int slot);
+  /* the bus went away, tell the client and close */
+  void tcpserver_session_bus_lost(context_t *context);
+  /* handle epoll events on the session's TCP socket */
+  void tcpserver_session_tcp_event(context_t *context, uint32_t events);
+  /* message 'seq', routed to the session, was added to the bus ring */
+  void tcpserver_session_deliver(context_t *context, uint64_t seq,
+                                 const vscp_buffer_entry_t *entry);
+  /* get the sequence number and a copy of the oldest pending message for
+   * this session and move past it. 0 if there was one, -1 if none. seq and
+   * entry can be NULL to discard it */
+  int tcpserver_session_pop(context_t *context, uint64_t *seq,
+                            vscp_buffer_entry_t *entry);
+  /* queue message 'seq' from the bus ring for the client, rendered from
+   * 'entry' when it's gone from the ring already; entry can be NULL. Returns
+   * the number of bytes queued, 0 if it was dropped, -1 on error */
+  int tcpserver_session_write_event(context_t *context, uint64_t seq,
+                                    const vscp_buffer_entry_t *entry);
+  /* same, for a message the client asked for with retr. It is part of the
+   * reply and never dropped. Returns the number of bytes queued, -1 on error */
+  int tcpserver_session_reply_event(context_t *context, uint64_t seq,
+                                    const vscp_buffer_entry_t *entry);
+  /* in loop mode, write out the pending messages. When conflating only as
+   * far as the client keeps up, the rest waits for the socket */
+  void tcpserver_session_drain(context_t *context);
+  /* keep only the latest pending message per class, type and nickname, with
+   * 'index' also per first data byte. Returns -1 when out of memory */
+  int tcpserver_session_conflate(context_t *context, int index);
+  /* stop conflating, the messages conflated so far still come first */
+  void tcpserver_session_unconflate(context_t *context);
+  /* start replaying the messages for this session from sequence number
+   * 'seq' on, and go on from there once done. Returns 0, -1 when 'seq' is
+   * ahead of the ring, -2 when it comes before the ring's first message,
+   * from an earlier run */
+  int tcpserver_session_resume(context_t *context, uint64_t seq);
+  /* go on with the replay as far as the output takes it, with the reply once
+   * it is done */
+  void tcpserver_session_resume_stream(context_t *context);
+  /* go on with the 'hist' lookup as far as the output takes it, with the
+   * reply once it is done */
+  void tcpserver_session_history(context_t *context);
+  /* number of pending messages for this session */
+  unsigned int tcpserver_session_pending(context_t *context);
+  /* discard all pending messages */
+  void tcpserver_session_clear(context_t *context);
+  /* the filter or subscriptions changed, pass them on to the bus and
+   * reevaluate the pending messages. Returns -1 when the bus refused them,
+   * the session then still receives what it did before */
+  int tcpserver_session_refilter(context_t *context);
+  /* periodic housekeeping (keepalives in loop mode) */
+  void tcpserver_session_tick(context_t *context, const struct timespec *now);
+  /* queue a frame to send on the bus, it is sent together with the others
+   * queued while handling the same input. The reply is written then. */
+  void tcpserver_session_send(context_t *context, const struct can_frame *frame);
+  /* a send failed before it was queued, reply with its sequence number in
+   * window mode */
+  void tcpserver_session_send_failed(context_t *context, const char *reason);
+  /* send the queued frames and reply for each of them, in window mode
+   * only for the failures; the others are acknowledged once they left */
+  void tcpserver_session_send_flush(context_t *context);
+  /* send the queued frames and, in window mode, acknowledge all sent since
+   * the last time with one reply */
+  void tcpserver_session_send_ack(context_t *context);
+  /* account for the numbered sends that left the transmit queue since, and
+   * report those the interface refused by their number */
+  void tcpserver_session_send_settle(context_t *context);
+  /* write out what the client's socket takes. 0 when all was written, 1 when
+   * the socket is full, -1 on error */
+  int tcpserver_session_flush(context_t *context);
+  /* close the sockets and free the session */
+  void tcpserver_session_close(context_t *context);
   int status_reply(context_t * context, int error, char *msg);
   ssize_t writen(context_t * context, const void *vptr, size_t n);
 #endif /* #ifndef _TCPSERVER_WORKER_H_ */
@@ -28,13 +28,23 @@
 #include <unistd.h>
 #include <config.h>
 
+#include "canbus_capture.h"
 #include "tcpserver.h"
+#include "tcpserver_output.h"
 #include "tcpserver_commands.h"
 #include "tcpserver_worker.h"
 #include "vscp.h"
 #include "version.h"
 
 #define TCPSERVER_PORT 8598
+#define TCPSERVER_MAX_CONNECTIONS 5
+#define TCPSERVER_DEPTH 100
+#define TCPSERVER_MAX_DEPTH (1 << 20)
+#define TCPSERVER_TX_QUEUE 256
+#define TCPSERVER_MAX_TX_QUEUE 65536
+#define TCPSERVER_MAX_TX_RATE 10000000 /* CAN FD data phase, bits/s */
+#define TCPSERVER_MAX_CACHE (1 << 20)
+#define TCPSERVER_MAX_RETAIN (1 << 24)
 
 void uvscpd_show_version(void);
 void uvscpd_show_help(void);
@@ -74,19 +84,37 @@ int main(int argc, char *argv[]) {
   uint32_t ip_addr = 0; /* any address...*/
   uint16_t port = TCPSERVER_PORT;
   char *can_bus = "can0";
+  unsigned int max_connections = TCPSERVER_MAX_CONNECTIONS;
+  unsigned int depth = TCPSERVER_DEPTH;
+  unsigned int tx_queue = TCPSERVER_TX_QUEUE;
+  uint32_t tx_rate = 0;
+  unsigned int cache = 0;
+  unsigned int retain = 0;
+  canbus_capture_config_t capture = {NULL, 64, 0, 0};
+  int exported = 0;
+  char error[120];
+  long value;
+  flush_policy_t flush_policy;
+  overflow_policy_t overflow_policy;
 
   for (i = 0; i < 16; i++) {
     gGuid.guid[i] = 0;
   }
 
-  const char *const short_options = "hvsU:P:c:i:p:g:";
+  const char *const short_options = "hvsU:P:c:i:p:g:m:d:F:o:t:r:C:R:w:W:X:";
   const struct option long_options[] = {
       // name, has_arg, flag, val
       {"help", 0, NULL, 'h'},      {"version", 0, NULL, 'v'},
       {"stay", 0, &gDaemonize, 0}, {"user", 1, NULL, 'U'},
       {"password", 1, NULL, 'P'},  {"canbus", 1, NULL, 'c'},
       {"ip", 1, NULL, 'i'},        {"port", 1, NULL, 'p'},
-      {"guid", 1, NULL, 'g'},      {NULL, 0, NULL, 0}};
+      {"guid", 1, NULL, 'g'},      {"max-connections", 1, NULL, 'm'},
+      {"depth", 1, NULL, 'd'},     {"flush", 1, NULL, 'F'},
+      {"overflow", 1, NULL, 'o'},  {"tx-queue", 1, NULL, 't'},
+      {"tx-rate", 1, NULL, 'r'},   {"cache", 1, NULL, 'C'},
+      {"retain", 1, NULL, 'R'},    {"capture", 1, NULL, 'w'},
+      {"capture-rotate", 1, NULL, 'W'}, {"export", 1, NULL, 'X'},
+      {NULL, 0, NULL, 0}};
   struct sigaction sa;
 
   while ((next_option = getopt_long(argc, argv, short_options, long_options,
@@ -105,6 +133,10 @@ int main(int argc, char *argv[]) {
       exit(0);
       break;
 
+    case 's':
+      gDaemonize = 0;
+      break;
+
     case 'U':
       cmd_user = strdup(optarg);
       break;
@@ -140,12 +172,104 @@ int main(int argc, char *argv[]) {
       }
       break;
 
+    case 'm':
+      value = strtol(optarg, &endptr, 10);
+      if (*endptr != 0 || value < 1 || value > 65535) {
+        fprintf(stderr, "invalid number of connections\n");
+        exit(-1);
+      }
+      max_connections = (unsigned int)value;
+      break;
+
+    case 'd':
+      value = strtol(optarg, &endptr, 10);
+      if (*endptr != 0 || value < 1 || value > TCPSERVER_MAX_DEPTH) {
+        fprintf(stderr, "invalid depth\n");
+        exit(-1);
+      }
+      depth = (unsigned int)value;
+      break;
+
+    case 't':
+      value = strtol(optarg, &endptr, 10);
+      if (*endptr != 0 || value < 1 || value > TCPSERVER_MAX_TX_QUEUE) {
+        fprintf(stderr, "invalid TX queue size\n");
+        exit(-1);
+      }
+      tx_queue = (unsigned int)value;
+      break;
+
+    case 'r':
+      value = strtol(optarg, &endptr, 10);
+      if (*endptr != 0 || value < 0 || value > TCPSERVER_MAX_TX_RATE) {
+        fprintf(stderr, "invalid TX rate\n");
+        exit(-1);
+      }
+      tx_rate = (uint32_t)value;
+      break;
+
+    case 'C':
+      value = strtol(optarg, &endptr, 10);
+      if (*endptr != 0 || value < 0 || value > TCPSERVER_MAX_CACHE) {
+        fprintf(stderr, "invalid cache size\n");
+        exit(-1);
+      }
+      cache = (unsigned int)value;
+      break;
+
+    case 'R':
+      value = strtol(optarg, &endptr, 10);
+      if (*endptr != 0 || value < 0 || value > TCPSERVER_MAX_RETAIN) {
+        fprintf(stderr, "invalid retention size\n");
+        exit(-1);
+      }
+      retain = (unsigned int)value;
+      break;
+
+    case 'w':
+      capture.directory = optarg;
+      break;
+
+    case 'W':
+      if (canbus_capture_parse_rotate(optarg, &capture)) {
+        fprintf(stderr, "invalid capture rotation\n");
+        exit(-1);
+      }
+      break;
+
+    case 'X':
+      if (canbus_capture_export(optarg, stdout, error, sizeof(error))) {
+        fprintf(stderr, "%s\n", error);
+        exit(-1);
+      }
+      exported = 1;
+      break;
+
+    case 'F':
+      if (tcpserver_output_parse_policy(optarg, &flush_policy)) {
+        fprintf(stderr, "invalid flush policy\n");
+        exit(-1);
+      }
+      tcpserver_output_set_policy(&flush_policy);
+      break;
+
+    case 'o':
+      if (tcpserver_output_parse_overflow(optarg, &overflow_policy)) {
+        fprintf(stderr, "invalid overflow policy\n");
+        exit(-1);
+      }
+      tcpserver_output_set_overflow(&overflow_policy);
+      break;
+
     case '?':
     default:
       uvscpd_show_help();
       exit(-1);
     }
   }
+  /* exporting segments is all there was to do */
+  if (exported)
+    exit(0);
 
   memset(&sa, 0, sizeof(sa));
   sa.sa_handler = &signal_handler;
@@ -187,7 +311,9 @@ int main(int argc, char *argv[]) {
 
   openlog("uvscpd : ", LOG_PID, LOG_USER);
 
-  tcpserver_start(can_bus, ip_addr, port);
+  tcpserver_start(can_bus, ip_addr, port, max_connections, depth, tx_queue,
+                  tx_rate, cache, retain,
+                  capture.directory != NULL ? &capture : NULL);
 
   while (1)
   {
@@ -231,9 +357,20 @@ void uvscpd_show_help(void) {
   print_opt("-s", "--stay", "don't daemonize");
   print_opt("-U <usr>", "--user=<usr>", "set username to <usr>");
   print_opt("-P <pwd>", "--password=<pwd>", "set password to <pwd> (unsafe! Check README)");
-  print_opt("-c <can>", "--canbus=<can>", "set socketcan interface to <can>, defaults to can0");
+  print_opt("-c <can>", "--canbus=<can>", "set socketcan interface to <can>, or replay:<log>[,<speed>] or loopback, defaults to can0");
   print_opt("-i <address>", "--ip=<address>", "bind to <address>, defaults to all interfaces");
   print_opt("-p <N>", "--port=<N>", "set IP port number to <N>, defaults to 8598");
+  print_opt("-m <N>", "--max-connections=<N>", "accept up to <N> simultaneous clients, defaults to 5");
+  print_opt("-d <N>", "--depth=<N>", "buffer up to <N> events for each client, defaults to 100");
+  print_opt("-F <policy>", "--flush=<policy>", "when to write to clients: immediate (default) or batch[,<bytes>[,<usec>]]");
+  print_opt("-o <policy>", "--overflow=<policy>", "when a client can't keep up: drop the oldest (default) or newest events, or disconnect; optionally followed by ,<bytes> to queue, defaults to 65536");
+  print_opt("-t <N>", "--tx-queue=<N>", "queue up to <N> frames when the CAN interface is busy, defaults to 256");
+  print_opt("-r <N>", "--tx-rate=<N>", "send at most <N> bits per second on the CAN bus, defaults to 0: no limit");
+  print_opt("-C <N>", "--cache=<N>", "remember the latest value of up to <N> events for snap, defaults to 0: none");
+  print_opt("-R <N>", "--retain=<N>", "keep the last <N> events of all traffic for clients to resume, defaults to 0: none");
+  print_opt("-w <dir>", "--capture=<dir>", "capture all traffic to segment files in <dir>");
+  print_opt("-W <rotate>", "--capture-rotate=<rotate>", "start a new segment every <MiB>[,<seconds>[,<segments> to keep]], defaults to 64");
+  print_opt("-X <file>", "--export=<file>", "write capture segment <file> in candump log format and exit");
   print_opt("-g <GUID>", "--guid=<GUID>", "set interface GUID to <GUID>, defaults to 00:00:00:00:00:00:00:00:00:00:00:00:00:00:00:00");
   printf("\n");
   printf("Report bugs to: " PACKAGE_BUGREPORT "\n");
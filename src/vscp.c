@@ -14,46 +14,205 @@
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
+#include <ctype.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "vscp.h"
 
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+// parses a number in [p, end): decimal, or hex when prefixed with 0x. The
+// whole field has to be a number. Returns 0 on success.
+static int parse_number(const char *p, const char *end, uint32_t *value) {
+  uint64_t v = 0;
+  int digit;
+
+  if (p == end)
+    return -1;
+
+  if (end - p >= 2 && p[0] == '0' && p[1] == 'x') {
+    p += 2;
+    if (p == end)
+      return -1;
+    for (; p < end; p++) {
+      if ((digit = hex_value(*p)) < 0)
+        return -1;
+      v = (v << 4) | digit;
+      if (v > UINT32_MAX)
+        return -1;
+    }
+  } else {
+    for (; p < end; p++) {
+      if (*p < '0' || *p > '9')
+        return -1;
+      v = v * 10 + (*p - '0');
+      if (v > UINT32_MAX)
+        return -1;
+    }
+  }
+  *value = (uint32_t)v;
+  return 0;
+}
+
+// reads a number in [p, end) as sscanf("%u") or, with 'hex', sscanf("%X")
+// did for send and filter lines, so they accept what they always have:
+// leading white space, a sign (negative values wrap), a 0x prefix for hex
+// that alone reads as 0, and values wider than 32 bits cut to the low 32 bits
+// (UINT32_MAX past 64 bits). Nothing may follow the number.
+static int scan_number(const char *p, const char *end, int hex,
+                       uint32_t *value) {
+  uint64_t v = 0;
+  int negative = 0, overflow = 0, digits = 0;
+  int digit;
+
+  while (p < end && isspace((unsigned char)*p))
+    p++;
+  if (p == end)
+    return -1;
+
+  if (*p == '+' || *p == '-')
+    negative = *p++ == '-';
+  if (hex && end - p >= 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+    p += 2;
+    digits = 1;
+  }
+
+  for (; p < end; p++, digits++) {
+    if (hex)
+      digit = hex_value(*p);
+    else
+      digit = *p >= '0' && *p <= '9' ? *p - '0' : -1;
+    if (digit < 0)
+      break;
+    if (v > (UINT64_MAX - digit) / (hex ? 16 : 10))
+      overflow = 1;
+    v = v * (hex ? 16 : 10) + digit;
+  }
+  if (digits == 0 || p != end)
+    return -1;
+
+  if (overflow)
+    v = UINT64_MAX;
+  else if (negative)
+    v = -v;
+  *value = (uint32_t)v;
+  return 0;
+}
+
+// reads a field of a send or filter line: hex when it starts with 0x,
+// decimal otherwise, see scan_number()
+static int parse_field(const char *p, const char *end, uint32_t *value) {
+  return scan_number(p, end, end - p >= 2 && p[0] == '0' && p[1] == 'x',
+                     value);
+}
+
+// parses exactly 'n' decimal digits at p
+static int parse_digits(const char *p, int n, int *value) {
+  int v = 0;
+  for (; n > 0; n--, p++) {
+    if (*p < '0' || *p > '9')
+      return -1;
+    v = v * 10 + (*p - '0');
+  }
+  *value = v;
+  return 0;
+}
+
+// parses YYYY-MM-DDTHH:MM:SS with an optional trailing Z, in UTC
+static int parse_datetime(const char *p, const char *end, time_t *timestamp) {
+  struct tm tm;
+  time_t t;
+
+  memset(&tm, 0, sizeof(tm));
+  if (end - p != 19 && !(end - p == 20 && (p[19] == 'z' || p[19] == 'Z')))
+    return -1;
+  if (p[4] != '-' || p[7] != '-' || (p[10] != 't' && p[10] != 'T') ||
+      p[13] != ':' || p[16] != ':')
+    return -1;
+  if (parse_digits(p, 4, &tm.tm_year) || parse_digits(p + 5, 2, &tm.tm_mon) ||
+      parse_digits(p + 8, 2, &tm.tm_mday) ||
+      parse_digits(p + 11, 2, &tm.tm_hour) ||
+      parse_digits(p + 14, 2, &tm.tm_min) ||
+      parse_digits(p + 17, 2, &tm.tm_sec))
+    return -1;
+  if (tm.tm_mon < 1 || tm.tm_mon > 12 || tm.tm_mday < 1 || tm.tm_mday > 31 ||
+      tm.tm_hour > 23 || tm.tm_min > 59 || tm.tm_sec > 60)
+    return -1;
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+  if ((t = timegm(&tm)) == (time_t)-1)
+    return -1;
+  *timestamp = t;
+  return 0;
+}
+
+// parses a GUID in [p, end), see vscp_strtoguid()
+static int parse_guid(const char *p, const char *end, vscp_guid_t *guid) {
+  vscp_guid_t local_guid;
+  uint32_t value;
+  int field = 0;
+
+  while (p < end) {
+    const char *seek = p;
+
+    if (field > 15)
+      return -1;
+
+    while (seek < end && *seek != ':')
+      seek++;
+
+    if (seek - p > 2 || scan_number(p, seek, 1, &value) || value > UINT8_MAX)
+      return -1;
+
+    local_guid.guid[field] = (uint8_t)value;
+
+    p = seek;
+    if (p < end)
+      p++;
+    field++;
+  }
+  if (field != 16)
+    return -1;
+  *guid = local_guid;
+  return 0;
+}
+
 // parses "priority, class, type, GUID"
-int vscp_parse_filter(const char *input, canid_t *id, vscp_guid_t *my_guid){
+int vscp_parse_filter(const char *input, canid_t *id, vscp_guid_t *my_guid) {
   const char *ptr = input;
-  char *temp;
-  unsigned int value;
+  uint32_t value = 0;
   int field = 0;
   vscp_guid_t guid;
   *id = 0;
 
   while (*ptr != 0) {
-
     const char *seek = ptr;
-    char guard;
 
     while (*seek != ',' && *seek != 0)
       seek++;
 
-    temp = strndup(ptr, seek - ptr);
-
     switch (field) {
-    case 0 ... 2:
-      if (temp[0] == '0' && temp[1] == 'x') {
-        if (sscanf(temp, "%X%c", &value, &guard) != 1) {
-          return -1;
-        }
-      } else {
-        if (sscanf(temp, "%u%c", &value, &guard) != 1) {
-          return -1;
-        }
-      }
+    case 0:
+    case 1:
+    case 2:
+      if (parse_field(ptr, seek, &value))
+        return -1;
       break;
     case 3:
-      if(vscp_strtoguid(temp, &guid))
+      if (parse_guid(ptr, seek, &guid))
         return -1;
       break;
+    default:
+      return -1;
     }
 
     switch (field) {
@@ -75,7 +234,7 @@ int vscp_parse_filter(const char *input, canid_t *id, vscp_guid_t *my_guid){
 
     case 2:
       if (value <= UINT8_MAX)
-        *id  |= (uint8_t)value << 8;
+        *id |= (uint8_t)value << 8;
       else
         return -1;
       break;
@@ -89,7 +248,6 @@ int vscp_parse_filter(const char *input, canid_t *id, vscp_guid_t *my_guid){
     if (*ptr != 0)
       ptr++;
     field++;
-    free(temp);
   }
   if (field == 4)
     return 0;
@@ -97,6 +255,184 @@ int vscp_parse_filter(const char *input, canid_t *id, vscp_guid_t *my_guid){
     return -1;
 }
 
+/* a field of a VSCP CAN identifier */
+typedef struct {
+  unsigned int shift;
+  uint32_t max;
+} id_field_t;
+
+static const id_field_t id_fields[] = {
+    {26, 0x7},   /* priority */
+    {16, 0x1FF}, /* class */
+    {8, 0xFF},   /* type */
+    {0, 0xFF}    /* nickname */
+};
+
+#define ID_FIELDS (sizeof(id_fields) / sizeof(id_fields[0]))
+/* aligned blocks a single range of a field can take */
+#define RANGE_MAX_BLOCKS 18
+
+/* split [low, high] into aligned power of two blocks, each a value/mask pair
+ * within 'field_mask'. Returns the number of blocks. */
+static unsigned int range_blocks(uint32_t low, uint32_t high,
+                                 uint32_t field_mask, uint32_t *values,
+                                 uint32_t *masks) {
+  unsigned int n = 0;
+  uint64_t size;
+
+  while (1) {
+    size = 1;
+    while ((low & (size * 2 - 1)) == 0 && low + size * 2 - 1 <= high)
+      size *= 2;
+    values[n] = low;
+    masks[n] = field_mask & ~(uint32_t)(size - 1);
+    n++;
+    if ((uint64_t)low + size > high)
+      return n;
+    low += size;
+  }
+}
+
+int vscp_parse_subscription(const char *input, struct can_filter *filters,
+                            unsigned int max) {
+  uint32_t values[ID_FIELDS][RANGE_MAX_BLOCKS];
+  uint32_t masks[ID_FIELDS][RANGE_MAX_BLOCKS];
+  unsigned int counts[ID_FIELDS];
+  unsigned int index[ID_FIELDS];
+  unsigned int field, total = 1, i, n;
+  const char *ptr = input;
+  int inverted = 0;
+  uint32_t low, high;
+
+  if (*ptr == '!') {
+    inverted = 1;
+    ptr++;
+  }
+
+  for (field = 0; field < ID_FIELDS; field++) {
+    const char *seek = ptr, *dash;
+    uint32_t max_value = id_fields[field].max;
+
+    while (*seek != ',' && *seek != 0)
+      seek++;
+    for (dash = ptr; dash < seek && *dash != '-'; dash++)
+      ;
+
+    if (*ptr == 0 || (seek - ptr == 1 && *ptr == '*')) {
+      low = 0; /* left out or any */
+      high = max_value;
+    } else if (dash < seek) {
+      if (parse_number(ptr, dash, &low) || parse_number(dash + 1, seek, &high))
+        return -1;
+    } else {
+      if (parse_number(ptr, seek, &low))
+        return -1;
+      high = low;
+    }
+
+    /* level II classes carry level I ones */
+    if (field == 1 && low >= 512 && high < 1024) {
+      low -= 512;
+      high -= 512;
+    }
+    if (low > high || high > max_value)
+      return -1;
+
+    counts[field] =
+        range_blocks(low, high, max_value, values[field], masks[field]);
+    total *= counts[field];
+
+    ptr = seek;
+    if (*ptr != 0)
+      ptr++;
+  }
+  if (*ptr != 0)
+    return -1; /* too many fields */
+  if (inverted && total != 1)
+    return -1; /* the inverse of several pairs isn't a pair */
+  if (total > max)
+    return -2;
+
+  /* every combination of the blocks of each field */
+  memset(index, 0, sizeof(index));
+  for (n = 0; n < total; n++) {
+    canid_t id = CAN_EFF_FLAG, mask = CAN_EFF_FLAG;
+    for (field = 0; field < ID_FIELDS; field++) {
+      id |= values[field][index[field]] << id_fields[field].shift;
+      mask |= masks[field][index[field]] << id_fields[field].shift;
+    }
+    filters[n].can_id = inverted ? id | CAN_INV_FILTER : id;
+    filters[n].can_mask = mask;
+
+    for (i = ID_FIELDS; i-- > 0;) {
+      if (++index[i] < counts[i])
+        break;
+      index[i] = 0;
+    }
+  }
+  return total;
+}
+
+/* class, type and nickname */
+#define EVENT_BITS 0x1FFFFFFU
+#define PRIORITY_BITS (0x7U << 26)
+
+int vscp_subscription_ids(const struct can_filter *filters, unsigned int count,
+                          canid_t *ids, unsigned int max) {
+  unsigned int i, n = 0;
+  canid_t open, bits;
+
+  for (i = 0; i < count; i++) {
+    if ((filters[i].can_id & CAN_INV_FILTER) ||
+        (filters[i].can_mask & EVENT_BITS) != EVENT_BITS)
+      return -1;
+    /* every priority left open, the hard coded bit is never set */
+    open = ~filters[i].can_mask & PRIORITY_BITS;
+    bits = 0;
+    do {
+      if (n == max)
+        return -2;
+      ids[n++] = (filters[i].can_id & ~open) | bits;
+      bits = (bits - open) & open;
+    } while (bits != 0);
+  }
+  return n;
+}
+
+int vscp_parse_time(const char *input, uint64_t *usec) {
+  const char *end = input + strlen(input), *dot;
+  uint64_t seconds = 0, fraction = 0;
+  unsigned int digits = 0;
+  time_t t;
+
+  if (parse_datetime(input, end, &t) == 0) {
+    if (t < 0)
+      return -1;
+    *usec = (uint64_t)t * 1000000;
+    return 0;
+  }
+
+  for (dot = input; dot < end && *dot != '.'; dot++) {
+    if (*dot < '0' || *dot > '9' || seconds > UINT32_MAX)
+      return -1;
+    seconds = seconds * 10 + (*dot - '0');
+  }
+  if (dot == input)
+    return -1;
+  if (dot < end) {
+    for (end = dot + 1; *end != 0; end++) {
+      if (*end < '0' || *end > '9' || digits == 6)
+        return -1;
+      fraction = fraction * 10 + (*end - '0');
+      digits++;
+    }
+    for (; digits < 6; digits++)
+      fraction *= 10;
+  }
+  *usec = seconds * 1000000 + fraction;
+  return 0;
+}
+
 //          0    1      2   3     4         5       6     7     8     9
 // parses "head,class,type,obid,datetime,timestamp,GUID,data1,data2,data3.."
 // datetime YYYY-MM-DDTHH:MM:DD
@@ -104,46 +440,41 @@ int vscp_parse_filter(const char *input, canid_t *id, vscp_guid_t *my_guid){
 // 0,30,11,0,0000-00-00t16:00:00z,0,00:00:00:00:00:00:00:00:00:00:00:00:00:00:00:00,0xff,0x00,0xaa,0x55
 // send
 // 96,512,9,0,1272-23-95T05:127:00Z,0,00:00:00:00:00:00:00:00:00:00:00:00:00:00:00:00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0xFF,0x00,0x03,0xD0
+// obid and GUID are not used. datetime and timestamp are optional: when
+// empty or not valid, they are left 0.
 
 int vscp_parse_msg(const char *input, vscp_msg_t *msg, vscp_guid_t *my_guid) {
   const char *ptr = input;
-  char *temp;
-  unsigned int value;
+  uint32_t value = 0;
   int field = 0;
   int level2 = 0;
 
   msg->data_length = 0;
-
-  /* we're not parsing these values - lazy */
   msg->hw_timestamp = 0;
   msg->timestamp = 0;
 
   while (*ptr != 0) {
-
     const char *seek = ptr;
-    char guard;
 
     while (*seek != ',' && *seek != 0)
       seek++;
 
-    temp = strndup(ptr, seek - ptr);
-
     switch (field) {
     case 0 ... 2:
     case 7 ... 30:
-      if (temp[0] == '0' && temp[1] == 'x') {
-        if (sscanf(temp, "%X%c", &value, &guard) != 1) {
-          return -1;
-        }
-      } else {
-        if (sscanf(temp, "%u%c", &value, &guard) != 1) {
-          return -1;
-        }
-      }
+      if (parse_field(ptr, seek, &value))
+        return -1;
+      break;
+    case 4:
+      if (parse_datetime(ptr, seek, &(msg->timestamp)))
+        msg->timestamp = 0;
+      break;
+    case 5:
+      if (parse_field(ptr, seek, &value) == 0)
+        msg->hw_timestamp = value;
       break;
     case 31:
       return -1;
-      break;
     }
 
     switch (field) {
@@ -200,7 +531,6 @@ int vscp_parse_msg(const char *input, vscp_msg_t *msg, vscp_guid_t *my_guid) {
     if (*ptr != 0)
       ptr++;
     field++;
-    free(temp);
   }
   if (field > 6)
     return 0;
@@ -217,10 +547,7 @@ void vscp_to_can(const vscp_msg_t *msg, struct can_frame *frame) {
     frame->data[i] = msg->data[i];
 }
 
-int can_to_vscp(const struct can_frame *frame,
-                const struct timeval *hw_timestamp, vscp_msg_t *msg,
-                vscp_guid_t *guid) {
-  int i;
+int vscp_frame_check(const struct can_frame *frame) {
   if ((frame->can_id & CAN_EFF_FLAG) == 0) {
     return -1;
   }
@@ -230,108 +557,192 @@ int can_to_vscp(const struct can_frame *frame,
   if (frame->can_dlc > 8) {
     return -1;
   }
+  return 0;
+}
+
+int can_to_vscp(const struct can_frame *frame, uint64_t timestamp,
+                vscp_msg_t *msg, const vscp_guid_t *guid) {
+  int i;
+  if (vscp_frame_check(frame)) {
+    return -1;
+  }
   msg->head = (uint8_t)((frame->can_id & 0x1E000000U) >> 21);
   msg->class = (uint16_t)((frame->can_id & 0x01FF0000U) >> 16);
   msg->type = (uint8_t)((frame->can_id & 0x0000FF00U) >> 8);
   msg->guid = *guid;
   msg->guid.guid[15] = (uint8_t)((frame->can_id & 0x000000FFU));
   msg->data_length = frame->can_dlc;
-  msg->timestamp = time(NULL);
-  msg->hw_timestamp = (uint32_t)(hw_timestamp->tv_usec)
-                         + (uint32_t)(hw_timestamp->tv_sec * 1000000);
+  msg->timestamp = (time_t)(timestamp / 1000000);
+  msg->hw_timestamp = (uint32_t)timestamp;
 
   for (i = 0; i < msg->data_length; i++) {
     msg->data[i] = frame->data[i];
   }
   return 0;
 }
+/* "00" "01" ... "99", to write two decimal digits at a time */
+static const char digit_pairs[201] =
+    "0001020304050607080910111213141516171819202122232425262728293031323334353637383940414243444546474849"
+    "5051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+
+static const char hex_digits[16] = "0123456789ABCDEF";
+
+/* write 'value' in decimal, returns the position after the last digit */
+static char *put_uint(char *p, uint32_t value) {
+  char tmp[10];
+  char *t = tmp + sizeof(tmp);
+  size_t n;
+
+  while (value >= 100) {
+    unsigned int pair = (value % 100) * 2;
+    value /= 100;
+    *--t = digit_pairs[pair + 1];
+    *--t = digit_pairs[pair];
+  }
+  if (value >= 10) {
+    *--t = digit_pairs[value * 2 + 1];
+    *--t = digit_pairs[value * 2];
+  } else
+    *--t = (char)('0' + value);
+
+  n = tmp + sizeof(tmp) - t;
+  memcpy(p, t, n);
+  return p + n;
+}
+
+/* write 'value' in hex without leading zero, as "%X" does */
+static char *put_hex8(char *p, uint8_t value) {
+  if (value >= 0x10)
+    *p++ = hex_digits[value >> 4];
+  *p++ = hex_digits[value & 0x0F];
+  return p;
+}
+
+/* the date only changes once a second, so keep the last one around */
+typedef struct {
+  time_t second;
+  int valid;
+  size_t length;
+  char text[32];
+} datetime_cache_t;
+
+static __thread datetime_cache_t datetime_cache;
+
+static char *put_datetime(char *p, time_t timestamp) {
+  datetime_cache_t *cache = &datetime_cache;
+  struct tm tm;
+
+  if (!cache->valid || cache->second != timestamp) {
+    if (gmtime_r(&timestamp, &tm) != NULL)
+      cache->length = strftime(cache->text, sizeof(cache->text),
+                               "%FT%H:%M:%S", &tm);
+    else
+      cache->length = 0;
+    cache->second = timestamp;
+    cache->valid = 1;
+  }
+  memcpy(p, cache->text, cache->length);
+  return p + cache->length;
+}
+
+void vscp_guid_prefix_set(vscp_guid_prefix_t *prefix, const vscp_guid_t *guid) {
+  char *p = prefix->text;
+  int i;
+
+  for (i = 0; i < 15; i++) {
+    p = put_hex8(p, guid->guid[i]);
+    *p++ = ':';
+  }
+  prefix->length = (uint8_t)(p - prefix->text);
+}
+
 // "head,class,type,obid,datetime,timestamp,GUID,data1,data2,data3.."
 // datetime YYYY-MM-DDTHH:MM:DD
-int print_vscp(const vscp_msg_t *msg, char *buffer, size_t buffer_size) {
+int print_vscp_prefix(const vscp_msg_t *msg, const vscp_guid_prefix_t *prefix,
+                      char *buffer, size_t buffer_size) {
+  char line[VSCP_TEXT_MAX];
+  char *start;
+  char *p;
+  size_t n;
   int i;
-  char timebuffer[32];
-  char guidbuffer[56];
-
-  struct tm *tmp;
-  tmp = gmtime(&(msg->timestamp));
 
-  if (tmp != NULL)
-    strftime(timebuffer, 32, "%FT%H:%M:%S", tmp);
+  /* write in place when it certainly fits, else go through 'line' */
+  if (buffer_size >= VSCP_TEXT_MAX)
+    start = buffer;
   else
-    snprintf(timebuffer, 32, "");
-
-  vscp_print_guid(guidbuffer, sizeof(guidbuffer), &(msg->guid));
-
-  snprintf(buffer, buffer_size, "%u,%u,%u,0,%s,%u,%s,", msg->head, msg->class,
-           msg->type, timebuffer, msg->hw_timestamp, guidbuffer);
+    start = line;
+  p = start;
+
+  p = put_uint(p, msg->head);
+  *p++ = ',';
+  p = put_uint(p, msg->class);
+  *p++ = ',';
+  p = put_uint(p, msg->type);
+  *p++ = ',';
+  *p++ = '0';
+  *p++ = ',';
+  p = put_datetime(p, msg->timestamp);
+  *p++ = ',';
+  p = put_uint(p, msg->hw_timestamp);
+  *p++ = ',';
+  memcpy(p, prefix->text, prefix->length);
+  p += prefix->length;
+  p = put_hex8(p, msg->guid.guid[15]);
 
   for (i = 0; (i < msg->data_length) && (i < 8); i++) {
-    char temp[8];
-    snprintf(temp, 7, "%u,", msg->data[i]);
-    strncat(buffer, temp, buffer_size - 1);
+    *p++ = ',';
+    p = put_uint(p, msg->data[i]);
+  }
+  *p++ = '\r';
+  *p++ = '\n';
+  *p = 0;
+
+  n = p - start;
+  if (start == line) {
+    if (buffer_size == 0)
+      return 0;
+    if (n >= buffer_size)
+      n = buffer_size - 1;
+    memcpy(buffer, line, n);
+    buffer[n] = 0;
   }
-  buffer[strlen(buffer) - 1] = 0;
-  strncat(buffer, "\r\n", buffer_size);
+  return (int)n;
+}
+
+int print_vscp(const vscp_msg_t *msg, char *buffer, size_t buffer_size) {
+  vscp_guid_prefix_t prefix;
 
-  return strlen(buffer);
+  vscp_guid_prefix_set(&prefix, &(msg->guid));
+  return print_vscp_prefix(msg, &prefix, buffer, buffer_size);
 }
 
 // Parses 00:11:22:33:44:55:66:77:88:99:AA:BB:CC:DD:EE:FF like strings and
 // checks for errors
 // Individual octets have to be written in HEX and can be single or double char
 int vscp_strtoguid(const char *input, vscp_guid_t *guid) {
-  const char *ptr = input;
-  char temp[3];
-  vscp_guid_t local_guid;
-  unsigned int value;
-  int field = 0;
-
   if (input == NULL)
     return -1;
+  return parse_guid(input, input + strlen(input), guid);
+}
 
-  while (*ptr != 0) {
-    const char *seek = ptr;
-    char guard;
-
-    if (field > 15)
-      return -1;
-
-    while (*seek != ':' && *seek != 0)
-      seek++;
-
-    if ((seek - ptr) > 2)
-      return -1;
-
-    strncpy(temp, ptr, seek - ptr); /* no null terminator is copied */
-    temp[seek - ptr] = 0;           /* so we do it! */
-
-    if (sscanf(temp, "%X%c", &value, &guard) != 1)
-      return -1;
-
-    /* not really possible with only 2 chars but hey.. */
-    if (value > UINT8_MAX)
-      return -1;
-
-    local_guid.guid[field] = (uint8_t)value;
+int vscp_print_guid(char *buffer, size_t buffer_size, const vscp_guid_t *guid) {
+  char text[48];
+  char *p = text;
+  size_t n;
+  int i;
 
-    ptr = seek;
-    if (*ptr != 0)
-      ptr++;
-    field++;
+  for (i = 0; i < 16; i++) {
+    if (i > 0)
+      *p++ = ':';
+    p = put_hex8(p, guid->guid[i]);
   }
-  if (*ptr != 0 || field != 16)
-    return -1;
-  else {
-    *guid = local_guid;
-    return 0;
-  }
-}
+  n = p - text;
 
-int vscp_print_guid(char *buffer, size_t buffer_size, const vscp_guid_t *guid) {
-  return snprintf(
-      buffer, buffer_size, "%X:%X:%X:%X:%X:%X:%X:%X:%X:%X:%X:%X:%X:%X:%X:%X",
-      guid->guid[0], guid->guid[1], guid->guid[2], guid->guid[3], guid->guid[4],
-      guid->guid[5], guid->guid[6], guid->guid[7], guid->guid[8], guid->guid[9],
-      guid->guid[10], guid->guid[11], guid->guid[12], guid->guid[13],
-      guid->guid[14], guid->guid[15]);
+  /* same result as snprintf: truncate but return the full length */
+  if (buffer_size > 0) {
+    size_t copy = n < buffer_size ? n : buffer_size - 1;
+    memcpy(buffer, text, copy);
+    buffer[copy] = 0;
+  }
+  return (int)n;
 }
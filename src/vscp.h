@@ -24,6 +24,16 @@
 
 typedef struct vscp_guid { uint8_t guid[16]; } vscp_guid_t;
 
+// The first 15 bytes of a GUID rendered as "XX:" each, they don't change
+// while the last byte (the nickname) differs for every node
+typedef struct {
+  uint8_t length;
+  char text[45];
+} vscp_guid_prefix_t;
+
+// Longest line print_vscp() produces, including the terminator
+#define VSCP_TEXT_MAX 128
+
 typedef struct {
   uint8_t head;
   uint8_t type;
@@ -39,13 +49,39 @@ int vscp_strtoguid(const char * input, vscp_guid_t * guid);
 
 // parses "priority, class, type, GUID"
 int vscp_parse_filter(const char *input, canid_t *id, vscp_guid_t *my_guid);
+// Most CAN filters a single subscription compiles into
+#define VSCP_SUBSCRIPTION_MAX_FILTERS 16
+// parses "[!]priority,class,type,nickname" into CAN_RAW_FILTER id/mask pairs
+// matching it. Every field is a number, a range "low-high" or "*" for any,
+// fields left out match any. '!' inverts a subscription that compiles into a
+// single pair. Returns the number of pairs, -1 on a format error and -2 when
+// it takes more than 'max' pairs.
+int vscp_parse_subscription(const char *input, struct can_filter *filters,
+                            unsigned int max);
+// the CAN ids of the frames a subscription compiled by
+// vscp_parse_subscription() matches, when only its priority may be open.
+// Returns the number of ids, -1 when class, type or nickname are open or it
+// is inverted, -2 when there are more than 'max'.
+int vscp_subscription_ids(const struct can_filter *filters, unsigned int count,
+                          canid_t *ids, unsigned int max);
+// parses "YYYY-MM-DDTHH:MM:SS" in UTC or "<seconds>[.<fraction>]" since the
+// epoch into microseconds since the epoch
+int vscp_parse_time(const char *input, uint64_t *usec);
 // parses "head,class,type,obid,datetime,timestamp,GUID,data1,data2,data3.."
 int vscp_parse_msg(const char *input, vscp_msg_t *msg, vscp_guid_t *my_guid);
 void vscp_to_can(const vscp_msg_t *msg, struct can_frame *frame);
 
-int can_to_vscp(const struct can_frame *frame,
-                const struct timeval *hw_timestamp, vscp_msg_t *msg,
-                vscp_guid_t *guid);
+// Is this a frame that can be decoded? Returns 0 if so, -1 if not.
+int vscp_frame_check(const struct can_frame *frame);
+// Decode a frame received at 'timestamp' (microseconds since the epoch),
+// GUID[0..14] are taken from 'guid'. Returns -1 if it isn't a VSCP frame.
+int can_to_vscp(const struct can_frame *frame, uint64_t timestamp,
+                vscp_msg_t *msg, const vscp_guid_t *guid);
 int print_vscp(const vscp_msg_t *msg, char *buffer, size_t buffer_size);
+// Prepare the GUID prefix for print_vscp_prefix()
+void vscp_guid_prefix_set(vscp_guid_prefix_t *prefix, const vscp_guid_t *guid);
+// As print_vscp(), using the prepared prefix instead of GUID[0..14] of msg
+int print_vscp_prefix(const vscp_msg_t *msg, const vscp_guid_prefix_t *prefix,
+                      char *buffer, size_t buffer_size);
 int vscp_print_guid(char *buffer, size_t buffer_size, const vscp_guid_t *guid);
 #endif /* #ifndef _VSCP_H_ */
@@ -14,97 +14,153 @@
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
-#include <stdlib.h>
 #include <assert.h>
-#include <malloc.h>
-#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "vscp_buffer.h"
 
+#define CACHE_LINE 64
+
 typedef struct vscp_buffer_ctx {
-  vscp_msg_t *buffer;
-  unsigned int wr;
-  unsigned int rd;
-  unsigned int size;
-  pthread_mutex_t mutex;
+  vscp_buffer_entry_t *buffer;
+  unsigned int mask; /* size - 1 */
+  /* written by the writer only, on a cache line of its own so readers
+   * polling it don't share a line with anything else */
+  uint64_t wr __attribute__((aligned(CACHE_LINE))); /* next sequence number */
+  uint64_t claim; /* wr once the push in progress is done */
+  uint64_t first; /* sequence number of the first message ever pushed */
 } vscp_buffer_ctx_t;
 
+static unsigned int round_up_pow2(unsigned int size) {
+  unsigned int pow2 = 1;
+  while (pow2 < size)
+    pow2 <<= 1;
+  return pow2;
+}
+
 vscp_buffer_ctx_t *vscp_buffer_ctx_create(unsigned int size) {
-  vscp_buffer_ctx_t *ctx = malloc(sizeof(vscp_buffer_ctx_t));
+  return vscp_buffer_ctx_create_at(size, 0);
+}
+
+vscp_buffer_ctx_t *vscp_buffer_ctx_create_at(unsigned int size,
+                                             uint64_t first) {
+  assert(size > 0 && size <= (1u << 31));
+  vscp_buffer_ctx_t *ctx = aligned_alloc(CACHE_LINE, sizeof(vscp_buffer_ctx_t));
   if (ctx != NULL) {
-    ctx->wr = 0;
-    ctx->rd = 0;
-    ctx->size = size + 1;
-    ctx->buffer = calloc(size + 1, sizeof(vscp_msg_t));
-    pthread_mutex_init(&(ctx->mutex), NULL);
+    size = round_up_pow2(size);
+    ctx->wr = first;
+    ctx->claim = first;
+    ctx->first = first;
+    ctx->mask = size - 1;
+    /* aligned_alloc() wants a multiple of the alignment, small rings aren't */
+    ctx->buffer = aligned_alloc(
+        CACHE_LINE, (size * sizeof(vscp_buffer_entry_t) + CACHE_LINE - 1) &
+                        ~(size_t)(CACHE_LINE - 1));
+    if (ctx->buffer == NULL) {
+      free(ctx);
+      return NULL;
+    }
+    memset(ctx->buffer, 0, size * sizeof(vscp_buffer_entry_t));
   }
   return ctx;
 }
 
 void vscp_buffer_free(vscp_buffer_ctx_t *ctx) {
   assert(ctx != NULL);
+  unsigned int i;
+  for (i = 0; i <= ctx->mask; i++)
+    vscp_text_unref(ctx->buffer[i].text);
   free(ctx->buffer);
-  pthread_mutex_destroy(&(ctx->mutex));
   free(ctx);
 }
 
-static unsigned int next(vscp_buffer_ctx_t *ctx, unsigned int current) {
-  current++;
-  if (current >= ctx->size)
-    current = 0;
-  return current;
-}
-
-void vscp_buffer_push(vscp_buffer_ctx_t *ctx, vscp_msg_t *msg) {
+unsigned int vscp_buffer_size(vscp_buffer_ctx_t *ctx) {
   assert(ctx != NULL);
-  vscp_msg_t discard;
-
-  pthread_mutex_lock(&(ctx->mutex));
-
-  if (next(ctx, ctx->wr) == ctx->rd)
-    vscp_buffer_pop(ctx, &discard);
-
-  ctx->buffer[ctx->wr] = *msg;
-  ctx->wr = next(ctx, ctx->wr);
-
-  pthread_mutex_unlock(&(ctx->mutex));
+  return ctx->mask + 1;
+}
 
+void vscp_buffer_push(vscp_buffer_ctx_t *ctx,
+                      const vscp_buffer_entry_t *entry) {
+  vscp_buffer_push_bulk(ctx, entry, 1);
 }
 
-int vscp_buffer_pop(vscp_buffer_ctx_t *ctx, vscp_msg_t *msg) {
+void vscp_buffer_push_bulk(vscp_buffer_ctx_t *ctx,
+                           const vscp_buffer_entry_t *entries,
+                           unsigned int count) {
   assert(ctx != NULL);
-  int rv;
+  uint64_t wr = ctx->wr; /* only we write it */
+  unsigned int i;
 
-  pthread_mutex_lock(&(ctx->mutex));
+  /* tell readers which slots are about to change before touching them */
+  __atomic_store_n(&ctx->claim, wr + count, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
 
-  if (ctx->rd != ctx->wr) {
-    *msg = ctx->buffer[ctx->rd];
-    ctx->rd = next(ctx, ctx->rd);
-    rv = 0;
-  } else
-    rv = -1;
+  for (i = 0; i < count; i++, wr++) {
+    vscp_buffer_entry_t *slot = &ctx->buffer[wr & ctx->mask];
+    vscp_text_unref(slot->text);
+    *slot = entries[i];
+  }
+  /* publish the messages, readers load it with acquire */
+  __atomic_store_n(&ctx->wr, wr, __ATOMIC_RELEASE);
+}
 
-  pthread_mutex_unlock(&(ctx->mutex));
+uint64_t vscp_buffer_head(vscp_buffer_ctx_t *ctx) {
+  assert(ctx != NULL);
+  return __atomic_load_n(&ctx->wr, __ATOMIC_ACQUIRE);
+}
 
-  return rv;
+static inline uint64_t tail_of(vscp_buffer_ctx_t *ctx, uint64_t wr) {
+  return wr - ctx->first > ctx->mask ? wr - ctx->mask - 1 : ctx->first;
 }
 
-unsigned int vscp_buffer_used(vscp_buffer_ctx_t *ctx) {
+uint64_t vscp_buffer_tail(vscp_buffer_ctx_t *ctx) {
   assert(ctx != NULL);
-  if (ctx->wr >= ctx->rd)
-    return ctx->wr - ctx->rd;
-  else
-    return (ctx->wr + ctx->size) - ctx->rd;
+  return tail_of(ctx, vscp_buffer_head(ctx));
 }
 
-int vscp_buffer_flush(vscp_buffer_ctx_t *ctx) {
+uint64_t vscp_buffer_first(vscp_buffer_ctx_t *ctx) {
   assert(ctx != NULL);
+  return ctx->first;
+}
 
-  pthread_mutex_lock(&(ctx->mutex));
+int vscp_buffer_get(vscp_buffer_ctx_t *ctx, uint64_t seq,
+                    vscp_buffer_entry_t *entry) {
+  return vscp_buffer_get_bulk(ctx, seq, entry, 1) == 1 ? 0 : -1;
+}
 
-  ctx->rd = ctx->wr;
+unsigned int vscp_buffer_get_bulk(vscp_buffer_ctx_t *ctx, uint64_t seq,
+                                  vscp_buffer_entry_t *entries,
+                                  unsigned int count) {
+  assert(ctx != NULL);
+  uint64_t wr = vscp_buffer_head(ctx);
+  unsigned int i;
+
+  if (seq >= wr || seq < tail_of(ctx, wr))
+    return 0;
+  if (count > wr - seq)
+    count = wr - seq;
+  for (i = 0; i < count; i++)
+    entries[i] = ctx->buffer[(seq + i) & ctx->mask];
+
+  /* a writer in another thread may have lapped us while copying. Slots are
+   * overwritten oldest first, so if the first one is fine all of them are */
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (seq < tail_of(ctx, __atomic_load_n(&ctx->claim, __ATOMIC_RELAXED)))
+    return 0;
+  return count;
+}
 
-  pthread_mutex_unlock(&(ctx->mutex));
+int vscp_buffer_set_text(vscp_buffer_ctx_t *ctx, uint64_t seq,
+                         vscp_text_t *text) {
+  assert(ctx != NULL);
+  uint64_t wr = ctx->wr;
 
-  return 0;
+  if (seq < wr && seq >= tail_of(ctx, wr)) {
+    vscp_text_unref(ctx->buffer[seq & ctx->mask].text);
+    ctx->buffer[seq & ctx->mask].text = text;
+    return 0;
+  }
+  vscp_text_unref(text);
+  return -1;
 }
@@ -17,31 +17,77 @@
 #ifndef _VSCP_BUFFER_H_
 #define _VSCP_BUFFER_H_
 
-/* NON THREAD SAFE FIFO buffer for VSCP messages */
+/* Lock-free ring buffer for VSCP messages with a single writer, shared by
+ * several readers. Every message pushed gets a sequence number; readers keep
+ * their own position (a cursor) and read messages by sequence number. The
+ * size is a power of two. The writer never waits for readers: when the buffer
+ * is full, the oldest message is overwritten and readers that were still
+ * behind notice by their cursor falling below the tail. */
 
+#include <stdint.h>
 #include "vscp.h"
+#include "vscp_text.h"
 
 // Context to work with
 typedef struct vscp_buffer_ctx vscp_buffer_ctx_t;
 
-// Set up a context to hold 'size' messages
+// What is stored for every message. Only the frame is kept, it is decoded
+// with can_to_vscp() when a client actually retrieves it.
+typedef struct {
+  struct can_frame frame; // as received
+  uint64_t timestamp;     // reception time, microseconds since the epoch
+  const void *origin; // who sent it when generated locally, NULL from the bus
+  vscp_text_t *text;  // message rendered for the wire, NULL until needed
+} vscp_buffer_entry_t;
+
+// Set up a context to hold 'size' messages, rounded up to a power of two
 vscp_buffer_ctx_t *vscp_buffer_ctx_create(unsigned int size);
 
+// The same, numbering the messages from 'first' on instead of 0
+vscp_buffer_ctx_t *vscp_buffer_ctx_create_at(unsigned int size,
+                                             uint64_t first);
+
 // Destroy/free the context
 void vscp_buffer_free(vscp_buffer_ctx_t *ctx);
 
 // Add the message to the buffer. If the buffer was full, the oldest message
-// gets discarded silently.
-void vscp_buffer_push(vscp_buffer_ctx_t *ctx, vscp_msg_t *msg);
+// gets overwritten silently. The buffer takes over the reference to the text,
+// if any.
+void vscp_buffer_push(vscp_buffer_ctx_t *ctx, const vscp_buffer_entry_t *entry);
+
+// Add 'count' messages at once, as vscp_buffer_push() does for each
+void vscp_buffer_push_bulk(vscp_buffer_ctx_t *ctx,
+                           const vscp_buffer_entry_t *entries,
+                           unsigned int count);
+
+// Number of messages the buffer holds
+unsigned int vscp_buffer_size(vscp_buffer_ctx_t *ctx);
+
+// Sequence number the next pushed message will get
+uint64_t vscp_buffer_head(vscp_buffer_ctx_t *ctx);
+
+// Sequence number of the oldest message still in the buffer
+uint64_t vscp_buffer_tail(vscp_buffer_ctx_t *ctx);
+
+// Sequence number of the first message ever pushed
+uint64_t vscp_buffer_first(vscp_buffer_ctx_t *ctx);
 
-// Get the oldest message from the buffer. Returns 0 if there was one, -1 if the
-// buffer was empty.
-int vscp_buffer_pop(vscp_buffer_ctx_t *ctx, vscp_msg_t *msg);
+// Get the message with sequence number 'seq'. Returns 0 if it is still in
+// the buffer, -1 if it was overwritten already or not pushed yet. The text is
+// not referenced, it is valid until the message gets overwritten.
+int vscp_buffer_get(vscp_buffer_ctx_t *ctx, uint64_t seq,
+                    vscp_buffer_entry_t *entry);
 
-// Get the amount of messages in the buffer
-unsigned int vscp_buffer_used(vscp_buffer_ctx_t *ctx);
+// Get up to 'count' consecutive messages starting at 'seq'. Returns the
+// number of messages copied to 'entries', 0 if 'seq' is not in the buffer.
+unsigned int vscp_buffer_get_bulk(vscp_buffer_ctx_t *ctx, uint64_t seq,
+                                  vscp_buffer_entry_t *entries,
+                                  unsigned int count);
 
-// Empty the buffer
-int vscp_buffer_flush (vscp_buffer_ctx_t *ctx);
+// Attach the rendered text to message 'seq', the buffer takes over the
+// reference. Returns -1 (and drops the reference) if the message is gone.
+// Only to be used from the writer's thread, like the texts themselves.
+int vscp_buffer_set_text(vscp_buffer_ctx_t *ctx, uint64_t seq,
+                         vscp_text_t *text);
 
 #endif /* _VSCP_BUFFER_H_ */
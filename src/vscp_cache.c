@@ -0,0 +1,115 @@
+// uvscpd - Minimalist VSCP Daemon
+// Copyright (C) 2019 Maarten Zanders
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "vscp_cache.h"
+
+#define NONE UINT32_MAX
+/* class, type and nickname */
+#define EVENT_BITS 0x1FFFFFFU
+
+typedef struct vscp_cache {
+  unsigned int size;
+  unsigned int length;
+  unsigned long missed;
+  vscp_buffer_entry_t *entries; /* in the order first seen */
+  uint32_t *buckets; /* open addressing, index into entries or NONE */
+  uint32_t mask;     /* buckets - 1 */
+} vscp_cache_t;
+
+static uint32_t event_hash(const vscp_cache_t *cache, canid_t event) {
+  return (uint32_t)((event * 0x9E3779B1U) >> 7) & cache->mask;
+}
+
+vscp_cache_t *vscp_cache_create(unsigned int size) {
+  vscp_cache_t *cache;
+  uint32_t buckets = 1;
+
+  /* at most half full, for short probes */
+  while (buckets < 2 * size)
+    buckets <<= 1;
+
+  cache = calloc(1, sizeof(vscp_cache_t));
+  if (cache == NULL)
+    return NULL;
+  cache->entries = malloc(size * sizeof(vscp_buffer_entry_t));
+  cache->buckets = malloc(buckets * sizeof(uint32_t));
+  if (cache->entries == NULL || cache->buckets == NULL) {
+    vscp_cache_free(cache);
+    return NULL;
+  }
+  memset(cache->buckets, 0xFF, buckets * sizeof(uint32_t));
+  cache->size = size;
+  cache->mask = buckets - 1;
+  return cache;
+}
+
+void vscp_cache_free(vscp_cache_t *cache) {
+  free(cache->entries);
+  free(cache->buckets);
+  free(cache);
+}
+
+void vscp_cache_update(vscp_cache_t *cache, const vscp_buffer_entry_t *entries,
+                       unsigned int count) {
+  vscp_buffer_entry_t *entry;
+  canid_t event;
+  uint32_t i, b;
+
+  for (i = 0; i < count; i++) {
+    event = entries[i].frame.can_id & EVENT_BITS;
+    for (b = event_hash(cache, event); cache->buckets[b] != NONE;
+         b = (b + 1) & cache->mask)
+      if ((cache->entries[cache->buckets[b]].frame.can_id & EVENT_BITS) ==
+          event)
+        break;
+
+    if (cache->buckets[b] == NONE) {
+      if (cache->length == cache->size) {
+        cache->missed++;
+        continue;
+      }
+      cache->buckets[b] = cache->length++;
+    }
+    entry = &(cache->entries[cache->buckets[b]]);
+    entry->frame = entries[i].frame;
+    entry->timestamp = entries[i].timestamp;
+    entry->origin = NULL;
+    entry->text = NULL;
+  }
+}
+
+unsigned int vscp_cache_length(const vscp_cache_t *cache) {
+  return cache->length;
+}
+
+unsigned long vscp_cache_missed(const vscp_cache_t *cache) {
+  return cache->missed;
+}
+
+unsigned int vscp_cache_get(const vscp_cache_t *cache, unsigned int start,
+                            vscp_buffer_entry_t *entries, unsigned int count) {
+  if (start >= cache->length)
+    return 0;
+  if (count > cache->length - start)
+    count = cache->length - start;
+  memcpy(entries, &(cache->entries[start]),
+         count * sizeof(vscp_buffer_entry_t));
+  return count;
+}
@@ -0,0 +1,50 @@
+// uvscpd - Minimalist VSCP Daemon
+// Copyright (C) 2019 Maarten Zanders
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _VSCP_CACHE_H_
+#define _VSCP_CACHE_H_
+
+/* The latest message of every event seen, by VSCP class, type and nickname,
+ * for clients that want to know the state of the bus when they connect
+ * instead of waiting for every node to send again. Events are kept in the
+ * order they were first seen; once full, new events are not remembered. */
+
+#include "vscp_buffer.h"
+
+typedef struct vscp_cache vscp_cache_t;
+
+// Set up a cache for up to 'size' events. Returns NULL when out of memory.
+vscp_cache_t *vscp_cache_create(unsigned int size);
+
+void vscp_cache_free(vscp_cache_t *cache);
+
+// Remember 'count' messages as the latest of their events. Texts and origins
+// are not kept.
+void vscp_cache_update(vscp_cache_t *cache, const vscp_buffer_entry_t *entries,
+                       unsigned int count);
+
+// Number of events remembered
+unsigned int vscp_cache_length(const vscp_cache_t *cache);
+
+// Number of messages of events that didn't fit anymore
+unsigned long vscp_cache_missed(const vscp_cache_t *cache);
+
+// Copy up to 'count' events starting at the 'start'th one. Returns the number
+// copied to 'entries'.
+unsigned int vscp_cache_get(const vscp_cache_t *cache, unsigned int start,
+                            vscp_buffer_entry_t *entries, unsigned int count);
+
+#endif /* _VSCP_CACHE_H_ */
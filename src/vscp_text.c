@@ -0,0 +1,45 @@
+// uvscpd - Minimalist VSCP Daemon
+// Copyright (C) 2019 Maarten Zanders
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vscp_text.h"
+
+vscp_text_t *vscp_text_create(const char *data, size_t length) {
+  vscp_text_t *text = malloc(sizeof(vscp_text_t) + length);
+  if (text != NULL) {
+    text->refcount = 1;
+    text->length = length;
+    memcpy(text->data, data, length);
+  }
+  return text;
+}
+
+vscp_text_t *vscp_text_ref(vscp_text_t *text) {
+  assert(text != NULL);
+  text->refcount++;
+  return text;
+}
+
+void vscp_text_unref(vscp_text_t *text) {
+  if (text == NULL)
+    return;
+  assert(text->refcount > 0);
+  if (--text->refcount == 0)
+    free(text);
+}
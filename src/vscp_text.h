@@ -0,0 +1,41 @@
+// uvscpd - Minimalist VSCP Daemon
+// Copyright (C) 2019 Maarten Zanders
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef _VSCP_TEXT_H_
+#define _VSCP_TEXT_H_
+
+/* Reference counted, immutable text as it goes out on the wire. A message is
+ * rendered once and the same bytes are written to every client. */
+
+#include <stddef.h>
+
+typedef struct vscp_text {
+  unsigned int refcount;
+  unsigned int length;
+  char data[];
+} vscp_text_t;
+
+// Create a text holding a copy of 'data', with a reference count of 1.
+// Returns NULL when out of memory.
+vscp_text_t *vscp_text_create(const char *data, size_t length);
+
+// Take an extra reference
+vscp_text_t *vscp_text_ref(vscp_text_t *text);
+
+// Drop a reference, the text is freed when the last one is gone
+void vscp_text_unref(vscp_text_t *text);
+
+#endif /* _VSCP_TEXT_H_ */